@@ -0,0 +1,153 @@
+/*	Recursive mode and owner changes, shared by chmod and chown.
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+#ifndef _ATTRWALK_H
+#define _ATTRWALK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined AT_SYMLINK_NOFOLLOW && !defined _WIN32
+#define ATTR_WALK
+
+/*
+ * Every file is looked at with fstatat(2) relative to its directory, and
+ * fchmodat(2)/fchownat(2) are only called when the mode or owner actually
+ * differ, so a tree that is already right is walked without dirtying any
+ * inode. Below the starting point symbolic links are not followed; chown
+ * changes the links themselves and chmod leaves them alone.
+ */
+
+struct attr_change {
+	const char *verb;		/* for messages */
+	mode_t mode;			/* (mode_t)-1 to keep */
+	uid_t uid;			/* (uid_t)-1 to keep */
+	gid_t gid;			/* (gid_t)-1 to keep */
+	unsigned long int changed, skipped;
+};
+
+struct attr_frame {
+	DIR *dir;
+	size_t path_len;
+	struct attr_frame *up;
+};
+
+/* Puts name after the first len bytes of the path buffer, returns the new length */
+static size_t attr_path_set(char **buf, size_t *size, size_t len, const char *name) {
+	size_t name_len = strlen(name);
+	size_t need = len + 1 + name_len + 1;
+	if(need > *size) {
+		size_t new_size = *size ? *size : 256;
+		while(new_size < need) new_size *= 2;
+		if(!(*buf = realloc(*buf, new_size))) abort();
+		*size = new_size;
+	}
+	if(len) (*buf)[len++] = '/';
+	memcpy(*buf + len, name, name_len + 1);
+	return len + name_len;
+}
+
+static int attr_apply(int dirfd, const char *name, const char *path, int at_flags, struct attr_change *c, struct stat *st) {
+	int need_mode, need_owner;
+	if(fstatat(dirfd, name, st, at_flags) < 0) {
+		fprintf(stderr, "Unable to %s %s: %s\n", c->verb, path, strerror(errno));
+		return -1;
+	}
+	need_mode = c->mode != (mode_t)-1 && !S_ISLNK(st->st_mode) &&
+		(st->st_mode & 07777) != c->mode;
+	need_owner = (c->uid != (uid_t)-1 && st->st_uid != c->uid) ||
+		(c->gid != (gid_t)-1 && st->st_gid != c->gid);
+	if(!need_mode && !need_owner) {
+		c->skipped++;
+		return 0;
+	}
+	// Owner first, a change of owner may clear the set-ID bits
+	if((need_owner && fchownat(dirfd, name, c->uid, c->gid, at_flags) < 0) ||
+	(need_mode && fchmodat(dirfd, name, c->mode, 0) < 0)) {
+		fprintf(stderr, "Unable to %s %s: %s\n", c->verb, path, strerror(errno));
+		return -1;
+	}
+	c->changed++;
+	return 0;
+}
+
+/* Applies the change to path, and to everything under it if recursive is
+ * set; returns -1 if anything failed */
+static int attr_walk(const char *path, struct attr_change *c, int recursive) {
+	struct attr_frame *top = NULL;
+	char *buf = NULL;
+	size_t size = 0;
+	struct stat st;
+	int r = 0;
+	int fd;
+	DIR *d;
+
+	if(attr_apply(AT_FDCWD, path, path, 0, c, &st) < 0) return -1;
+	if(!recursive || !S_ISDIR(st.st_mode)) return 0;
+
+	attr_path_set(&buf, &size, 0, path);
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	if(fd < 0 || !(d = fdopendir(fd))) {
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		if(fd >= 0) close(fd);
+		free(buf);
+		return -1;
+	}
+	while(1) {
+		struct attr_frame *frame = malloc(sizeof *frame);
+		struct dirent *de;
+		if(!frame) abort();
+		frame->dir = d;
+		frame->path_len = strlen(buf);
+		frame->up = top;
+		top = frame;
+		do {
+			errno = 0;
+			if(!(de = readdir(top->dir))) {
+				buf[top->path_len] = 0;
+				if(errno) {
+					fprintf(stderr, "Unable to read %s: %s\n", buf, strerror(errno));
+					r = -1;
+				}
+				frame = top;
+				top = frame->up;
+				closedir(frame->dir);
+				free(frame);
+				continue;
+			}
+			if(de->d_name[0] == '.' && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2]))) continue;
+			attr_path_set(&buf, &size, top->path_len, de->d_name);
+			if(attr_apply(dirfd(top->dir), de->d_name, buf, AT_SYMLINK_NOFOLLOW, c, &st) < 0) {
+				r = -1;
+				continue;
+			}
+			if(!S_ISDIR(st.st_mode)) continue;
+			fd = openat(dirfd(top->dir), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if(fd < 0 || !(d = fdopendir(fd))) {
+				fprintf(stderr, "Unable to open %s: %s\n", buf, strerror(errno));
+				if(fd >= 0) close(fd);
+				r = -1;
+				continue;
+			}
+			break;
+		} while(top);
+		if(!top) break;
+	}
+	free(buf);
+	return r;
+}
+
+#endif
+
+#endif
@@ -15,9 +15,11 @@
 #include <limits.h>
 #include <sys/stat.h>
 #include "str2mode.h"
+#include "attrwalk.h"
 #include <unistd.h>
 #include <time.h>
 
+#ifndef ATTR_WALK
 static int recurse_chmod(const char *path, int mode) {
 	struct dirent *dp;
 	DIR *dir = opendir(path);
@@ -51,37 +53,53 @@ static int recurse_chmod(const char *path, int mode) {
 	closedir(dir);
 	return r;
 }
+#endif
 
 static void usage() {
 	fprintf(stderr, "Usage: chmod"
 #if defined _WIN32 && !defined _WINDOWSNT_NATIVE
 			".exe"
 #endif
-			" [<option>] <mode> <file>\n");
+			" [<option>] <mode> <file> [...]\n");
 	fprintf(stderr, "  -R, --recursive         change files and directories recursively\n");
+#ifdef ATTR_WALK
+	fprintf(stderr, "  -v, --verbose           report how many files were changed\n");
+#endif
 	fprintf(stderr, "  --help                  display this help and exit\n");
 }
 
 int chmod_main(int argc, char **argv) {
 	int i;
+	int recursive = 0;
+#ifdef ATTR_WALK
+	int verbose = 0;
+#endif
 
-	if(argc < 3 || strcmp(argv[1], "--help") == 0) {
-		usage();
-		return -1;
+	for(i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if(strcmp(argv[i], "--help") == 0) {
+			usage();
+			return -1;
+		}
+		if(strcmp(argv[i], "-R") == 0 || strcmp(argv[i], "--recursive") == 0) recursive = 1;
+#ifdef ATTR_WALK
+		else if(strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) verbose = 1;
+#endif
+		else if(strcmp(argv[i], "--") == 0) {
+			i++;
+			break;
+		} else {
+			fprintf(stderr, "chmod: Invalid option '%s'\n", argv[i]);
+			usage();
+			return 10;
+		}
 	}
 
-	int recursive = (strcmp(argv[1], "-R") == 0 ||
-			strcmp(argv[1], "--recursive") == 0) ? 1 : 0;
-
-	if(recursive && argc < 4) {
+	if(argc - i < 2) {
 		usage();
 		return 10;
 	}
-
-	if(recursive) {
-		argc--;
-		argv++;
-	}
+	argc -= i - 1;
+	argv += i - 1;
 
 	mode_t mode = STR2MODE(argv[1]);
 	if(mode == (mode_t)-1) {
@@ -90,6 +108,15 @@ int chmod_main(int argc, char **argv) {
 	}
 
 	int r = 0;
+#ifdef ATTR_WALK
+	struct attr_change change = { "chmod", mode, (uid_t)-1, (gid_t)-1, 0, 0 };
+	for(i = 2; i < argc; i++) {
+		if(attr_walk(argv[i], &change, recursive) < 0) r = 1;
+	}
+	if(verbose) {
+		printf("chmod: %lu changed, %lu already right\n", change.changed, change.skipped);
+	}
+#else
 	for(i = 2; i < argc; i++) {
 		if(chmod(argv[i], mode) < 0) {
 			fprintf(stderr, "Unable to chmod %s: %s\n", argv[i], strerror(errno));
@@ -99,5 +126,6 @@ int chmod_main(int argc, char **argv) {
 			r = 1;
 		}
 	}
+#endif
 	return r;
 }
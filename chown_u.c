@@ -9,12 +9,40 @@
 
 #include <unistd.h>
 #include <time.h>
+#include "attrwalk.h"
+
+#ifdef ATTR_WALK
+#define USAGE "Usage: chown [-R] [-v] <user>[:<group>] <file> [...]\n"
+#else
+#define USAGE "Usage: chown <user>[:<group>] <file> [...]\n"
+#endif
 
 int chown_main(int argc, char **argv) {
     int i;
+#ifdef ATTR_WALK
+    int recursive = 0, verbose = 0;
+
+    while(1) {
+        int c = getopt(argc, argv, "Rv");
+        if(c == -1) break;
+        switch(c) {
+            case 'R':
+                recursive = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                fprintf(stderr, USAGE);
+                return 10;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+#endif
 
     if(argc < 3) {
-        fprintf(stderr, "Usage: chown <user>[:<group>] <file> [...]\n");
+        fprintf(stderr, USAGE);
         return 10;
     }
 
@@ -61,6 +89,20 @@ int chown_main(int argc, char **argv) {
         }
     }
 
+#ifdef ATTR_WALK
+    struct attr_change change = { "chown", (mode_t)-1, uid, gid, 0, 0 };
+    int r = 0;
+    for(i = 2; i < argc; i++) {
+        if(attr_walk(argv[i], &change, recursive) < 0) {
+            if(!recursive) return 10;
+            r = 10;
+        }
+    }
+    if(verbose) {
+        printf("chown: %lu changed, %lu already right\n", change.changed, change.skipped);
+    }
+    return r;
+#else
     for(i = 2; i < argc; i++) {
         if(chown(argv[i], uid, gid) < 0) {
             fprintf(stderr, "Unable to chown %s: %s\n", argv[i], strerror(errno));
@@ -69,4 +111,5 @@ int chown_main(int argc, char **argv) {
     }
 
     return 0;
+#endif
 }
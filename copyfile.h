@@ -0,0 +1,770 @@
+/*	File and tree copying, shared by the tools that copy data.
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+#ifndef _COPYFILE_H
+#define _COPYFILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#if defined AT_SYMLINK_NOFOLLOW && !defined _WIN32
+#define COPY_TREE
+
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+#endif
+
+/*
+ * A source is copied by a pool of threads working on a shared stack of
+ * entries; copying a directory creates it and pushes its entries, so
+ * independent files and subtrees are copied in parallel. A directory's
+ * own attributes are applied once every entry under it is done, so the
+ * copied times survive. Everything below the source is reached relative
+ * to open directory fds; a listing is read whole and closed before its
+ * entries are copied, and past COPY_MAX_OPEN_DIRS the least recently used
+ * directories are closed and later reopened by path, so the depth of a
+ * tree is not limited by the number of open files.
+ *
+ * File data is cloned with FICLONE where the filesystem can share extents,
+ * otherwise moved with copy_file_range(2), and otherwise read and written.
+ * Sparse files are copied one data segment at a time, found with
+ * SEEK_DATA/SEEK_HOLE, so their holes stay holes.
+ */
+
+#define COPY_MODE 1
+#define COPY_OWNER 2
+#define COPY_TIMES 4
+#define COPY_XATTR 8
+#define COPY_LINKS 16			/* keep hard links within a copy linked */
+#define COPY_ALL (COPY_MODE | COPY_OWNER | COPY_TIMES | COPY_XATTR | COPY_LINKS)
+
+#define COPY_MAX_THREADS 64
+#define COPY_CHUNK_SIZE (16 << 20)	/* per copy_file_range(2) call */
+#define COPY_BUF_SIZE (128 * 1024)
+#define COPY_LINK_BUCKETS 1024
+#define COPY_MAX_OPEN_DIRS 128
+
+struct copy_options {
+	const char *prog;		/* for messages */
+	int preserve;			/* COPY_* */
+	int threads;			/* besides the calling one */
+	int progress;			/* report on stderr */
+	int follow_root;		/* copy what a symbolic link given as the source points to */
+};
+
+struct copy_dir {
+	int src_fd, dst_fd;		/* -1 while closed */
+	char *src_path, *dst_path;
+	struct stat st;
+	dev_t dst_dev;			/* to check a reopened copy */
+	ino_t dst_ino;
+	int refs;			/* unfinished entries, plus one while listing */
+	int users;			/* entries using the fds right now */
+	int created;
+	struct copy_dir *parent;
+	struct copy_dir *newer, *older;	/* among the open ones */
+};
+
+struct copy_task {
+	struct copy_dir *dir;		/* NULL for the source itself */
+	const char *dst_name;
+	struct copy_task *next;
+	char name[];
+};
+
+struct copy_link {
+	dev_t dev;
+	ino_t ino;
+	char *dst_path;			/* of the first copy */
+	int state;			/* 0 copying, 1 done, -1 failed */
+	struct copy_link *next;
+};
+
+static const struct copy_options *copy_opts;
+static pthread_mutex_t copy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t copy_cond = PTHREAD_COND_INITIALIZER;
+static struct copy_task *copy_stack;
+static int copy_busy;			/* tasks queued or running */
+static int copy_failed;
+static struct copy_link *copy_links[COPY_LINK_BUCKETS];
+static unsigned long long int copied_bytes, copied_files;
+static struct timeval copy_start, copy_next_report;
+static mode_t copy_umask;
+static struct copy_dir *copy_newest, *copy_oldest;
+static int copy_open_dirs, copy_open_limit;
+static dev_t copy_root_dev;		/* the destination directory, never to be copied into itself */
+static ino_t copy_root_ino;
+
+static void copy_error(const char *path, int e) {
+	fprintf(stderr, "%s: %s: %s\n", copy_opts->prog, path, strerror(e));
+}
+
+static char *copy_join(const char *dir, const char *name) {
+	size_t len = strlen(dir);
+	char *path = malloc(len + 1 + strlen(name) + 1);
+	if(!path) abort();
+	memcpy(path, dir, len);
+	path[len] = '/';
+	strcpy(path + len + 1, name);
+	return path;
+}
+
+static double copy_elapsed(const struct timeval *now) {
+	return (now->tv_sec - copy_start.tv_sec) + (now->tv_usec - copy_start.tv_usec) / 1000000.0;
+}
+
+static void copy_report(const struct timeval *now, int final) {
+	double t = copy_elapsed(now);
+	fprintf(stderr, "\r%s: %llu files, %.1f MiB, %.1f MiB/s%s", copy_opts->prog,
+		copied_files, copied_bytes / 1048576.0, t > 0 ? copied_bytes / 1048576.0 / t : 0.0,
+		final ? "\n" : "");
+}
+
+/* Accounts for copied data, reporting at most once a second */
+static void copy_progress(unsigned long long int bytes, int files) {
+	struct timeval now;
+	pthread_mutex_lock(&copy_lock);
+	copied_bytes += bytes;
+	copied_files += files;
+	if(copy_opts->progress) {
+		gettimeofday(&now, NULL);
+		if(timercmp(&now, &copy_next_report, >)) {
+			copy_report(&now, 0);
+			copy_next_report = now;
+			copy_next_report.tv_sec++;
+		}
+	}
+	pthread_mutex_unlock(&copy_lock);
+}
+
+static void copy_times(const struct stat *st, struct timespec *ts) {
+	ts[0].tv_sec = st->st_atime;
+	ts[1].tv_sec = st->st_mtime;
+#ifdef __linux__
+	ts[0].tv_nsec = st->st_atim.tv_nsec;
+	ts[1].tv_nsec = st->st_mtim.tv_nsec;
+#else
+	ts[0].tv_nsec = ts[1].tv_nsec = 0;
+#endif
+}
+
+#ifdef __linux__
+static void copy_xattrs(int in, int out, const char *path) {
+	char *names, *name, *value = NULL;
+	ssize_t len, value_size = 0;
+	len = flistxattr(in, NULL, 0);
+	if(len <= 0) return;
+	if(!(names = malloc(len))) abort();
+	len = flistxattr(in, names, len);
+	for(name = names; len > 0 && name < names + len; name += strlen(name) + 1) {
+		ssize_t s = fgetxattr(in, name, NULL, 0);
+		if(s < 0) continue;
+		if(s > value_size) {
+			if(!(value = realloc(value, s))) abort();
+			value_size = s;
+		}
+		s = fgetxattr(in, name, value, s);
+		if(s < 0) continue;
+		if(fsetxattr(out, name, value, s, 0) < 0) {
+			// Nothing to say if the destination can't store them at all
+			if(errno != ENOTSUP) copy_error(path, errno);
+			if(errno == ENOTSUP || errno == ENOSPC) break;
+		}
+	}
+	free(value);
+	free(names);
+}
+#endif
+
+/* Applies the attributes of st to an open copy */
+static int copy_attrs_fd(int in, int out, const struct stat *st, const char *path) {
+	int preserve = copy_opts->preserve;
+	mode_t mode = st->st_mode & 07777;
+	struct timespec ts[2];
+	if(preserve & COPY_OWNER && fchown(out, st->st_uid, st->st_gid) < 0) {
+		// Only the superuser may give files away; the set-ID bits must not outlive the owner
+		if(errno != EPERM) {
+			copy_error(path, errno);
+			return -1;
+		}
+		mode &= ~(S_ISUID | S_ISGID);
+	}
+#ifdef __linux__
+	if(preserve & COPY_XATTR && in >= 0) copy_xattrs(in, out, path);
+#endif
+	if(preserve & COPY_MODE && fchmod(out, mode) < 0) {
+		copy_error(path, errno);
+		return -1;
+	}
+	copy_times(st, ts);
+	if(preserve & COPY_TIMES && futimens(out, ts) < 0) {
+		copy_error(path, errno);
+		return -1;
+	}
+	return 0;
+}
+
+/* Same for entries that can't be opened, such as symbolic links and devices */
+static int copy_attrs_at(int dirfd, const char *name, const struct stat *st, const char *path) {
+	int preserve = copy_opts->preserve;
+	mode_t mode = st->st_mode & 07777;
+	struct timespec ts[2];
+	if(preserve & COPY_OWNER && fchownat(dirfd, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW) < 0) {
+		if(errno != EPERM) {
+			copy_error(path, errno);
+			return -1;
+		}
+		mode &= ~(S_ISUID | S_ISGID);
+	}
+	if(preserve & COPY_MODE && !S_ISLNK(st->st_mode) && fchmodat(dirfd, name, mode, 0) < 0) {
+		copy_error(path, errno);
+		return -1;
+	}
+	copy_times(st, ts);
+	if(preserve & COPY_TIMES && utimensat(dirfd, name, ts, AT_SYMLINK_NOFOLLOW) < 0) {
+		copy_error(path, errno);
+		return -1;
+	}
+	return 0;
+}
+
+/* Copies len bytes at off, or up to the end of the file if len is negative;
+ * returns the bytes copied, or -1 */
+static off_t copy_range(int in, int out, off_t off, off_t len, char **buf) {
+	off_t done = 0;
+#ifdef __NR_copy_file_range
+	while(len > done) {
+		loff_t in_off = off + done, out_off = off + done;
+		size_t n = len - done > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : len - done;
+		ssize_t s = syscall(__NR_copy_file_range, in, &in_off, out, &out_off, n, 0);
+		if(s < 0) {
+			if(errno == EINTR) continue;
+			// Not between these files, do it by hand
+			if(errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP || errno == EBADF) break;
+			return -1;
+		}
+		if(!s) return done;
+		done += s;
+		copy_progress(s, 0);
+	}
+#endif
+	if(!*buf && !(*buf = malloc(COPY_BUF_SIZE))) abort();
+	while(len < 0 || len > done) {
+		size_t n = len < 0 || len - done > COPY_BUF_SIZE ? COPY_BUF_SIZE : len - done;
+		ssize_t s = pread(in, *buf, n, off + done);
+		ssize_t w = 0;
+		if(s < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		if(!s) break;
+		while(w < s) {
+			ssize_t r = pwrite(out, *buf + w, s - w, off + done + w);
+			if(r < 0) {
+				if(errno == EINTR) continue;
+				return -1;
+			}
+			w += r;
+		}
+		done += s;
+		copy_progress(s, 0);
+	}
+	return done;
+}
+
+static int copy_data(int in, int out, const struct stat *st, char **buf) {
+	off_t end = 0;
+#ifdef FICLONE
+	if(st->st_size && ioctl(out, FICLONE, in) == 0) {
+		copy_progress(st->st_size, 0);
+		return 0;
+	}
+#endif
+#ifdef SEEK_DATA
+	if((off_t)st->st_blocks * 512 < st->st_size) {
+		while(end < st->st_size) {
+			off_t data = lseek(in, end, SEEK_DATA);
+			off_t hole;
+			if(data < 0) break;
+			hole = lseek(in, data, SEEK_HOLE);
+			if(hole < 0) return -1;
+			if(copy_range(in, out, data, hole - data, buf) < 0) return -1;
+			end = hole;
+		}
+		// Past the last data segment the rest is a hole too
+		if(end >= st->st_size || errno == ENXIO) return ftruncate(out, st->st_size);
+	}
+#endif
+	if(copy_range(in, out, end, st->st_size - end, buf) < 0) return -1;
+	// Whatever the file grew by, and pseudo files that report no size
+	return copy_range(in, out, st->st_size, -1, buf) < 0 ? -1 : 0;
+}
+
+static int copy_regular(int src_fd, const char *name, int nofollow, int dst_fd, const char *dst_name, const struct stat *st, const char *path, const char *dst_path, char **buf) {
+	mode_t mode = copy_opts->preserve & COPY_MODE ? 0600 : st->st_mode & 0777;
+	struct stat dst_st;
+	int in, out, r;
+	in = openat(src_fd, name, O_RDONLY | nofollow);
+	if(in < 0) {
+		copy_error(path, errno);
+		return -1;
+	}
+	// Truncating it would lose the source
+	if(fstatat(dst_fd, dst_name, &dst_st, 0) == 0 && dst_st.st_dev == st->st_dev && dst_st.st_ino == st->st_ino) {
+		fprintf(stderr, "%s: '%s' and '%s' are the same file\n", copy_opts->prog, path, dst_path);
+		close(in);
+		return -1;
+	}
+	out = openat(dst_fd, dst_name, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	if(out < 0) {
+		copy_error(dst_path, errno);
+		close(in);
+		return -1;
+	}
+	r = copy_data(in, out, st, buf);
+	if(r < 0) copy_error(dst_path, errno);
+	else r = copy_attrs_fd(in, out, st, dst_path);
+	close(in);
+	if(close(out) < 0 && !r) {
+		copy_error(dst_path, errno);
+		r = -1;
+	}
+	return r;
+}
+
+/* Returns 1 if the destination was linked to an earlier copy of the same
+ * file, 0 if the file must be copied; link is set if this is the first copy */
+static int copy_hard_link(struct copy_link **link, const struct stat *st, int dst_fd, const char *dst_name, const char *dst_path) {
+	struct copy_link *l;
+	size_t i = ((size_t)st->st_ino ^ (size_t)st->st_dev * 31) % COPY_LINK_BUCKETS;
+	*link = NULL;
+	pthread_mutex_lock(&copy_lock);
+	for(l = copy_links[i]; l; l = l->next) {
+		if(l->ino == st->st_ino && l->dev == st->st_dev) break;
+	}
+	if(!l) {
+		if(!(l = malloc(sizeof *l)) || !(l->dst_path = strdup(dst_path))) abort();
+		l->dev = st->st_dev;
+		l->ino = st->st_ino;
+		l->state = 0;
+		l->next = copy_links[i];
+		copy_links[i] = l;
+		pthread_mutex_unlock(&copy_lock);
+		*link = l;
+		return 0;
+	}
+	// The first copy is still being made
+	while(!l->state) pthread_cond_wait(&copy_cond, &copy_lock);
+	pthread_mutex_unlock(&copy_lock);
+	if(l->state < 0) return 0;
+	if(linkat(AT_FDCWD, l->dst_path, dst_fd, dst_name, 0) == 0) return 1;
+	if(errno == EEXIST && unlinkat(dst_fd, dst_name, 0) == 0 &&
+	linkat(AT_FDCWD, l->dst_path, dst_fd, dst_name, 0) == 0) return 1;
+	// Across a long path or some other trouble, a separate copy will do
+	return 0;
+}
+
+static void copy_push(struct copy_task *first, struct copy_task *last, int count) {
+	pthread_mutex_lock(&copy_lock);
+	last->next = copy_stack;
+	copy_stack = first;
+	copy_busy += count;
+	pthread_cond_broadcast(&copy_cond);
+	pthread_mutex_unlock(&copy_lock);
+}
+
+/* Opens a directory by a path that may be longer than PATH_MAX, checking
+ * that it is still the one expected */
+static int copy_open_path(const char *path, dev_t dev, ino_t ino) {
+	char piece[PATH_MAX];
+	struct stat st;
+	int at = AT_FDCWD, fd;
+	while(strlen(path) >= PATH_MAX) {
+		const char *slash = path + PATH_MAX - 1;
+		size_t len;
+		while(slash > path && *slash != '/') slash--;
+		if(slash == path && *path != '/') {
+			if(at != AT_FDCWD) close(at);
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		len = slash == path ? 1 : slash - path;
+		memcpy(piece, path, len);
+		piece[len] = 0;
+		fd = openat(at, piece, O_RDONLY | O_DIRECTORY);
+		if(at != AT_FDCWD) close(at);
+		if(fd < 0) return -1;
+		at = fd;
+		path = slash + 1;
+	}
+	fd = openat(at, path, O_RDONLY | O_DIRECTORY);
+	if(at != AT_FDCWD) close(at);
+	if(fd < 0) return -1;
+	if(fstat(fd, &st) < 0 || st.st_dev != dev || st.st_ino != ino) {
+		// Something moved the tree under us
+		close(fd);
+		errno = ESTALE;
+		return -1;
+	}
+	return fd;
+}
+
+/* Called with copy_lock held */
+static void copy_dir_close(struct copy_dir *dir) {
+	close(dir->src_fd);
+	close(dir->dst_fd);
+	dir->src_fd = dir->dst_fd = -1;
+	if(dir->newer) dir->newer->older = dir->older;
+	else copy_newest = dir->older;
+	if(dir->older) dir->older->newer = dir->newer;
+	else copy_oldest = dir->newer;
+	copy_open_dirs--;
+}
+
+/* Called with copy_lock held; makes the open directory the most recently used */
+static void copy_dir_touch(struct copy_dir *dir, int opened) {
+	if(opened) copy_open_dirs++;
+	else if(dir == copy_newest) return;
+	else {
+		dir->newer->older = dir->older;
+		if(dir->older) dir->older->newer = dir->newer;
+		else copy_oldest = dir->newer;
+	}
+	dir->newer = NULL;
+	dir->older = copy_newest;
+	if(copy_newest) copy_newest->newer = dir;
+	else copy_oldest = dir;
+	copy_newest = dir;
+	// Close the least recently used ones that no entry is working in
+	for(dir = copy_oldest; dir && copy_open_dirs > copy_open_limit; ) {
+		struct copy_dir *newer = dir->newer;
+		if(!dir->users) copy_dir_close(dir);
+		dir = newer;
+	}
+}
+
+/* Opens the directory again if it was closed, and keeps it open until
+ * copy_dir_put */
+static int copy_dir_get(struct copy_dir *dir) {
+	int e = 0;
+	pthread_mutex_lock(&copy_lock);
+	if(dir->src_fd < 0) {
+		dir->src_fd = copy_open_path(dir->src_path, dir->st.st_dev, dir->st.st_ino);
+		if(dir->src_fd < 0) e = errno;
+		else if((dir->dst_fd = copy_open_path(dir->dst_path, dir->dst_dev, dir->dst_ino)) < 0) {
+			e = errno;
+			close(dir->src_fd);
+			dir->src_fd = -1;
+		}
+		if(!e) copy_dir_touch(dir, 1);
+	} else copy_dir_touch(dir, 0);
+	if(!e) dir->users++;
+	pthread_mutex_unlock(&copy_lock);
+	errno = e;
+	return e ? -1 : 0;
+}
+
+static void copy_dir_put(struct copy_dir *dir) {
+	pthread_mutex_lock(&copy_lock);
+	dir->users--;
+	pthread_mutex_unlock(&copy_lock);
+}
+
+/* Drops a reference to the directory, finishing it with its attributes
+ * once the last entry is done */
+static void copy_release(struct copy_dir *dir) {
+	while(dir) {
+		struct copy_dir *parent = dir->parent;
+		int refs;
+		pthread_mutex_lock(&copy_lock);
+		refs = --dir->refs;
+		pthread_mutex_unlock(&copy_lock);
+		if(refs) return;
+		if(copy_dir_get(dir) < 0) {
+			copy_error(dir->dst_path, errno);
+			pthread_mutex_lock(&copy_lock);
+			copy_failed = 1;
+			pthread_mutex_unlock(&copy_lock);
+		} else {
+			int r;
+			// It was created accessible to us whatever the source said
+			if(!(copy_opts->preserve & COPY_MODE) && dir->created && (dir->st.st_mode & 0700) != 0700) {
+				fchmod(dir->dst_fd, dir->st.st_mode & 0777 & ~copy_umask);
+			}
+			r = copy_attrs_fd(dir->src_fd, dir->dst_fd, &dir->st, dir->dst_path);
+			pthread_mutex_lock(&copy_lock);
+			if(r < 0) copy_failed = 1;
+			copy_dir_close(dir);
+			pthread_mutex_unlock(&copy_lock);
+		}
+		free(dir->src_path);
+		free(dir->dst_path);
+		free(dir);
+		dir = parent;
+	}
+}
+
+static int copy_directory(struct copy_dir *parent, int src_fd, const char *name, int dst_fd, const char *dst_name, const struct stat *st, const char *path, const char *dst_path) {
+	struct copy_task *first = NULL, *last = NULL;
+	struct copy_dir *dir;
+	int count = 0;
+	DIR *d;
+	struct dirent *de;
+	struct stat dst_st;
+	int in, out, fd = 0, e, created = 1;
+
+	if(mkdirat(dst_fd, dst_name, copy_opts->preserve & COPY_MODE ? 0700 : (st->st_mode & 0777) | 0700) < 0) {
+		if(errno != EEXIST || fstatat(dst_fd, dst_name, &dst_st, 0) < 0 || !S_ISDIR(dst_st.st_mode)) {
+			copy_error(dst_path, errno == EEXIST ? ENOTDIR : errno);
+			return -1;
+		}
+		created = 0;
+	}
+	in = openat(src_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if(in < 0) {
+		copy_error(path, errno);
+		return -1;
+	}
+	out = openat(dst_fd, dst_name, O_RDONLY | O_DIRECTORY);
+	if(out < 0) {
+		copy_error(dst_path, errno);
+		close(in);
+		return -1;
+	}
+	// The listing gets its own fd, closed once it has been read
+	if(fstat(out, &dst_st) < 0 || (fd = dup(in)) < 0) {
+		copy_error(fd < 0 ? path : dst_path, errno);
+		close(in);
+		close(out);
+		return -1;
+	}
+	if(!(d = fdopendir(fd))) abort();
+	if(!parent) {
+		copy_root_dev = dst_st.st_dev;
+		copy_root_ino = dst_st.st_ino;
+	}
+	if(!(dir = malloc(sizeof *dir))) abort();
+	dir->src_fd = in;
+	dir->dst_fd = out;
+	if(!(dir->src_path = strdup(path)) || !(dir->dst_path = strdup(dst_path))) abort();
+	dir->st = *st;
+	dir->dst_dev = dst_st.st_dev;
+	dir->dst_ino = dst_st.st_ino;
+	dir->refs = 1;
+	dir->users = 0;
+	dir->created = created;
+	dir->parent = parent;
+	if(parent) {
+		// The entries of this directory keep the parent unfinished as well
+		pthread_mutex_lock(&copy_lock);
+		parent->refs++;
+		pthread_mutex_unlock(&copy_lock);
+	}
+	while(1) {
+		struct copy_task *task;
+		size_t len;
+		errno = 0;
+		if(!(de = readdir(d))) break;
+		if(de->d_name[0] == '.' && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2]))) continue;
+		len = strlen(de->d_name);
+		if(!(task = malloc(sizeof *task + len + 1))) abort();
+		memcpy(task->name, de->d_name, len + 1);
+		task->dir = dir;
+		task->dst_name = task->name;
+		task->next = NULL;
+		if(last) last->next = task;
+		else first = task;
+		last = task;
+		count++;
+	}
+	if((e = errno)) copy_error(path, e);
+	pthread_mutex_lock(&copy_lock);
+	if(e) copy_failed = 1;
+	dir->refs += count;
+	copy_dir_touch(dir, 1);
+	pthread_mutex_unlock(&copy_lock);
+	closedir(d);
+	if(first) copy_push(first, last, count);
+	copy_release(dir);
+	return 0;
+}
+
+static int copy_entry(struct copy_task *task, char **buf) {
+	struct copy_dir *dir = task->dir;
+	int src_fd = AT_FDCWD, dst_fd = AT_FDCWD;
+	char *path = dir ? copy_join(dir->src_path, task->name) : strdup(task->name);
+	char *dst_path = dir ? copy_join(dir->dst_path, task->dst_name) : strdup(task->dst_name);
+	struct copy_link *link = NULL;
+	int nofollow = dir || !copy_opts->follow_root ? O_NOFOLLOW : 0;
+	struct stat st;
+	int r = -1;
+
+	if(!path || !dst_path) abort();
+	if(dir) {
+		if(copy_dir_get(dir) < 0) {
+			copy_error(dir->src_path, errno);
+			free(path);
+			free(dst_path);
+			return -1;
+		}
+		src_fd = dir->src_fd;
+		dst_fd = dir->dst_fd;
+	}
+	if(fstatat(src_fd, task->name, &st, nofollow ? AT_SYMLINK_NOFOLLOW : 0) < 0) {
+		copy_error(path, errno);
+		goto out;
+	}
+	if(S_ISDIR(st.st_mode)) {
+		if(dir && st.st_dev == copy_root_dev && st.st_ino == copy_root_ino) {
+			fprintf(stderr, "%s: %s: cannot copy a directory into itself\n", copy_opts->prog, path);
+			goto out;
+		}
+		r = copy_directory(dir, src_fd, task->name, dst_fd, task->dst_name, &st, path, dst_path);
+		goto out;
+	}
+	if(copy_opts->preserve & COPY_LINKS && st.st_nlink > 1) {
+		r = copy_hard_link(&link, &st, dst_fd, task->dst_name, dst_path);
+		if(r) goto out;
+	}
+	if(S_ISREG(st.st_mode)) {
+		r = copy_regular(src_fd, task->name, nofollow, dst_fd, task->dst_name, &st, path, dst_path, buf);
+	} else if(S_ISLNK(st.st_mode)) {
+		char *target = malloc(st.st_size + 1);
+		ssize_t len;
+		if(!target) abort();
+		len = readlinkat(src_fd, task->name, target, st.st_size + 1);
+		if(len < 0 || len > st.st_size) {
+			copy_error(path, len < 0 ? errno : ENAMETOOLONG);
+		} else {
+			target[len] = 0;
+			if(symlinkat(target, dst_fd, task->dst_name) < 0 &&
+			(errno != EEXIST || unlinkat(dst_fd, task->dst_name, 0) < 0 ||
+			symlinkat(target, dst_fd, task->dst_name) < 0)) {
+				copy_error(dst_path, errno);
+			} else r = copy_attrs_at(dst_fd, task->dst_name, &st, dst_path);
+		}
+		free(target);
+	} else {
+		if(mknodat(dst_fd, task->dst_name, st.st_mode, st.st_rdev) < 0) {
+			copy_error(dst_path, errno);
+		} else r = copy_attrs_at(dst_fd, task->dst_name, &st, dst_path);
+	}
+	if(link) {
+		pthread_mutex_lock(&copy_lock);
+		link->state = r < 0 ? -1 : 1;
+		pthread_cond_broadcast(&copy_cond);
+		pthread_mutex_unlock(&copy_lock);
+	}
+out:
+	if(dir) copy_dir_put(dir);
+	if(r >= 0) copy_progress(0, 1);
+	free(path);
+	free(dst_path);
+	return r;
+}
+
+/* Runs tasks until none are left; the pool threads and the caller all run this */
+static void *copy_worker(void *arg) {
+	char *buf = NULL;
+	pthread_mutex_lock(&copy_lock);
+	while(1) {
+		struct copy_task *task;
+		struct copy_dir *dir;
+		int r;
+		while(!copy_stack && copy_busy) pthread_cond_wait(&copy_cond, &copy_lock);
+		if(!copy_stack) break;
+		task = copy_stack;
+		copy_stack = task->next;
+		pthread_mutex_unlock(&copy_lock);
+		r = copy_entry(task, &buf);
+		dir = task->dir;
+		free(task);
+		if(dir) copy_release(dir);
+		pthread_mutex_lock(&copy_lock);
+		if(r < 0) copy_failed = 1;
+		copy_busy--;
+		if(!copy_busy) pthread_cond_broadcast(&copy_cond);
+	}
+	pthread_mutex_unlock(&copy_lock);
+	free(buf);
+	return NULL;
+}
+
+/* Copies source to destination, with everything under it if it is a
+ * directory; returns -1 if anything failed */
+static int copy_tree(const char *source, const char *destination, const struct copy_options *options) {
+	pthread_t threads[COPY_MAX_THREADS];
+	struct copy_task *task;
+	struct rlimit rl;
+	size_t len = strlen(source);
+	int count, i;
+
+	copy_opts = options;
+	copy_failed = 0;
+	copy_umask = umask(0);
+	umask(copy_umask);
+	copy_root_dev = 0;
+	copy_root_ino = 0;
+	// Two fds for each open directory, some left for the files being copied
+	copy_open_limit = COPY_MAX_OPEN_DIRS;
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur / 4 < COPY_MAX_OPEN_DIRS) {
+		copy_open_limit = rl.rlim_cur / 4;
+	}
+	if(!(task = malloc(sizeof *task + len + 1))) abort();
+	memcpy(task->name, source, len + 1);
+	task->dir = NULL;
+	task->dst_name = destination;
+	task->next = NULL;
+	copy_stack = task;
+	copy_busy = 1;
+	if(!copy_start.tv_sec) {
+		gettimeofday(&copy_start, NULL);
+		copy_next_report = copy_start;
+		copy_next_report.tv_sec++;
+	}
+
+	for(count = 0; count < options->threads && count < COPY_MAX_THREADS; count++) {
+		if(pthread_create(&threads[count], NULL, copy_worker, NULL)) break;
+	}
+	copy_worker(NULL);
+	for(i = 0; i < count; i++) pthread_join(threads[i], NULL);
+
+	for(i = 0; i < COPY_LINK_BUCKETS; i++) {
+		while(copy_links[i]) {
+			struct copy_link *l = copy_links[i];
+			copy_links[i] = l->next;
+			free(l->dst_path);
+			free(l);
+		}
+	}
+	return copy_failed ? -1 : 0;
+}
+
+/* Prints the totals of all copies so far */
+static void copy_summary() {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	copy_report(&now, 1);
+}
+
+#endif
+
+#endif
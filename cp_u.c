@@ -0,0 +1,192 @@
+/*	cp - toolbox
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "copyfile.h"
+
+#ifdef COPY_TREE
+#define SHORT_OPTIONS "aprRgj:"
+#else
+#define SHORT_OPTIONS "p"
+#endif
+
+static void usage() {
+	fprintf(stderr, "Usage: cp"
+#if defined _WIN32 && !defined _WIN32_WNT_NATIVE
+		".exe"
+#endif
+		" [<options>] <source> [...] <destination>\n\n"
+		"Options:\n"
+#ifdef COPY_TREE
+		"	-r, -R		Copy directories recursively, keeping hard links within them\n"
+#endif
+		"	-p		Preserve mode, owner and timestamps\n"
+#ifdef COPY_TREE
+		"	-a		Same as -rp, and preserve extended attributes too\n"
+		"	-g		Report progress and throughput\n"
+		"	-j <n>		Copy with n additional threads\n"
+#endif
+		"\n");
+}
+
+#ifndef COPY_TREE
+/* Copies a single regular file with read(2) and write(2) */
+static int copy_plain(const char *source, const char *dest, int preserve) {
+	char buffer[4096];
+	struct stat st, dest_st;
+	int in, out;
+	ssize_t s;
+	in = open(source, O_RDONLY);
+	if(in < 0 || fstat(in, &st) < 0) {
+		fprintf(stderr, "cp: %s: %s\n", source, strerror(errno));
+		if(in >= 0) close(in);
+		return -1;
+	}
+	if(S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "cp: %s: %s\n", source, strerror(EISDIR));
+		close(in);
+		return -1;
+	}
+	if(stat(dest, &dest_st) == 0 && dest_st.st_dev == st.st_dev && dest_st.st_ino == st.st_ino) {
+		fprintf(stderr, "cp: '%s' and '%s' are the same file\n", source, dest);
+		close(in);
+		return -1;
+	}
+	out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+	if(out < 0) {
+		fprintf(stderr, "cp: %s: %s\n", dest, strerror(errno));
+		close(in);
+		return -1;
+	}
+	while((s = read(in, buffer, sizeof buffer)) > 0) {
+		if(write(out, buffer, s) != s) {
+			s = -1;
+			break;
+		}
+	}
+	if(s < 0) fprintf(stderr, "cp: %s: %s\n", dest, strerror(errno));
+	close(in);
+	if(close(out) < 0) s = -1;
+	if(s == 0 && preserve) chmod(dest, st.st_mode & 07777);
+	return s < 0 ? -1 : 0;
+}
+#endif
+
+int cp_main(int argc, char **argv) {
+	const char *dest;
+	struct stat st;
+	int dest_is_dir;
+	int recursive = 0;
+	int r = 0;
+	int i;
+#ifdef COPY_TREE
+	struct copy_options options = { "cp", 0, -1, 0, 0 };
+#else
+	int preserve = 0;
+#endif
+
+	while(1) {
+		int c = getopt(argc, argv, SHORT_OPTIONS);
+		if(c == -1) break;
+		switch(c) {
+#ifdef COPY_TREE
+			case 'a':
+				recursive = 1;
+				options.preserve = COPY_ALL;
+				break;
+			case 'p':
+				options.preserve |= COPY_MODE | COPY_OWNER | COPY_TIMES;
+				break;
+			case 'r':
+			case 'R':
+				recursive = 1;
+				break;
+			case 'g':
+				options.progress = 1;
+				break;
+			case 'j':
+				options.threads = atoi(optarg);
+				if(options.threads < 0 || options.threads > COPY_MAX_THREADS) {
+					fprintf(stderr, "cp: thread count must be between 0 and %d\n", COPY_MAX_THREADS);
+					return -1;
+				}
+				break;
+#else
+			case 'p':
+				preserve = 1;
+				break;
+#endif
+			default:
+				usage();
+				return -1;
+		}
+	}
+	if(argc - optind < 2) {
+		usage();
+		return -1;
+	}
+#ifdef COPY_TREE
+	if(recursive) options.preserve |= COPY_LINKS;
+	else options.follow_root = 1;
+	if(options.threads < 0) {
+		long int n = sysconf(_SC_NPROCESSORS_ONLN);
+		options.threads = n < 2 ? 0 : n > 8 ? 8 : n;
+	}
+#endif
+
+	dest = argv[argc - 1];
+	dest_is_dir = stat(dest, &st) == 0 && S_ISDIR(st.st_mode);
+	if(argc - optind > 2 && !dest_is_dir) {
+		fprintf(stderr, "cp: %s: %s\n", dest, strerror(ENOTDIR));
+		return 1;
+	}
+
+	for(i = optind; i < argc - 1; i++) {
+		const char *source = argv[i];
+		char *full_dest = NULL;
+		if((recursive ? lstat : stat)(source, &st) < 0) {
+			fprintf(stderr, "cp: %s: %s\n", source, strerror(errno));
+			r = 1;
+			continue;
+		}
+		if(S_ISDIR(st.st_mode) && !recursive) {
+			fprintf(stderr, "cp: omitting directory %s\n", source);
+			r = 1;
+			continue;
+		}
+		if(dest_is_dir) {
+			// Into the directory, under the last component of the source
+			size_t len = strlen(source);
+			const char *name;
+			while(len > 1 && source[len - 1] == '/') len--;
+			for(name = source + len; name > source && name[-1] != '/'; name--);
+			full_dest = malloc(strlen(dest) + 1 + (source + len - name) + 1);
+			if(!full_dest) abort();
+			sprintf(full_dest, "%s/%.*s", dest, (int)(source + len - name), name);
+		}
+#ifdef COPY_TREE
+		if(copy_tree(source, full_dest ? full_dest : dest, &options) < 0) r = 1;
+#else
+		if(copy_plain(source, full_dest ? full_dest : dest, preserve) < 0) r = 1;
+#endif
+		free(full_dest);
+	}
+
+#ifdef COPY_TREE
+	if(options.progress) copy_summary();
+#endif
+	return r;
+}
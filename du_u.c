@@ -39,8 +39,8 @@
 
 #include <dirent.h>
 #include <err.h>
-#include <fts.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,11 +49,28 @@
 #include <limits.h>
 #include <stdint.h>
 
+/* Directories are read by a pool of threads where openat() is available */
+#if defined AT_SYMLINK_NOFOLLOW && !defined _WIN32
+#define PARALLEL_WALK
+#include <pthread.h>
+#include <sys/resource.h>
+#define MAX_WALK_THREADS 64
+#define MAX_READ_AHEAD_DIRS 256
+/* Listings kept open to open subdirectories relative to them, at most a
+ * quarter of the descriptor limit; below the rest, directories are opened
+ * by path from the nearest one still open */
+#define MAX_OPEN_DIRS 128
+#else
+#include <fts.h>
+#endif
+
 #ifndef howmany
 #define howmany(x, y) (((x)+((y)-1))/(y))
 #endif
 
 static long int blocksize;
+static int listfiles, depth, cflag;
+static int64_t totalblocks;
 
 static void prstat(const char *fname, int64_t blocks) {
 	(void)printf("%lld\t%s\n",
@@ -129,25 +146,814 @@ static int linkchk(dev_t dev, ino_t ino) {
 	return 0;
 }
 
+#ifdef PARALLEL_WALK
+/*
+ * Parallel tree walk. Worker threads open, read and stat directories ahead
+ * of the main thread, adding up the blocks of plain files on their own.
+ * Everything that depends on the serial fts order, counting hard links
+ * once and all of the output, is left to the main thread, which consumes
+ * the directories depth first in readdir order, exactly as fts visits them.
+ * Loaded subdirectories are pushed on a shared stack in reverse order, so
+ * the workers read ahead in about the order the main thread needs them;
+ * a directory nobody has taken yet is read by the main thread itself.
+ */
+
+enum { FOLLOW_NONE, FOLLOW_ROOTS, FOLLOW_ALL };
+
+/* What the main thread still has to see of a directory, in readdir order */
+enum { EV_FILE, EV_LINK, EV_DIR, EV_OTHER_FS, EV_ERROR };
+
+struct du_event {
+	int type;
+	int error;
+	size_t name;		/* offset in the directory's names */
+	int64_t blocks;
+	dev_t dev;
+	ino_t ino;
+	struct du_dir *child;
+};
+
+enum { DIR_QUEUED, DIR_LOADING, DIR_LOADED };
+
+struct du_dir {
+	struct du_dir *parent;
+	char *path;
+	const char *name;		/* opened relative to the parent, if any */
+	int level;
+	int64_t blocks;			/* of the directory itself */
+	dev_t dev;
+	ino_t ino;
+	long long int times[4];		/* mtime, its ns, ctime, its ns */
+	int state;
+	int error;
+	DIR *dir;
+	int fd_users;			/* subdirectories not opened yet, and
+					 * threads opening deeper below it */
+	int64_t file_blocks;		/* plain files nobody needs to see */
+	struct du_event *events;
+	size_t event_count, event_size;
+	char *names;
+	size_t names_len, names_size;
+	struct du_dir *prev, *next;	/* on the stack while queued */
+};
+
+static int follow = FOLLOW_NONE;
+static int xdev;
+static dev_t root_dev;
+static int thread_count = -1;
+static int walk_rval;
+
+static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dir_cond = PTHREAD_COND_INITIALIZER;
+static struct du_dir *dir_stack;
+static int dirs_ahead;		/* taken but not consumed yet */
+static int open_dirs;		/* listings kept open */
+static int open_dir_limit;
+static int stop_workers;
+
+static char *join_path(const char *dir, const char *name) {
+	const char *slash = dir[strlen(dir) - 1] == '/' ? "" : "/";
+	char *path = malloc(strlen(dir) + strlen(slash) + strlen(name) + 1);
+	if(!path) err(1, "malloc");
+	sprintf(path, "%s%s%s", dir, slash, name);
+	return path;
+}
+
+static void get_times(const struct stat *st, long long int *t) {
+	t[0] = st->st_mtime;
+	t[2] = st->st_ctime;
+#ifdef __linux__
+	t[1] = st->st_mtim.tv_nsec;
+	t[3] = st->st_ctim.tv_nsec;
+#else
+	t[1] = t[3] = 0;
+#endif
+}
+
+static struct du_dir *new_dir(struct du_dir *parent, char *path, const struct stat *st) {
+	struct du_dir *dir = calloc(1, sizeof *dir);
+	if(!dir) err(1, "calloc");
+	dir->parent = parent;
+	dir->path = path;
+	dir->name = parent ? strrchr(path, '/') + 1 : path;
+	dir->level = parent ? parent->level + 1 : 0;
+	dir->blocks = st->st_blocks;
+	dir->dev = st->st_dev;
+	dir->ino = st->st_ino;
+	get_times(st, dir->times);
+	return dir;
+}
+
+static void free_dir(struct du_dir *dir) {
+	free(dir->events);
+	free(dir->names);
+	free(dir->path);
+	free(dir);
+}
+
+static struct du_event *add_event(struct du_dir *dir, int type, const char *name) {
+	struct du_event *ev;
+	size_t len = strlen(name) + 1;
+	if(dir->event_count == dir->event_size) {
+		size_t new_size = dir->event_size ? dir->event_size * 2 : 16;
+		ev = realloc(dir->events, new_size * sizeof *ev);
+		if(!ev) err(1, "realloc");
+		dir->events = ev;
+		dir->event_size = new_size;
+	}
+	if(dir->names_size - dir->names_len < len) {
+		size_t new_size = dir->names_size ? dir->names_size * 2 : 256;
+		char *names;
+		while(new_size - dir->names_len < len) new_size *= 2;
+		names = realloc(dir->names, new_size);
+		if(!names) err(1, "realloc");
+		dir->names = names;
+		dir->names_size = new_size;
+	}
+	ev = dir->events + dir->event_count++;
+	memset(ev, 0, sizeof *ev);
+	ev->type = type;
+	ev->name = dir->names_len;
+	memcpy(dir->names + dir->names_len, name, len);
+	dir->names_len += len;
+	return ev;
+}
+
+/* A directory that is also one of its ancestors, fts reports it as FTS_DC */
+static int is_cycle(const struct du_dir *dir, const struct stat *st) {
+	for(; dir; dir = dir->parent) {
+		if(dir->dev == st->st_dev && dir->ino == st->st_ino) return 1;
+	}
+	return 0;
+}
+
+/* The stack functions are called with dir_lock held */
+static void push_dir(struct du_dir *dir) {
+	dir->prev = NULL;
+	dir->next = dir_stack;
+	if(dir_stack) dir_stack->prev = dir;
+	dir_stack = dir;
+}
+
+static void take_dir(struct du_dir *dir) {
+	if(dir->prev) dir->prev->next = dir->next;
+	else dir_stack = dir->next;
+	if(dir->next) dir->next->prev = dir->prev;
+	dir->state = DIR_LOADING;
+	dirs_ahead++;
+}
+
+/*
+ * Size cache. With -C, every directory walked without errors is recorded
+ * with its identity, times and what the main thread needed of it: its own
+ * blocks, the sum of its plain files, and its hard links, subdirectories
+ * and other file system mount points in readdir order. On the next run a
+ * directory whose inode, mtime and ctime are unchanged is taken from the
+ * cache instead of being read; only its subdirectories are stat'ed again,
+ * so every directory is still checked but files are not looked at. Changes
+ * that don't touch any directory, such as a file growing in place, go
+ * unnoticed; -V rescans everything, reports where the cache was wrong and
+ * then exits with 1. Records for directories outside of the roots walked
+ * are carried over when the file is rewritten.
+ *
+ * The file is text, one "D" line per directory followed by its entries:
+ *	du-cache 1 <follow> <xdev>
+ *	D <dev> <ino> <mtime> <mtime ns> <ctime> <ctime ns> <blocks> <file blocks> <total> <path>
+ *	L <blocks> <dev> <ino> <name>
+ *	S <name>
+ *	X <blocks> <name>
+ */
+
+#define CACHE_VERSION 1
+
+struct cache_event {
+	int type;
+	int64_t blocks;
+	dev_t dev;
+	ino_t ino;
+	const char *name;
+};
+
+struct cache_dir {
+	const char *path;
+	dev_t dev;
+	ino_t ino;
+	long long int times[4];		/* mtime, its ns, ctime, its ns */
+	int64_t blocks;
+	int64_t file_blocks;
+	int64_t total;
+	struct cache_event *events;
+	size_t event_count, event_size;
+	struct cache_dir *next;
+};
+
+static const char *cache_file;
+static int cache_verify;
+static char *cache_data;
+static struct cache_dir *cache_dirs;
+static size_t cache_count;
+static struct cache_dir **cache_table;
+static size_t cache_mask;
+static FILE *cache_out;
+static char *cache_out_name;
+
+static size_t cache_hash(const char *path) {
+	size_t h = 2166136261U;
+	while(*path) h = (h ^ (unsigned char)*path++) * 16777619U;
+	return h;
+}
+
+static const struct cache_dir *cache_lookup(const char *path) {
+	const struct cache_dir *cd;
+	if(!cache_table) return NULL;
+	for(cd = cache_table[cache_hash(path) & cache_mask]; cd; cd = cd->next) {
+		if(strcmp(cd->path, path) == 0) return cd;
+	}
+	return NULL;
+}
+
+static void cache_free() {
+	size_t i;
+	for(i = 0; i < cache_count; i++) free(cache_dirs[i].events);
+	free(cache_dirs);
+	free(cache_table);
+	free(cache_data);
+	cache_dirs = NULL;
+	cache_count = 0;
+	cache_table = NULL;
+	cache_data = NULL;
+}
+
+/* Splits off the next space separated number */
+static unsigned long long int next_number(char **p, int *bad) {
+	char *end;
+	unsigned long long int n = strtoull(*p, &end, 10);
+	if(end == *p || *end != ' ') *bad = 1;
+	else *p = end + 1;
+	return n;
+}
+
+static struct cache_event *add_cache_event(struct cache_dir *cd) {
+	struct cache_event *ev;
+	if(cd->event_count == cd->event_size) {
+		size_t new_size = cd->event_size ? cd->event_size * 2 : 8;
+		if(!(ev = realloc(cd->events, new_size * sizeof *ev))) err(1, "realloc");
+		cd->events = ev;
+		cd->event_size = new_size;
+	}
+	ev = cd->events + cd->event_count++;
+	memset(ev, 0, sizeof *ev);
+	return ev;
+}
+
+/* Parses a "D" line */
+static void parse_cache_dir(struct cache_dir *cd, char *line, int *bad) {
+	int i;
+	memset(cd, 0, sizeof *cd);
+	cd->dev = next_number(&line, bad);
+	cd->ino = next_number(&line, bad);
+	for(i = 0; i < 4; i++) cd->times[i] = next_number(&line, bad);
+	cd->blocks = next_number(&line, bad);
+	cd->file_blocks = next_number(&line, bad);
+	cd->total = next_number(&line, bad);
+	cd->path = line;
+}
+
+/* Parses an entry line */
+static void parse_cache_event(struct cache_dir *cd, char *line, int *bad) {
+	struct cache_event *ev = add_cache_event(cd);
+	char type = line[0];
+	line += 2;
+	switch(type) {
+		case 'L':
+			ev->type = EV_LINK;
+			ev->blocks = next_number(&line, bad);
+			ev->dev = next_number(&line, bad);
+			ev->ino = next_number(&line, bad);
+			break;
+		case 'S':
+			ev->type = EV_DIR;
+			break;
+		case 'X':
+			ev->type = EV_OTHER_FS;
+			ev->blocks = next_number(&line, bad);
+			break;
+		default:
+			*bad = 1;
+	}
+	ev->name = line;
+}
+
+static char *read_file(const char *name) {
+	size_t len = 0, size = 0, n;
+	char *data = NULL;
+	FILE *f = fopen(name, "r");
+	if(!f) return NULL;
+	do {
+		if(size - len < 65536 + 1) {
+			size = size ? size * 2 : 1 << 20;
+			if(!(data = realloc(data, size))) err(1, "realloc");
+		}
+		n = fread(data + len, 1, size - len - 1, f);
+		len += n;
+	} while(n);
+	fclose(f);
+	data[len] = 0;
+	return data;
+}
+
+/* Loads the whole cache; a file that can't be used is ignored and the
+ * walk then simply reads everything */
+static void cache_load() {
+	struct cache_dir *cd = NULL;
+	size_t size = 0, i;
+	int version, cached_follow, cached_xdev;
+	int bad = 0;
+	char *p;
+
+	if(!(cache_data = read_file(cache_file))) {
+		if(errno != ENOENT) warn("%s", cache_file);
+		return;
+	}
+	p = cache_data;
+	if(sscanf(p, "du-cache %d %d %d", &version, &cached_follow, &cached_xdev) != 3 ||
+	version != CACHE_VERSION || !(p = strchr(p, '\n'))) {
+		bad = 1;
+	} else if(cached_follow != follow || cached_xdev != xdev) {
+		// Written for another kind of walk
+		cache_free();
+		return;
+	}
+
+	while(!bad && *++p) {
+		char *line = p;
+		if(!(p = strchr(p, '\n'))) break;
+		*p = 0;
+		if(line[0] == 'D' && line[1] == ' ') {
+			if(cache_count == size) {
+				size = size ? size * 2 : 1024;
+				if(!(cd = realloc(cache_dirs, size * sizeof *cd))) err(1, "realloc");
+				cache_dirs = cd;
+			}
+			cd = cache_dirs + cache_count++;
+			parse_cache_dir(cd, line + 2, &bad);
+		} else if(cd && line[0] && line[1] == ' ') {
+			parse_cache_event(cd, line, &bad);
+		} else bad = 1;
+	}
+	if(bad) {
+		warnx("%s: not a usable cache, ignoring it", cache_file);
+		cache_free();
+		return;
+	}
+
+	for(cache_mask = 1; cache_mask < cache_count * 2; cache_mask <<= 1);
+	if(!(cache_table = calloc(cache_mask, sizeof *cache_table))) err(1, "calloc");
+	cache_mask--;
+	for(i = 0; i < cache_count; i++) {
+		size_t h = cache_hash(cache_dirs[i].path) & cache_mask;
+		cache_dirs[i].next = cache_table[h];
+		cache_table[h] = cache_dirs + i;
+	}
+}
+
+static void cache_open_output() {
+	cache_out_name = malloc(strlen(cache_file) + 5);
+	if(!cache_out_name) err(1, "malloc");
+	sprintf(cache_out_name, "%s.new", cache_file);
+	if(!(cache_out = fopen(cache_out_name, "w"))) {
+		warn("%s", cache_out_name);
+		return;
+	}
+	fprintf(cache_out, "du-cache %d %d %d\n", CACHE_VERSION, follow, xdev);
+}
+
+static void cache_close_output() {
+	if(!cache_out) return;
+	if(ferror(cache_out) | fclose(cache_out)) {
+		warnx("%s: write error, cache not updated", cache_out_name);
+		unlink(cache_out_name);
+	} else if(rename(cache_out_name, cache_file) < 0) {
+		warn("%s", cache_file);
+		unlink(cache_out_name);
+	}
+	cache_out = NULL;
+	free(cache_out_name);
+}
+
+static void cache_write_dir(dev_t dev, ino_t ino, const long long int *times, int64_t blocks,
+int64_t file_blocks, int64_t total, const char *path) {
+	fprintf(cache_out, "D %llu %llu %lld %lld %lld %lld %lld %lld %lld %s\n",
+		(unsigned long long int)dev, (unsigned long long int)ino,
+		times[0], times[1], times[2], times[3],
+		(long long int)blocks, (long long int)file_blocks, (long long int)total, path);
+}
+
+static void cache_write_event(int type, int64_t blocks, dev_t dev, ino_t ino, const char *name) {
+	switch(type) {
+		case EV_LINK:
+			fprintf(cache_out, "L %lld %llu %llu %s\n", (long long int)blocks,
+				(unsigned long long int)dev, (unsigned long long int)ino, name);
+			break;
+		case EV_DIR:
+			fprintf(cache_out, "S %s\n", name);
+			break;
+		case EV_OTHER_FS:
+			fprintf(cache_out, "X %lld %s\n", (long long int)blocks, name);
+			break;
+	}
+}
+
+/* Records the directory once the main thread has its total; directories
+ * with errors are left out so that they are read again next time */
+static void cache_write(const struct du_dir *dir, int64_t total) {
+	int64_t file_blocks = dir->file_blocks;
+	size_t i;
+	if(!cache_out || strchr(dir->path, '\n')) return;
+	for(i = 0; i < dir->event_count; i++) {
+		const struct du_event *ev = dir->events + i;
+		if(ev->type == EV_ERROR || strchr(dir->names + ev->name, '\n')) return;
+		if(ev->type == EV_FILE) file_blocks += ev->blocks;
+	}
+	cache_write_dir(dir->dev, dir->ino, dir->times, dir->blocks, file_blocks, total, dir->path);
+	for(i = 0; i < dir->event_count; i++) {
+		const struct du_event *ev = dir->events + i;
+		cache_write_event(ev->type, ev->blocks, ev->dev, ev->ino, dir->names + ev->name);
+	}
+}
+
+/* Whether the path is the root or below it, as join_path() builds them */
+static int under_root(const char *path, const char *root) {
+	size_t len = strlen(root);
+	if(strncmp(path, root, len)) return 0;
+	return !path[len] || path[len] == '/' || (len && root[len - 1] == '/');
+}
+
+/* Carries over the records of directories outside of the roots just
+ * walked, so that walks of different trees can share a cache file */
+static void cache_keep_others(char **roots) {
+	size_t i, j;
+	char **r;
+	if(!cache_out) return;
+	for(i = 0; i < cache_count; i++) {
+		const struct cache_dir *cd = cache_dirs + i;
+		for(r = roots; *r && !under_root(cd->path, *r); r++);
+		if(*r) continue;
+		cache_write_dir(cd->dev, cd->ino, cd->times, cd->blocks, cd->file_blocks, cd->total, cd->path);
+		for(j = 0; j < cd->event_count; j++) {
+			const struct cache_event *ev = cd->events + j;
+			cache_write_event(ev->type, ev->blocks, ev->dev, ev->ino, ev->name);
+		}
+	}
+}
+
+/* Adds a directory entry the main thread has to know about, or adds it
+ * up right away */
+static void add_entry(struct du_dir *dir, const char *name, const struct stat *st) {
+	struct du_event *ev;
+	if(S_ISDIR(st->st_mode)) {
+		if(xdev && st->st_dev != root_dev) {
+			add_event(dir, EV_OTHER_FS, name)->blocks = st->st_blocks;
+		} else if(follow != FOLLOW_ALL || !is_cycle(dir, st)) {
+			add_event(dir, EV_DIR, name)->child = new_dir(dir, join_path(dir->path, name), st);
+			dir->fd_users++;
+		}
+	} else if(st->st_nlink > 1) {
+		ev = add_event(dir, EV_LINK, name);
+		ev->blocks = st->st_blocks;
+		ev->dev = st->st_dev;
+		ev->ino = st->st_ino;
+	} else if(listfiles) {
+		add_event(dir, EV_FILE, name)->blocks = st->st_blocks;
+	} else {
+		dir->file_blocks += st->st_blocks;
+	}
+}
+
+/* Fills the directory in from its cache record, stat'ing only the
+ * subdirectories; returns 0 if it has to be read after all */
+static int reuse_dir(struct du_dir *dir, int fd, int stat_flags) {
+	const struct cache_dir *cd = cache_lookup(dir->path);
+	size_t i;
+	if(!cd || cd->dev != dir->dev || cd->ino != dir->ino || memcmp(cd->times, dir->times, sizeof cd->times)) {
+		return 0;
+	}
+	for(i = 0; i < cd->event_count; i++) {
+		const struct cache_event *cev = cd->events + i;
+		struct du_event *ev;
+		struct stat st;
+		if(cev->type == EV_LINK) {
+			ev = add_event(dir, EV_LINK, cev->name);
+			ev->blocks = cev->blocks;
+			ev->dev = cev->dev;
+			ev->ino = cev->ino;
+			continue;
+		}
+		if(fstatat(fd, cev->name, &st, stat_flags) < 0 || !S_ISDIR(st.st_mode)) {
+			for(i = 0; i < dir->event_count; i++) {
+				if(dir->events[i].type == EV_DIR) free_dir(dir->events[i].child);
+			}
+			dir->event_count = 0;
+			dir->names_len = 0;
+			dir->fd_users = 0;
+			return 0;
+		}
+		add_entry(dir, cev->name, &st);
+	}
+	dir->file_blocks = cd->file_blocks;
+	return 1;
+}
+
+/* Called with dir_lock held; returns the listing to close once no
+ * subdirectory needs it any more */
+static DIR *put_dir_fd(struct du_dir *dir) {
+	DIR *d = NULL;
+	if(!--dir->fd_users && dir->dir) {
+		d = dir->dir;
+		dir->dir = NULL;
+		open_dirs--;
+	}
+	return d;
+}
+
+/* Opens the directory relative to base, an ancestor with its listing
+ * open, or to the working directory if there is none. Directories in
+ * between are crossed in a single path, as long as it fits; since that
+ * follows symbolic links on the way, the result has to be the directory
+ * that was stat'ed, as fts checks when it changes directories. */
+static int open_below(const struct du_dir *base, const struct du_dir *dir) {
+	int at = base ? dirfd(base->dir) : AT_FDCWD;
+	int oflags = O_RDONLY | O_DIRECTORY;
+	const char *path = dir->path;
+	struct stat st;
+	int fd;
+
+	if(dir->parent && follow != FOLLOW_ALL) oflags |= O_NOFOLLOW;
+	if(dir->parent == base) return openat(at, dir->name, oflags);
+	if(base) {
+		path += strlen(base->path);
+		if(*path == '/') path++;
+	}
+	if(strlen(path) >= PATH_MAX) {
+		int parent_fd = open_below(base, dir->parent);
+		if(parent_fd < 0) return -1;
+		fd = openat(parent_fd, dir->name, oflags);
+		close(parent_fd);
+		return fd;
+	}
+	fd = openat(at, path, oflags);
+	if(fd < 0) return -1;
+	if(fstat(fd, &st) < 0 || st.st_dev != dir->dev || st.st_ino != dir->ino) {
+		close(fd);
+		errno = ENOENT;
+		return -1;
+	}
+	return fd;
+}
+
+static void load_dir(struct du_dir *dir) {
+	struct du_dir *parent = dir->parent;
+	struct du_dir *base;
+	int stat_flags = follow == FOLLOW_ALL ? 0 : AT_SYMLINK_NOFOLLOW;
+	struct dirent *de;
+	DIR *d = NULL;
+	size_t i;
+	int fd;
+
+	pthread_mutex_lock(&dir_lock);
+	for(base = parent; base && !base->dir; base = base->parent);
+	if(base) base->fd_users++;
+	pthread_mutex_unlock(&dir_lock);
+	fd = open_below(base, dir);
+	if(fd >= 0 && !(d = fdopendir(fd))) {
+		int e = errno;
+		close(fd);
+		errno = e;
+	}
+	if(!d) dir->error = errno;
+
+	if(parent) {
+		DIR *base_dir = NULL, *parent_dir;
+		pthread_mutex_lock(&dir_lock);
+		if(base) base_dir = put_dir_fd(base);
+		parent_dir = put_dir_fd(parent);
+		pthread_mutex_unlock(&dir_lock);
+		if(base_dir) closedir(base_dir);
+		if(parent_dir) closedir(parent_dir);
+	}
+
+	if(d && (!cache_table || cache_verify || listfiles || !reuse_dir(dir, fd, stat_flags))) {
+		while((de = readdir(d))) {
+			struct stat st;
+			if(de->d_name[0] == '.' && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2]))) continue;
+			if(fstatat(fd, de->d_name, &st, stat_flags) < 0) {
+				// A dangling symbolic link is counted as itself
+				if(stat_flags || errno != ENOENT || fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+					add_event(dir, EV_ERROR, de->d_name)->error = errno;
+					continue;
+				}
+			}
+			add_entry(dir, de->d_name, &st);
+		}
+	}
+
+	pthread_mutex_lock(&dir_lock);
+	if(d && dir->fd_users && open_dirs < open_dir_limit) {
+		dir->dir = d;
+		open_dirs++;
+		d = NULL;
+	}
+	dir->state = DIR_LOADED;
+	i = dir->event_count;
+	while(i > 0) {
+		if(dir->events[--i].type == EV_DIR) push_dir(dir->events[i].child);
+	}
+	pthread_cond_broadcast(&dir_cond);
+	pthread_mutex_unlock(&dir_lock);
+	if(d) closedir(d);
+}
+
+static void *dir_worker(void *arg) {
+	pthread_mutex_lock(&dir_lock);
+	while(1) {
+		struct du_dir *dir;
+		while(!stop_workers && (!dir_stack || dirs_ahead >= MAX_READ_AHEAD_DIRS)) {
+			pthread_cond_wait(&dir_cond, &dir_lock);
+		}
+		if(stop_workers) break;
+		dir = dir_stack;
+		take_dir(dir);
+		pthread_mutex_unlock(&dir_lock);
+		load_dir(dir);
+		pthread_mutex_lock(&dir_lock);
+	}
+	pthread_mutex_unlock(&dir_lock);
+	return NULL;
+}
+
+static void count_blocks(int64_t *total, int64_t blocks) {
+	*total += blocks;
+	if(cflag) totalblocks += blocks;
+}
+
+/* Reports the directory and everything below it as the fts walk would,
+ * returning its total; frees the directory */
+static int64_t consume_dir(struct du_dir *dir) {
+	int64_t total = 0;
+	size_t i;
+
+	pthread_mutex_lock(&dir_lock);
+	if(dir->state == DIR_QUEUED) {
+		take_dir(dir);
+		pthread_mutex_unlock(&dir_lock);
+		load_dir(dir);
+		pthread_mutex_lock(&dir_lock);
+	}
+	while(dir->state != DIR_LOADED) pthread_cond_wait(&dir_cond, &dir_lock);
+	dirs_ahead--;
+	pthread_cond_broadcast(&dir_cond);
+	pthread_mutex_unlock(&dir_lock);
+
+	if(dir->error) {
+		warnx("%s: %s", dir->path, strerror(dir->error));
+		walk_rval = 1;
+		free_dir(dir);
+		return 0;
+	}
+
+	count_blocks(&total, dir->file_blocks);
+	for(i = 0; i < dir->event_count; i++) {
+		struct du_event *ev = dir->events + i;
+		char *path;
+		switch(ev->type) {
+			case EV_DIR:
+				total += consume_dir(ev->child);
+				break;
+			case EV_LINK:
+				if(linkchk(ev->dev, ev->ino)) break;
+				// Fall
+			case EV_FILE:
+				if(listfiles) {
+					path = join_path(dir->path, dir->names + ev->name);
+					prstat(path, ev->blocks);
+					free(path);
+				}
+				count_blocks(&total, ev->blocks);
+				break;
+			case EV_OTHER_FS:
+				if(dir->level + 1 <= depth) {
+					path = join_path(dir->path, dir->names + ev->name);
+					prstat(path, ev->blocks);
+					free(path);
+				}
+				count_blocks(&total, ev->blocks);
+				break;
+			case EV_ERROR:
+				path = join_path(dir->path, dir->names + ev->name);
+				warnx("%s: %s", path, strerror(ev->error));
+				free(path);
+				walk_rval = 1;
+				break;
+		}
+	}
+	count_blocks(&total, dir->blocks);
+	if(dir->level <= depth || (!listfiles && !dir->level)) prstat(dir->path, total);
+	if(cache_verify) {
+		const struct cache_dir *cd = cache_lookup(dir->path);
+		if(cd && cd->total != total) {
+			warnx("%s: cached size %lld, scanned %lld", dir->path,
+				(long long int)howmany(cd->total, (int64_t)blocksize),
+				(long long int)howmany(total, (int64_t)blocksize));
+			walk_rval = 1;
+		}
+	}
+	cache_write(dir, total);
+	free_dir(dir);
+	return total;
+}
+
+static int walk(char **roots) {
+	pthread_t threads[MAX_WALK_THREADS];
+	char **first_root = roots;
+	struct rlimit rl;
+	int count;
+
+	walk_rval = 0;
+	stop_workers = 0;
+	open_dir_limit = MAX_OPEN_DIRS;
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur / 4 < MAX_OPEN_DIRS) {
+		open_dir_limit = rl.rlim_cur / 4;
+	}
+	if(cache_file) {
+		cache_load();
+		cache_open_output();
+	}
+	for(count = 0; count < thread_count; count++) {
+		if(pthread_create(&threads[count], NULL, dir_worker, NULL)) break;
+	}
+
+	for(; *roots; roots++) {
+		const char *root = *roots;
+		struct stat st;
+		char *path;
+		if((follow == FOLLOW_NONE ? lstat : stat)(root, &st) < 0 &&
+		(follow == FOLLOW_NONE || errno != ENOENT || lstat(root, &st) < 0)) {
+			warnx("%s: %s", root, strerror(errno));
+			walk_rval = 1;
+			continue;
+		}
+		if(!S_ISDIR(st.st_mode)) {
+			if(st.st_nlink > 1 && linkchk(st.st_dev, st.st_ino)) continue;
+			prstat(root, st.st_blocks);
+			if(cflag) totalblocks += st.st_blocks;
+			continue;
+		}
+		root_dev = st.st_dev;
+		if(!(path = strdup(root))) err(1, "strdup");
+		consume_dir(new_dir(NULL, path, &st));
+	}
+
+	pthread_mutex_lock(&dir_lock);
+	stop_workers = 1;
+	pthread_cond_broadcast(&dir_cond);
+	pthread_mutex_unlock(&dir_lock);
+	while(count > 0) pthread_join(threads[--count], NULL);
+	if(cache_file) {
+		cache_keep_others(first_root);
+		cache_close_output();
+		cache_free();
+	}
+	return walk_rval;
+}
+#endif
+
 static void usage(void) {
-	fprintf(stderr, "Usage: du [-H | -L | -P] [-a | -d <depth> | -s] [-cgkmrx] [<file> ...]\n");
+	fprintf(stderr, "Usage: du [-H | -L | -P] [-a | -d <depth> | -s] [-cgkmrx]"
+#ifdef PARALLEL_WALK
+		" [-j <threads>] [-C <cache file> [-V]]"
+#endif
+		" [<file> ...]\n");
 }
 
 int du_main(int argc, char *argv[]) {
+#ifndef PARALLEL_WALK
 	FTS *fts;
 	FTSENT *p;
-	int64_t totalblocks;
-	int ftsoptions, listfiles;
-	int depth;
-	int Hflag, Lflag, aflag, ch, cflag, dflag, gkmflag, rval, sflag;
+	int ftsoptions;
+#endif
+	int Hflag, Lflag, aflag, ch, dflag, gkmflag, rval, sflag, xflag;
 	char *noargv[2];
 
-	Hflag = Lflag = aflag = cflag = dflag = gkmflag = sflag = 0;
+	Hflag = Lflag = aflag = cflag = dflag = gkmflag = sflag = xflag = 0;
 	totalblocks = 0;
-	ftsoptions = FTS_PHYSICAL;
 	depth = INT_MAX;
-	while((ch = getopt(argc, argv, "HLPacd:ghkmnrsx")) != -1)
+	while((ch = getopt(argc, argv, "C:HLPVacd:ghj:kmnrsx")) != -1)
 		switch(ch) {
+#ifdef PARALLEL_WALK
+			case 'C':
+				cache_file = optarg;
+				break;
+#endif
 			case 'H':
 				Hflag = 1;
 				Lflag = 0;
@@ -159,6 +965,11 @@ int du_main(int argc, char *argv[]) {
 			case 'P':
 				Hflag = Lflag = 0;
 				break;
+#ifdef PARALLEL_WALK
+			case 'V':
+				cache_verify = 1;
+				break;
+#endif
 			case 'a':
 				aflag = 1;
 				break;
@@ -178,6 +989,16 @@ int du_main(int argc, char *argv[]) {
 				blocksize = 1024 * 1024 * 1024;
 				gkmflag = 1;
 				break;
+#ifdef PARALLEL_WALK
+			case 'j':
+				thread_count = atoi(optarg);
+				if(thread_count < 0 || thread_count > MAX_WALK_THREADS) {
+					warnx("invalid argument to option j: %s", optarg);
+					usage();
+					return 1;
+				}
+				break;
+#endif
 			case 'k':
 				blocksize = 1024;
 				gkmflag = 1;
@@ -192,7 +1013,7 @@ int du_main(int argc, char *argv[]) {
 				sflag = 1;
 				break;
 			case 'x':
-				ftsoptions |= FTS_XDEV;
+				xflag = 1;
 				break;
 			case '?':
 			default:
@@ -202,24 +1023,13 @@ int du_main(int argc, char *argv[]) {
 	argc -= optind;
 	argv += optind;
 
-	/*
-	 * XXX
-	 * Because of the way that fts(3) works, logical walks will not count
-	 * the blocks actually used by symbolic links.  We rationalize this by
-	 * noting that users computing logical sizes are likely to do logical
-	 * copies, so not counting the links is correct.  The real reason is
-	 * that we'd have to re-implement the kernel's symbolic link traversing
-	 * algorithm to get this right.  If, for example, you have relative
-	 * symbolic links referencing other relative symbolic links, it gets
-	 * very nasty, very fast.  The bottom line is that it's documented in
-	 * the man page, so it's a feature.
-	 */
-
-	if(Hflag) ftsoptions |= FTS_COMFOLLOW;
-	if(Lflag) {
-		ftsoptions &= ~FTS_PHYSICAL;
-		ftsoptions |= FTS_LOGICAL;
+#ifdef PARALLEL_WALK
+	if(cache_verify && !cache_file) {
+		warnx("-V needs a cache file given with -C");
+		usage();
+		return 1;
 	}
+#endif
 
 	listfiles = 0;
 	if(aflag) {
@@ -246,6 +1056,40 @@ int du_main(int argc, char *argv[]) {
 	if(!gkmflag) blocksize = 512;
 	blocksize /= 512;
 
+#ifdef PARALLEL_WALK
+	follow = Lflag ? FOLLOW_ALL : Hflag ? FOLLOW_ROOTS : FOLLOW_NONE;
+	xdev = xflag;
+	if(thread_count < 0) {
+		// Leave a single CPU alone, the walk would only contend for it
+		long int n = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = n < 2 ? 0 : n > 16 ? 16 : n;
+	}
+	rval = walk(argv);
+	thread_count = -1;
+	cache_file = NULL;
+	cache_verify = 0;
+#else
+	/*
+	 * XXX
+	 * Because of the way that fts(3) works, logical walks will not count
+	 * the blocks actually used by symbolic links.  We rationalize this by
+	 * noting that users computing logical sizes are likely to do logical
+	 * copies, so not counting the links is correct.  The real reason is
+	 * that we'd have to re-implement the kernel's symbolic link traversing
+	 * algorithm to get this right.  If, for example, you have relative
+	 * symbolic links referencing other relative symbolic links, it gets
+	 * very nasty, very fast.  The bottom line is that it's documented in
+	 * the man page, so it's a feature.
+	 */
+
+	ftsoptions = FTS_PHYSICAL;
+	if(xflag) ftsoptions |= FTS_XDEV;
+	if(Hflag) ftsoptions |= FTS_COMFOLLOW;
+	if(Lflag) {
+		ftsoptions &= ~FTS_PHYSICAL;
+		ftsoptions |= FTS_LOGICAL;
+	}
+
 	if(!(fts = fts_open(argv, ftsoptions, NULL))) err(1, "fts_open `%s'", *argv);
 
 	for(rval = 0; (p = fts_read(fts)) != NULL;) {
@@ -288,6 +1132,7 @@ int du_main(int argc, char *argv[]) {
 		}
 	}
 	if(errno) err(1, "fts_read");
+#endif
 	if(cflag) prstat("total", totalblocks);
 	return rval;
 }
@@ -6,39 +6,234 @@
 	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
 */
 
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 //#include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#endif
 //#include <sys/ioctl.h>
 #include <errno.h>
 
+#define LINE_SIZE 16
+/* "%016llx: " + 16 * "xx " + "s %x\n" */
+#define MAX_LINE_LEN (16 + 2 + LINE_SIZE * 3 + 2 + 8 + 1)
+#define READ_BUF_SIZE (64 * 1024)
+#define OUT_BUF_SIZE (64 * 1024)
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* The counters are volatile as a mapped dump may be cut short by SIGBUS,
+ * see dump_mapped() */
+static char out_buf[OUT_BUF_SIZE];
+static volatile size_t out_len;
+
+/* Delta mode: the bytes seen on the previous pass, relative to the start offset */
+static int delta;
+static unsigned char *prev_data;
+static size_t prev_len, prev_size;
+
+static volatile unsigned long long int sum;
+static volatile int changed_lines;
+static volatile off_t dumped_pos;	/* end of the last line dumped */
+
+static void flush_output() {
+	const char *p = out_buf;
+	while(out_len > 0) {
+		ssize_t s = write(STDOUT_FILENO, p, out_len);
+		if(s < 0) {
+			if(errno == EINTR) continue;
+			break;
+		}
+		p += s;
+		out_len -= s;
+	}
+	out_len = 0;
+}
+
+static char *put_hex(char *p, unsigned long long int v, int width) {
+	char tmp[16];
+	int n = 0;
+	do {
+		tmp[n++] = hex_digits[v & 0xf];
+		v >>= 4;
+	} while(v);
+	while(n < width) tmp[n++] = '0';
+	while(n > 0) *p++ = tmp[--n];
+	return p;
+}
+
+static int line_changed(off_t rel, const unsigned char *data, size_t len) {
+	size_t end = rel + len;
+	if(end > prev_size) {
+		size_t new_size = prev_size ? prev_size : READ_BUF_SIZE;
+		unsigned char *p;
+		while(new_size < end) new_size *= 2;
+		p = realloc(prev_data, new_size);
+		if(!p) return 1;
+		prev_data = p;
+		prev_size = new_size;
+	}
+	if(end <= prev_len && memcmp(prev_data + rel, data, len) == 0) return 0;
+	memcpy(prev_data + rel, data, len);
+	if(end > prev_len) prev_len = end;
+	return 1;
+}
+
+static void format_line(off_t pos, const unsigned char *data, size_t len) {
+	unsigned int lsum = 0;
+	size_t i;
+	char *p;
+	if(out_len + MAX_LINE_LEN > sizeof out_buf) flush_output();
+	p = out_buf + out_len;
+	p = put_hex(p, pos, 8);
+	*p++ = ':';
+	*p++ = ' ';
+	for(i = 0; i < len; i++) {
+		unsigned char c = data[i];
+		lsum += c;
+		*p++ = hex_digits[c >> 4];
+		*p++ = hex_digits[c & 0xf];
+		*p++ = ' ';
+	}
+	*p++ = 's';
+	*p++ = ' ';
+	p = put_hex(p, lsum, 1);
+	*p++ = '\n';
+	out_len = p - out_buf;
+}
+
+/* Dumps whole lines from data, which starts at file offset pos. A trailing
+ * partial line is only dumped if final is set; returns the bytes consumed. */
+static size_t dump_lines(const unsigned char *data, size_t len, off_t pos, off_t start, int final) {
+	size_t done = 0;
+	while(done < len) {
+		size_t n = len - done;
+		unsigned int lsum = 0;
+		size_t i;
+		if(n > LINE_SIZE) n = LINE_SIZE;
+		else if(n < LINE_SIZE && !final) break;
+		for(i = 0; i < n; i++) lsum += data[done + i];
+		if(!delta || line_changed(pos - start, data + done, n)) {
+			format_line(pos, data + done, n);
+			changed_lines++;
+		}
+		// Only counted once the whole line has been read
+		sum += lsum;
+		done += n;
+		pos += n;
+		dumped_pos = pos;
+	}
+	return done;
+}
+
+#ifndef _WIN32
+static sigjmp_buf map_fault;
+
+static void map_fault_handler(int sig) {
+	siglongjmp(map_fault, 1);
+}
+
+/* Returns 0 if the range was dumped from a mapping, -1 to fall back to read(2).
+ * If the file is truncated under the mapping, SIGBUS stops the dump after
+ * the last whole line; that offset is put in filepos and 1 is returned. */
+static int dump_mapped(int fd, off_t start, off_t count, off_t *filepos) {
+	static long int page_size;
+	struct sigaction sa, old_sa;
+	struct stat st;
+	int r = 0;
+	off_t map_start, end;
+	size_t map_len;
+	void *map;
+	// Files in /proc report a size of 0, read them instead
+	if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size) return -1;
+	end = st.st_size;
+	if(count > 0 && start + count < end) end = start + count;
+	if(start >= end) return 0;
+	if(!page_size) page_size = sysconf(_SC_PAGESIZE);
+	if(page_size <= 0) return -1;
+	map_start = start - start % page_size;
+	map_len = end - map_start;
+	if((off_t)map_len != end - map_start) return -1;
+	map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, map_start);
+	if(map == MAP_FAILED) return -1;
+#ifdef MADV_SEQUENTIAL
+	madvise(map, map_len, MADV_SEQUENTIAL);
+#endif
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = map_fault_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGBUS, &sa, &old_sa);
+	dumped_pos = start;
+	if(sigsetjmp(map_fault, 1) == 0) {
+		dump_lines((const unsigned char *)map + (start - map_start), end - start, start, start, 1);
+	} else {
+		*filepos = dumped_pos;
+		r = 1;
+	}
+	sigaction(SIGBUS, &old_sa, NULL);
+	munmap(map, map_len);
+	return r;
+}
+#endif
+
+static int dump_read(int fd, const char *name, off_t start, off_t count, off_t *filepos) {
+	static unsigned char buf[READ_BUF_SIZE];
+	size_t pending = 0;
+	while(1) {
+		size_t read_len = sizeof buf - pending;
+		size_t done;
+		ssize_t res;
+		if(count > 0 && start + count - (*filepos + (off_t)pending) < (off_t)read_len) {
+			read_len = start + count - (*filepos + pending);
+		}
+		res = read_len ? read(fd, buf + pending, read_len) : 0;
+		if(res < 0) {
+			if(errno == EINTR) continue;
+			dump_lines(buf, pending, *filepos, start, 1);
+			flush_output();
+			printf("Read error on %s, offset %lld len %lu, %s\n",
+				name, (long long int)(*filepos + pending), (unsigned long int)read_len, strerror(errno));
+			return -1;
+		}
+		pending += res;
+		done = dump_lines(buf, pending, *filepos, start, res == 0);
+		*filepos += done;
+		pending -= done;
+		if(pending) memmove(buf, buf + done, pending);
+		if(res == 0) return 0;
+	}
+}
+
 int hd_main(int argc, char *argv[]) {
 	int fd;
-	unsigned char buf[4096];
-	int res;
-	int read_len;
-	//int rv = 0;
-	int i;
-	int filepos = 0;
-	int sum;
-	int lsum;
-
-	int base = -1;
-	int count = 0;
+	off_t filepos = 0;
+	off_t start;
+
+	off_t base = -1;
+	off_t count = 0;
 	int repeat = 0;
 
 	while(1) {
-		int c = getopt(argc, argv, "b:c:r:");
+		int c = getopt(argc, argv, "b:c:dr:");
 		if(c == -1) break;
 		switch(c) {
 			case 'b':
-				base = strtol(optarg, NULL, 0);
+				base = strtoll(optarg, NULL, 0);
 				break;
 			case 'c':
-				count = strtol(optarg, NULL, 0);
+				count = strtoll(optarg, NULL, 0);
+				break;
+			case 'd':
+				delta = 1;
 				break;
 			case 'r':
 				repeat = strtol(optarg, NULL, 0);
@@ -50,7 +245,11 @@ int hd_main(int argc, char *argv[]) {
 	}
 
 	if(optind + 1 != argc) {
-		fprintf(stderr, "Usage: %s [-b <base>] [-c <count>] [-r <delay>] <file>\n", argv[0]);
+		fprintf(stderr, "Usage: %s [-b <base>] [-c <count>] [-r <delay> [-d]] <file>\n", argv[0]);
+		return -1;
+	}
+	if(delta && !repeat) {
+		fprintf(stderr, "%s: -d requires -r\n", argv[0]);
 		return -1;
 	}
 
@@ -60,40 +259,31 @@ int hd_main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	start = base >= 0 ? base : 0;
 	do {
-		if(base >= 0) {
-			lseek(fd, base, SEEK_SET);
-			filepos = base;
-		}
+		int mapped = -1;
 		sum = 0;
-		lsum = 0;
-		while(1) {
-			read_len = sizeof(buf);
-			if(count > 0 && base + count - filepos < read_len) {
-				read_len = base + count - filepos;
-			}
-			res = read(fd, buf, read_len);
-			if(res == 0) break;
-			for(i = 0; i < res; i++) {
-				if((i & 15) == 0) {
-					printf("%08x: ", filepos + i);
-				}
-				lsum += buf[i];
-				sum += buf[i];
-				printf("%02x ", buf[i]);
-				if(((i & 15) == 15) || (i == res - 1)) {
-					printf("s %x\n", lsum);
-					lsum = 0;
-				}
+		changed_lines = 0;
+#ifndef _WIN32
+		mapped = dump_mapped(fd, start, count, &filepos);
+#endif
+		if(mapped) {
+			if(mapped > 0) {
+				// Truncated while mapped, read whatever is left after the last line
+				lseek(fd, filepos, SEEK_SET);
+			} else if(base >= 0 || filepos > 0) {
+				// Non-seekable files just continue from where the last pass ended
+				if(lseek(fd, start, SEEK_SET) != -1) filepos = start;
 			}
-			if(res < 0) {
-				printf("Read error on %s, offset %d len %d, %s\n", argv[optind], filepos, read_len, strerror(errno));
-				return 1;
-			}
-			filepos += res;
-			if(filepos == base + count) break;
+			if(dump_read(fd, argv[optind], start, count, &filepos) < 0) return 1;
+		}
+		if(!delta || changed_lines) {
+			if(out_len + MAX_LINE_LEN > sizeof out_buf) flush_output();
+			memcpy(out_buf + out_len, "sum ", 4);
+			out_len = put_hex(out_buf + out_len + 4, sum, 1) - out_buf;
+			out_buf[out_len++] = '\n';
 		}
-		printf("sum %x\n", sum);
+		flush_output();
 		if(repeat) sleep(repeat);
 	} while(repeat);
 
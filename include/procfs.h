@@ -0,0 +1,123 @@
+/*	Reading processes and threads from /proc, shared by ps, top, lsof and schedtop.
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+#ifndef _PROCFS_H
+#define _PROCFS_H
+
+#include <sys/types.h>
+
+/*
+ * Directories are listed with getdents(2) straight into an array of ids,
+ * and files are opened relative to a descriptor for /proc. The parsers
+ * scan numbers in place in a NUL-terminated buffer, which may come from a
+ * file the caller keeps open, and the name in stat is pointed to rather
+ * than copied. procfs_read() only opens the files behind the bits it is
+ * given.
+ */
+
+#define PROCFS_STAT		(1U << 0)
+#define PROCFS_STATUS		(1U << 1)
+#define PROCFS_STATM		(1U << 2)
+#define PROCFS_SCHEDSTAT	(1U << 3)
+#define PROCFS_CMDLINE		(1U << 4)
+#define PROCFS_OWNER		(1U << 5)	/* owner of /proc/<pid> */
+
+#define PROCFS_STAT_SIZE 1024
+#define PROCFS_CMDLINE_SIZE 4096
+#define PROCFS_STATUS_SIZE 4096
+
+/* Named as in proc(5) */
+struct procfs_stat {
+	const char *comm;		/* into the buffer, not terminated */
+	size_t comm_len;
+	char state;
+	pid_t ppid, pgrp, session;
+	int tty_nr;
+	pid_t tpgid;
+	unsigned long int minflt, majflt;
+	unsigned long int utime, stime;	/* clock ticks */
+	long int cutime, cstime;
+	long int priority, nice, num_threads;
+	unsigned long long int starttime;
+	unsigned long int vsize;	/* bytes */
+	long int rss;			/* pages */
+	unsigned long int kstkeip, wchan;
+	int processor;
+	unsigned int rt_priority, policy;
+};
+
+struct procfs_status {
+	uid_t uid, euid;
+	gid_t gid, egid;
+	pid_t tgid;
+	int threads;
+	long int vm_size, vm_rss, vm_swap;	/* KiB, -1 for kernel threads */
+	unsigned long int voluntary_ctxt_switches, nonvoluntary_ctxt_switches;
+};
+
+struct procfs_statm {
+	unsigned long int size, resident, shared, text, data;	/* pages */
+};
+
+struct procfs_schedstat {
+	unsigned long long int exec_time, delay_time;	/* ns */
+	unsigned long int run_count;
+};
+
+/* /proc/<pid>/fdinfo/<fd> */
+struct procfs_fdinfo {
+	unsigned long long int pos;
+	unsigned int flags;		/* O_* the file was opened with */
+	int mnt_id;
+};
+
+struct procfs_task {
+	pid_t pid, tid;			/* tid is 0 for the process */
+	unsigned int fields;		/* PROCFS_* read so far for this task */
+	uid_t owner;
+	struct procfs_stat stat;
+	struct procfs_status status;
+	struct procfs_statm statm;
+	struct procfs_schedstat schedstat;
+	size_t cmdline_len;		/* arguments are separated by NULs */
+	char stat_buf[PROCFS_STAT_SIZE];
+	char cmdline[PROCFS_CMDLINE_SIZE];
+};
+
+/* Returns a descriptor for /proc, or -1 */
+extern int procfs_open(void);
+
+/* Puts the numeric names in the directory into the array, which is grown
+ * as needed and may be reused from call to call; returns how many there
+ * were, or -1 */
+extern ssize_t procfs_list(int dir_fd, pid_t **ids, size_t *size);
+
+/* Same for the threads of a process */
+extern ssize_t procfs_tasks(int proc_fd, pid_t pid, pid_t **ids, size_t *size);
+
+/* Reads the given PROCFS_* files of the task, adding to what was read
+ * before for the same pid and tid; returns -1 if any of them couldn't be
+ * read, which mostly means the task is gone */
+extern int procfs_read(int proc_fd, pid_t pid, pid_t tid, unsigned int fields, struct procfs_task *task);
+
+/* Read from the start of a file into buf and terminate it; returns the length or -1 */
+extern ssize_t procfs_read_file(int fd, char *buf, size_t size);
+extern ssize_t procfs_read_at(int proc_fd, const char *path, char *buf, size_t size);
+
+/* The parsers return -1 if the buffer doesn't look right */
+extern int procfs_parse_stat(const char *buf, struct procfs_stat *stat);
+extern int procfs_parse_status(const char *buf, struct procfs_status *status);
+extern int procfs_parse_statm(const char *buf, struct procfs_statm *statm);
+extern int procfs_parse_schedstat(const char *buf, struct procfs_schedstat *schedstat);
+extern int procfs_parse_fdinfo(const char *buf, struct procfs_fdinfo *fdinfo);
+
+/* The scanners under the parsers, for files they don't cover */
+extern const char *procfs_skip_fields(const char *p, int n);
+extern unsigned long int procfs_scan_ulong(const char **p);
+extern unsigned long long int procfs_scan_ull(const char **p);
+
+#endif
@@ -11,6 +11,9 @@ TOOL(chroot)
 TOOL(clear)
 #endif
 TOOL(cmp)
+#ifndef _WINDOWSNT_NATIVE
+TOOL(cp)
+#endif
 TOOL(date)
 #ifndef _WINDOWSNT_NATIVE
 TOOL(dd)
@@ -14,6 +14,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <errno.h>
@@ -22,6 +24,9 @@
 #include <unistd.h>
 #include <time.h>
 #include <math.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
 
 #if !defined __linux__ && !defined _NO_SELINUX
 #define _NO_SELINUX
@@ -29,13 +34,13 @@
 
 #ifdef _NO_SELINUX
 #ifdef _WIN32
-#define SHORT_OPTIONS "AadFhilpRs"
+#define SHORT_OPTIONS "AadFfhilpRrSstUX"
 #else
-#define SHORT_OPTIONS "AadFhilnpRs"
+#define SHORT_OPTIONS "AadFfhilnpRrSstUX"
 #endif
 #else
 //#define SHORT_OPTIONS "lsRdZAaFpnih"
-#define SHORT_OPTIONS "AadFhilnpRsZ"
+#define SHORT_OPTIONS "AadFfhilnpRrSstUXZ"
 #endif
 
 #ifndef _WIN32
@@ -53,6 +58,21 @@
 
 #include <limits.h>
 
+/* Entries are looked up relative to their directory's fd where supported */
+#if defined AT_SYMLINK_NOFOLLOW && !defined _WIN32
+#define HAVE_FSTATAT
+#endif
+
+/* Recursive listings read directories ahead in worker threads */
+#ifdef HAVE_FSTATAT
+#define PARALLEL_RECURSION
+#include <pthread.h>
+#define MAX_LIST_THREADS 16
+#define MAX_READ_AHEAD_DIRS 64
+#endif
+
+#define PATH_BUFFER_SIZE 4096
+
 #ifdef _WINDOWSNT_NATIVE
 // The nativelibc didn't implement snprintf yet
 #if 0
@@ -537,27 +557,13 @@ static void strlist_done(strlist_t *list) {
 	dynarray_done(list);
 }
 
-static int strlist_compare_strings(const void *a, const void *b) {
-	const char *sa = *(const char **)a;
-	const char *sb = *(const char **)b;
-	return strcasecmp(sa, sb);
-}
-
-static void strlist_sort(strlist_t *list) {
-	if(list->count > 0) {
-		qsort(list->items,
-			(size_t)list->count,
-			sizeof(void *),
-			strlist_compare_strings);
-	}
-}
-
 // bits for flags argument
 #define LIST_LONG		(1 << 0)
 #define LIST_ALL		(1 << 1)
 #define LIST_RECURSIVE		(1 << 2)
 #define LIST_DIRECTORIES	(1 << 3)
 #define LIST_SIZE		(1 << 4)
+#define LIST_UNSORTED		(1 << 5)
 #define LIST_CLASSIFY		(1 << 6)
 #define LIST_ALL_ALMOST		(1 << 7)
 #define LIST_MACLABEL		(1 << 8)
@@ -615,26 +621,143 @@ static void mode2str(unsigned int mode, char *out) {
 }
 
 #ifndef _WIN32
-static void user2str(unsigned int uid, char *out) {
-	struct passwd *pw = getpwuid(uid);
-	if(pw) {
-		strcpy(out, pw->pw_name);
-	} else {
-		sprintf(out, "%u", uid);
+/* Names of the user and group ids seen so far, with ids that have no name
+ * cached as their decimal form; a directory usually has few distinct owners */
+struct id_name {
+	unsigned int id;
+	char *name;
+};
+
+struct id_cache {
+	struct id_name *entries;
+	size_t count;
+	size_t size;
+	unsigned long int hits;
+	unsigned long int misses;
+};
+
+static struct id_cache user_cache, group_cache;
+static bool print_id_cache_stats = false;
+
+static size_t id_hash(unsigned int id, size_t size) {
+	return (id * 2654435761U) & (size - 1);
+}
+
+static void id_cache_grow(struct id_cache *cache) {
+	size_t new_size = cache->size ? cache->size * 2 : 64;
+	struct id_name *new_entries = calloc(new_size, sizeof *new_entries);
+	size_t i;
+	if(!new_entries) abort();
+	for(i = 0; i < cache->size; i++) {
+		struct id_name *e = cache->entries + i;
+		size_t j;
+		if(!e->name) continue;
+		j = id_hash(e->id, new_size);
+		while(new_entries[j].name) j = (j + 1) & (new_size - 1);
+		new_entries[j] = *e;
 	}
+	free(cache->entries);
+	cache->entries = new_entries;
+	cache->size = new_size;
 }
 
-static void group2str(unsigned int gid, char *out) {
-	struct group *gr = getgrgid(gid);
-	if(gr) {
-		strcpy(out, gr->gr_name);
-	} else {
-		sprintf(out, "%u", gid);
+static const char *id_cache_lookup(struct id_cache *cache, unsigned int id, const char *(*resolve)(unsigned int)) {
+	const char *name;
+	size_t i;
+	if(cache->count * 2 >= cache->size) id_cache_grow(cache);
+	i = id_hash(id, cache->size);
+	while(cache->entries[i].name) {
+		if(cache->entries[i].id == id) {
+			cache->hits++;
+			return cache->entries[i].name;
+		}
+		i = (i + 1) & (cache->size - 1);
 	}
+	cache->misses++;
+	name = resolve(id);
+	if(name) cache->entries[i].name = strdup(name);
+	else {
+		char buffer[16];
+		sprintf(buffer, "%u", id);
+		cache->entries[i].name = strdup(buffer);
+	}
+	if(!cache->entries[i].name) abort();
+	cache->entries[i].id = id;
+	cache->count++;
+	return cache->entries[i].name;
+}
+
+static void id_cache_done(struct id_cache *cache, const char *what) {
+	size_t i;
+	if(print_id_cache_stats) {
+		fprintf(stderr, "ls: %s name cache: %lu hits, %lu misses\n", what, cache->hits, cache->misses);
+	}
+	for(i = 0; i < cache->size; i++) free(cache->entries[i].name);
+	free(cache->entries);
+	memset(cache, 0, sizeof *cache);
+}
+
+static const char *resolve_user(unsigned int uid) {
+	struct passwd *pw = getpwuid(uid);
+	return pw ? pw->pw_name : NULL;
+}
+
+static const char *resolve_group(unsigned int gid) {
+	struct group *gr = getgrgid(gid);
+	return gr ? gr->gr_name : NULL;
+}
+
+static const char *user2str(unsigned int uid) {
+	return id_cache_lookup(&user_cache, uid, resolve_user);
+}
+
+static const char *group2str(unsigned int gid) {
+	return id_cache_lookup(&group_cache, gid, resolve_group);
+}
+#endif
+
+/* A file to list. Its name is relative to the directory dirname, which is
+ * open as dirfd; for command line arguments dirname is NULL and name is the
+ * path as given */
+struct file_ref {
+	const char *dirname;
+	const char *name;
+#ifdef HAVE_FSTATAT
+	int dirfd;
+#endif
+};
+
+/* Returns the full path of the file, building it in buffer if needed */
+static const char *ref_path(const struct file_ref *ref, char *buffer, size_t size) {
+	const char *slash = "/";
+	if(!ref->dirname) return ref->name;
+	if(ref->dirname[strlen(ref->dirname) - 1] == '/') slash = "";
+	snprintf(buffer, size, "%s%s%s", ref->dirname, slash, ref->name);
+	return buffer;
 }
+
+static int ref_stat(const struct file_ref *ref, struct stat *st, int follow) {
+#ifdef HAVE_FSTATAT
+	return fstatat(ref->dirfd, ref->name, st, follow ? 0 : AT_SYMLINK_NOFOLLOW);
+#else
+	char buffer[PATH_BUFFER_SIZE];
+	const char *path = ref_path(ref, buffer, sizeof buffer);
+	return follow ? stat(path, st) : lstat(path, st);
 #endif
+}
 
-static int get_file_color_by_mode(mode_t mode, const char *pathname) {
+#if !defined _WIN32 || defined _WINDOWSNT_NATIVE
+static ssize_t ref_readlink(const struct file_ref *ref, char *buffer, size_t size) {
+#ifdef HAVE_FSTATAT
+	return readlinkat(ref->dirfd, ref->name, buffer, size);
+#else
+	char path_buffer[PATH_BUFFER_SIZE];
+	return readlink(ref_path(ref, path_buffer, sizeof path_buffer), buffer, size);
+#endif
+}
+#endif
+
+static int get_file_color_by_mode(mode_t mode, const struct file_ref *ref) {
 	switch(mode & S_IFMT) {
 		case S_IFDIR:
 			return COLOR_BOLD_BLUE;
@@ -645,9 +768,9 @@ static int get_file_color_by_mode(mode_t mode, const char *pathname) {
 		case S_IFCHR:
 			return COLOR_BOLD_YELLOW | (COLOR_BACKGROUND_BLACK << 16);
 		case S_IFLNK:
-			if(pathname) {
+			if(ref) {
 				struct stat st;
-				if(stat(pathname, &st) < 0) return COLOR_BOLD_RED;
+				if(ref_stat(ref, &st, 1) < 0) return COLOR_BOLD_RED;
 			}
 			return COLOR_BOLD_CRAN;
 #endif
@@ -666,10 +789,13 @@ static int get_file_color_by_mode(mode_t mode, const char *pathname) {
 	}
 }
 
-static int get_file_color(const char *pathname) {
-	struct stat st;
-	if(lstat(pathname, &st) < 0) return NO_COLOR;
-	return get_file_color_by_mode(st.st_mode, pathname);
+static int get_file_color(const struct file_ref *ref, const struct stat *st) {
+	struct stat s;
+	if(!st) {
+		if(ref_stat(ref, &s, 0) < 0) return NO_COLOR;
+		st = &s;
+	}
+	return get_file_color_by_mode(st->st_mode, ref);
 }
 
 static double human_readable_d(double n, int *unit) {
@@ -697,30 +823,333 @@ static double human_readable_d(double n, int *unit) {
 	}
 }
 
-static int show_total_size(const char *dirname, DIR *d, int flags) {
-	struct dirent *de;
-	char tmp[1024];
-	struct stat s;
-	unsigned int sum = 0;
+/* A directory entry with the attributes fetched for it while reading the
+ * directory; stat_errno is -1 if nothing was fetched, in which case st isn't
+ * even allocated, and st only has its type bits set if they came from d_type */
+struct file_entry {
+	char *name;
+	int stat_errno;
+	struct stat st;
+};
 
-	/* run through the directory and sum up the file block sizes */
-	while((de = readdir(d))) {
-		if(!(flags & LIST_ALL) && (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)) continue;
-		if(de->d_name[0] == '.' && !(flags & LIST_ALL) && !(flags & LIST_ALL_ALMOST)) continue;
-		const char *slash = "/";
-		if(dirname[strlen(dirname) - 1] == '/') slash = "";
-		snprintf(tmp, sizeof(tmp), "%s%s%s", dirname, slash, de->d_name);
-
-		if(lstat(tmp, &s) < 0) {
-			fprintf(stderr, "ls: stat '%s' failed: %s\n", tmp, strerror(errno));
-			rewinddir(d);
-			return -1;
+/* Entries are packed into a few growing chunks instead of being allocated
+ * one by one; the sort works on an array of keys caching the first bytes
+ * of each name, so most comparisons never touch the entries at all */
+#define ARENA_ALIGN 8
+#define ARENA_MIN_CHUNK (4 * 1024)
+#define ARENA_MAX_CHUNK (256 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	size_t pad;
+	char data[];
+};
+
+struct sort_key {
+	unsigned long long int prefix;	/* case folded, big endian */
+	long long int value;		/* time or size to sort on */
+	struct file_entry *entry;
+};
+
+enum { SORT_NAME, SORT_TIME, SORT_SIZE, SORT_EXTENSION };
+
+static int sort_by = SORT_NAME;
+static bool sort_reverse = false;
+static int max_entries = 0;
+
+struct entry_list {
+	struct arena_chunk *chunks;
+	struct sort_key *keys;
+	int count;
+	int capacity;
+	unsigned int total;			/* for the total line, over all entries */
+	const struct file_entry *total_failed;	/* an entry that couldn't be stat'ed */
+};
+
+#define ENTRY_LIST_INITIALIZER { NULL, NULL, 0, 0, 0, NULL }
+
+#define FOREACH_ENTRY(_entries,_entry,_stmnt) \
+	do { \
+		int _nn_##__LINE__ = 0; \
+		for(;_nn_##__LINE__ < (_entries)->count; ++ _nn_##__LINE__) { \
+			struct file_entry *_entry = (_entries)->keys[_nn_##__LINE__].entry; \
+			_stmnt; \
+		} \
+	} while(0)
+
+static void *arena_alloc(struct entry_list *list, size_t size) {
+	struct arena_chunk *chunk = list->chunks;
+	void *p;
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if(!chunk || chunk->size - chunk->used < size) {
+		size_t chunk_size = chunk ? chunk->size * 2 : ARENA_MIN_CHUNK;
+		if(chunk_size > ARENA_MAX_CHUNK) chunk_size = ARENA_MAX_CHUNK;
+		if(chunk_size < size) chunk_size = size;
+		chunk = malloc(sizeof *chunk + chunk_size);
+		if(!chunk) abort();
+		chunk->next = list->chunks;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		list->chunks = chunk;
+	}
+	p = chunk->data + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+/* Gives back the most recent allocation */
+static void arena_release(struct entry_list *list, void *p) {
+	list->chunks->used = (char *)p - list->chunks->data;
+}
+
+static unsigned long long int name_prefix(const char *name) {
+	unsigned long long int prefix = 0;
+	int i;
+	for(i = 0; i < 8; i++) {
+		prefix <<= 8;
+		if(*name) prefix |= (unsigned char)tolower((unsigned char)*name++);
+	}
+	return prefix;
+}
+
+/* Files without an extension sort first */
+static const char *name_extension(const char *name) {
+	const char *dot = strrchr(name, '.');
+	return dot ? dot + 1 : "";
+}
+
+static void entries_append(struct entry_list *list, struct file_entry *entry) {
+	struct sort_key *key;
+	if(list->count >= list->capacity) {
+		int new_cap = list->capacity ? list->capacity * 2 : 64;
+		struct sort_key *keys;
+		if(new_cap <= list->capacity || (size_t)new_cap > (size_t)-1 / sizeof *keys) abort();
+		keys = realloc(list->keys, new_cap * sizeof *keys);
+		if(!keys) abort();
+		list->keys = keys;
+		list->capacity = new_cap;
+	}
+	key = list->keys + list->count++;
+	key->entry = entry;
+	key->value = 0;
+	key->prefix = name_prefix(sort_by == SORT_EXTENSION ? name_extension(entry->name) : entry->name);
+	if(entry->stat_errno) return;
+	if(sort_by == SORT_TIME) {
+		key->value = (long long int)entry->st.st_mtime * 1000000000;
+#ifdef __linux__
+		key->value += entry->st.st_mtim.tv_nsec;
+#endif
+	} else if(sort_by == SORT_SIZE) {
+		key->value = entry->st.st_size;
+	}
+}
+
+static void entries_done(struct entry_list *list) {
+	while(list->chunks) {
+		struct arena_chunk *next = list->chunks->next;
+		free(list->chunks);
+		list->chunks = next;
+	}
+	free(list->keys);
+	list->keys = NULL;
+	list->count = list->capacity = 0;
+}
+
+static int compare_names(const char *a, const char *b) {
+	int r = strcasecmp(a, b);
+	return r ? r : strcmp(a, b);
+}
+
+/* Orders by the sort key first, then by name, so that sorting is
+ * deterministic and files with equal times or sizes stay in name order */
+static int compare_keys(const struct sort_key *a, const struct sort_key *b) {
+	int r;
+	if(a->value != b->value) {
+		r = a->value > b->value ? -1 : 1;
+	} else if(a->prefix != b->prefix) {
+		r = a->prefix < b->prefix ? -1 : 1;
+	} else if(sort_by == SORT_EXTENSION) {
+		r = compare_names(name_extension(a->entry->name), name_extension(b->entry->name));
+		if(!r) r = compare_names(a->entry->name, b->entry->name);
+	} else if(a->prefix & 0xff) {
+		// Equal prefixes already cover the first 8 bytes of both names
+		r = strcasecmp(a->entry->name + 8, b->entry->name + 8);
+		if(!r) r = strcmp(a->entry->name, b->entry->name);
+	} else {
+		// A padding byte means both names ended within the prefix
+		r = strcmp(a->entry->name, b->entry->name);
+	}
+	return sort_reverse ? -r : r;
+}
+
+/* A stable merge sort, tmp has room for n / 2 keys */
+static void sort_keys(struct sort_key *keys, struct sort_key *tmp, size_t n) {
+	size_t half, i, j, k;
+	if(n < 16) {
+		for(i = 1; i < n; i++) {
+			struct sort_key key = keys[i];
+			for(j = i; j > 0 && compare_keys(&key, &keys[j - 1]) < 0; j--) keys[j] = keys[j - 1];
+			keys[j] = key;
+		}
+		return;
+	}
+	half = n / 2;
+	sort_keys(keys, tmp, half);
+	sort_keys(keys + half, tmp, n - half);
+	if(compare_keys(&keys[half - 1], &keys[half]) <= 0) return;
+	memcpy(tmp, keys, half * sizeof *keys);
+	i = 0;
+	j = half;
+	k = 0;
+	while(i < half && j < n) keys[k++] = compare_keys(&keys[j], &tmp[i]) < 0 ? keys[j++] : tmp[i++];
+	while(i < half) keys[k++] = tmp[i++];
+}
+
+static void sift_down(struct sort_key *heap, int n, int i) {
+	struct sort_key key = heap[i];
+	while(1) {
+		int child = 2 * i + 1;
+		if(child >= n) break;
+		if(child + 1 < n && compare_keys(&heap[child + 1], &heap[child]) > 0) child++;
+		if(compare_keys(&heap[child], &key) <= 0) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = key;
+}
+
+/* Moves the first max_entries keys in sort order to the front, keeping
+ * the last one seen at the root of a heap */
+static void select_keys(struct entry_list *list) {
+	struct sort_key *keys = list->keys;
+	int n = max_entries, i;
+	for(i = n / 2 - 1; i >= 0; i--) sift_down(keys, n, i);
+	for(i = n; i < list->count; i++) {
+		if(compare_keys(&keys[i], &keys[0]) < 0) {
+			keys[0] = keys[i];
+			sift_down(keys, n, 0);
+		}
+	}
+	list->count = n;
+}
+
+/* Sums the block sizes for the total line, before --max drops anything */
+static void sum_blocks(struct entry_list *list) {
+	list->total = 0;
+	list->total_failed = NULL;
+	FOREACH_ENTRY(list, entry, {
+		if(entry->stat_errno) {
+			list->total_failed = entry;
+			return;
 		}
 #if defined _WIN32 && !defined _WINDOWSNT_NATIVE
-		sum += s.st_size / 1024;		// XXX
+		list->total += entry->st.st_size / 1024;		// XXX
 #else
-		sum += s.st_blocks / 2;
+		list->total += entry->st.st_blocks / 2;
+#endif
+	});
+}
+
+/* Puts the entries in listing order, dropping those past max_entries */
+static void entries_sort(struct entry_list *list, int flags) {
+	struct sort_key *tmp;
+	if(flags & (LIST_SIZE | LIST_LONG)) sum_blocks(list);
+	if(max_entries && list->count > max_entries) {
+		if(flags & LIST_UNSORTED) list->count = max_entries;
+		else select_keys(list);
+	}
+	if(list->count < 2 || (flags & LIST_UNSORTED)) return;
+	tmp = malloc(list->count / 2 * sizeof *tmp);
+	if(!tmp) abort();
+	sort_keys(list->keys, tmp, list->count);
+	free(tmp);
+}
+
+#ifdef DT_UNKNOWN
+static mode_t dtype_to_mode(unsigned char type) {
+	switch(type) {
+		case DT_DIR: return S_IFDIR;
+		case DT_REG: return S_IFREG;
+		case DT_LNK: return S_IFLNK;
+		case DT_FIFO: return S_IFIFO;
+		case DT_SOCK: return S_IFSOCK;
+		case DT_CHR: return S_IFCHR;
+		case DT_BLK: return S_IFBLK;
+		default: return 0;
+	}
+}
+#endif
+
+/* Whether listing needs every attribute, or only the file type */
+static int need_full_stat(int flags) {
+	if(!(flags & LIST_UNSORTED) && (sort_by == SORT_TIME || sort_by == SORT_SIZE)) return 1;
+	return is_color || (flags & (LIST_LONG | LIST_SIZE | LIST_CLASSIFY | LIST_MACLABEL | LIST_INODE));
+}
+
+static int need_file_type(int flags) {
+	return flags & (LIST_RECURSIVE | LIST_PATH_SLASH | LIST_FILE_TYPE);
+}
+
+static int listfile(const struct file_ref *ref, const struct stat *st, int flags);
+
+/* Reads the directory in one pass, fetching each entry's attributes once.
+ * When streaming, entries are listed as they are read, and only those the
+ * recursion still needs are kept */
+static void read_entries(DIR *d, struct file_ref *dir, struct entry_list *entries, int flags, int stream) {
+	struct dirent *de;
+	int list_all = flags & LIST_ALL;
+	int full_stat = need_full_stat(flags);
+	int type_only = !full_stat && need_file_type(flags);
+	size_t head_size = full_stat || type_only ? sizeof(struct file_entry) : offsetof(struct file_entry, st);
+	int listed = 0;
+
+	while((de = readdir(d))) {
+		struct file_entry *entry;
+		size_t len;
+		if(stream && max_entries && listed == max_entries) break;
+		if(!list_all && (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)) continue;
+		if(de->d_name[0] == '.' && !list_all && !(flags & LIST_ALL_ALMOST)) continue;
+
+		len = strlen(de->d_name);
+		entry = arena_alloc(entries, head_size + len + 1);
+		entry->name = (char *)entry + head_size;
+		memcpy(entry->name, de->d_name, len + 1);
+		entry->stat_errno = -1;
+#ifdef DT_UNKNOWN
+		if(type_only && (entry->st.st_mode = dtype_to_mode(de->d_type))) {
+			entry->stat_errno = 0;
+		} else
 #endif
+		if(full_stat || type_only) {
+			dir->name = entry->name;
+			entry->stat_errno = ref_stat(dir, &entry->st, 0) < 0 ? errno : 0;
+		}
+		if(stream) {
+			dir->name = entry->name;
+			listfile(dir, entry->stat_errno ? NULL : &entry->st, flags);
+			listed++;
+			if(!(flags & LIST_RECURSIVE) || (!entry->stat_errno && !S_ISDIR(entry->st.st_mode))) {
+				arena_release(entries, entry);
+				continue;
+			}
+		}
+		entries_append(entries, entry);
+	}
+}
+
+/* Shows the total that entries_sort() summed up */
+static int show_total_size(const struct file_ref *dir, const struct entry_list *entries, int flags) {
+	unsigned int sum = entries->total;
+
+	if(entries->total_failed) {
+		char buffer[PATH_BUFFER_SIZE];
+		struct file_ref ref = *dir;
+		ref.name = entries->total_failed->name;
+		fprintf(stderr, "ls: stat '%s' failed: %s\n",
+			ref_path(&ref, buffer, sizeof buffer), strerror(entries->total_failed->stat_errno));
+		return -1;
 	}
 
 	if(flags & LIST_HUMAN_READABLE) {
@@ -729,7 +1158,6 @@ static int show_total_size(const char *dirname, DIR *d, int flags) {
 		if(isnan(n)) return -1;
 		printf("total %.1f%ci\n", n, unit);
 	} else printf("total %u\n", sum);
-	rewinddir(d);
 	return 0;
 }
 
@@ -742,11 +1170,14 @@ static void show_inode(const struct stat *st) {
 #endif
 }
 
-static int listfile_other(const char *path, const char *filename, const struct stat *st, int flags) {
+static int listfile_other(const struct file_ref *ref, const char *filename, const struct stat *st, int flags) {
+	char path_buffer[PATH_BUFFER_SIZE];
 	struct stat s;
 	if(!st) {
-		if(lstat(path, &s) < 0) {
-			fprintf(stderr, "ls: lstat '%s' failed: %s\n", path, strerror(errno));
+		if(ref_stat(ref, &s, 0) < 0) {
+			int e = errno;
+			fprintf(stderr, "ls: lstat '%s' failed: %s\n",
+				ref_path(ref, path_buffer, sizeof path_buffer), strerror(e));
 			return -1;
 		}
 		st = &s;
@@ -775,10 +1206,12 @@ static int listfile_other(const char *path, const char *filename, const struct s
 			printf("%c ", filetype);
 		} else {
 			struct stat link_dest;
-			if(stat(path, &link_dest) == 0) {
+			if(ref_stat(ref, &link_dest, 1) == 0) {
 				printf("l%c ", mode2kind(link_dest.st_mode));
 			} else {
-				fprintf(stderr, "ls: stat '%s' failed: %s\n", path, strerror(errno));
+				int e = errno;
+				fprintf(stderr, "ls: stat '%s' failed: %s\n",
+					ref_path(ref, path_buffer, sizeof path_buffer), strerror(e));
 				printf("l? ");
 			}
 		}
@@ -800,28 +1233,33 @@ static int listfile_other(const char *path, const char *filename, const struct s
 	}
 #endif
 
-	if(is_color) printf_color(get_file_color_by_mode(st->st_mode, path), "%V%s%v%s\n", filename, suffix);
+	if(is_color) printf_color(get_file_color_by_mode(st->st_mode, ref), "%V%s%v%s\n", filename, suffix);
 	else printf("%s%s\n", filename, suffix);
 
 	return 0;
 }
 
-static int listfile_long(const char *path, int flags) {
+static int listfile_long(const struct file_ref *ref, const struct stat *st, int flags) {
 	//fprintf(stderr, "function: listfile_long(%p<%s>, %d)\n", path, path, flags);
+	const char *path = ref->name;
 	struct stat s;
 	char date[32];
 	char mode[16];
-	char user[16];
-	char group[16];
+	char uid_buffer[16];
+	char gid_buffer[16];
+	const char *user = uid_buffer;
+	const char *group = gid_buffer;
 	const char *name;
 	char size[16];
 
-	if((flags & LIST_DIRECTORIES) || !(name = strrchr(path, '/')) || !*++name) name = path;
+	if(ref->dirname || (flags & LIST_DIRECTORIES) || !(name = strrchr(path, '/')) || !*++name) name = path;
 
-	if(lstat(path, &s) < 0) {
+	if(st) s = *st;
+	else if(ref_stat(ref, &s, 0) < 0) {
+		char path_buffer[PATH_BUFFER_SIZE];
 		int e = errno;
 		//perror(path);
-		fprintf(stderr, "ls: lstat '%s' failed: %s\n", path, strerror(e));
+		fprintf(stderr, "ls: lstat '%s' failed: %s\n", ref_path(ref, path_buffer, sizeof path_buffer), strerror(e));
 		if(e != ENOENT) {
 			printf("??????????   ? ?      ?             ? \?\?\?\?-\?\?-\?\? \?\?:\?\? %s\n", name);
 		}
@@ -838,13 +1276,13 @@ static int listfile_long(const char *path, int flags) {
 //		sprintf(user, "%lu", s.st_uid);
 //		sprintf(group, "%lu", s.st_gid);
 //#else
-		sprintf(user, "%u", (unsigned int)s.st_uid);
-		sprintf(group, "%u", (unsigned int)s.st_gid);
+		sprintf(uid_buffer, "%u", (unsigned int)s.st_uid);
+		sprintf(gid_buffer, "%u", (unsigned int)s.st_gid);
 //#endif
 #ifndef _WIN32
 	} else {
-		user2str(s.st_uid, user);
-		group2str(s.st_gid, group);
+		user = user2str(s.st_uid);
+		group = group2str(s.st_gid);
 	}
 #endif
 
@@ -932,7 +1370,7 @@ static int listfile_long(const char *path, int flags) {
 			struct stat st_linkto;
 			const char *suffix = "";
 
-			len = readlink(path, linkto, 256);
+			len = ref_readlink(ref, linkto, 256);
 			if(len < 0) color = COLOR_BOLD_RED;
 			else {
 				if(len > 255) {
@@ -943,7 +1381,7 @@ static int listfile_long(const char *path, int flags) {
 				} else {
 					linkto[len] = 0;
 				}
-				if(stat(path, &st_linkto) < 0) color = COLOR_BOLD_RED;
+				if(ref_stat(ref, &st_linkto, 1) < 0) color = COLOR_BOLD_RED;
 			}
 
 			printf_color(color, "%s %3u %-6s %-6s %8s %s %V%s%v",
@@ -976,19 +1414,25 @@ static int listfile_long(const char *path, int flags) {
 }
 
 #ifndef _NO_SELINUX
-static int listfile_maclabel(const char *path, int flags) {
+static int listfile_maclabel(const struct file_ref *ref, const struct stat *st, int flags) {
 	//fprintf(stderr, "function: listfile_maclabel(%p<%s>, 0x%x)\n", path, path, flags);
+	char path_buffer[PATH_BUFFER_SIZE];
+	const char *path = ref_path(ref, path_buffer, sizeof path_buffer);
 	struct stat s;
 	char mode[16];
-	char user[16];
-	char group[16];
+	char uid_buffer[16];
+	char gid_buffer[16];
+	const char *user = uid_buffer;
+	const char *group = gid_buffer;
 	char *maclabel = NULL;
 	const char *name;
 	char size[16];
 
-	if((flags & LIST_DIRECTORIES) || !(name = strrchr(path, '/')) || !*++name) name = path;
+	if(ref->dirname) name = ref->name;
+	else if((flags & LIST_DIRECTORIES) || !(name = strrchr(path, '/')) || !*++name) name = path;
 
-	if(lstat(path, &s) < 0) {
+	if(st) s = *st;
+	else if(lstat(path, &s) < 0) {
 		perror(path);
 		return -1;
 	}
@@ -1011,8 +1455,8 @@ static int listfile_maclabel(const char *path, int flags) {
 
 	if(!(flags & LIST_LONG)) {
 		printf("%s ", maclabel ? : "?");
-		if(flags & (LIST_SIZE | LIST_CLASSIFY)) listfile_other(path, name, &s, flags & ~LIST_INODE);
-		else printf_color(get_file_color_by_mode(s.st_mode, path), "%V%s%v%s\n", name, suffix);
+		if(flags & (LIST_SIZE | LIST_CLASSIFY)) listfile_other(ref, name, &s, flags & ~LIST_INODE);
+		else printf_color(get_file_color_by_mode(s.st_mode, ref), "%V%s%v%s\n", name, suffix);
 		free(maclabel);
 		return 0;
 	}
@@ -1021,12 +1465,12 @@ static int listfile_maclabel(const char *path, int flags) {
 #ifndef _WIN32
 	if(flags & LIST_NUMERIC_ID) {
 #endif
-		sprintf(user, "%u", (unsigned int)s.st_uid);
-		sprintf(group, "%u", (unsigned int)s.st_gid);
+		sprintf(uid_buffer, "%u", (unsigned int)s.st_uid);
+		sprintf(gid_buffer, "%u", (unsigned int)s.st_gid);
 #ifndef _WIN32
 	} else {
-		user2str(s.st_uid, user);
-		group2str(s.st_gid, group);
+		user = user2str(s.st_uid);
+		group = group2str(s.st_gid);
 	}
 #endif
 
@@ -1107,28 +1551,15 @@ static int listfile_maclabel(const char *path, int flags) {
 }
 #endif
 
-static int listfile(const char *dirname, const char *filename, int flags) {
-	//struct stat s;
-	//char file[4096];
-	char tmp[4096];
+static int listfile(const struct file_ref *ref, const struct stat *st, int flags) {
 	const char *name;
-	const char *pathname = filename;
-
-	if(dirname != NULL) {
-		const char *slash = "/";
-		if(dirname[strlen(dirname) - 1] == '/') slash = "";
-		snprintf(tmp, sizeof(tmp), "%s%s%s", dirname, slash, filename);
-		pathname = tmp;
-	} else {
-		pathname = filename;
-	}
 
 	if((flags & (LIST_LONG | LIST_SIZE | LIST_CLASSIFY | LIST_PATH_SLASH | LIST_MACLABEL | LIST_INODE | LIST_FILE_TYPE)) == 0) {
 		/* name is anything after the final '/', or the whole path if none*/
-		if((flags & LIST_DIRECTORIES) || !(name = strrchr(pathname, '/'))) name = pathname;
+		if(ref->dirname || (flags & LIST_DIRECTORIES) || !(name = strrchr(ref->name, '/'))) name = ref->name;
 		else name++;
 
-		if(is_color) printf_color(get_file_color(pathname), "%V%s%v\n", name);
+		if(is_color) printf_color(get_file_color(ref, st), "%V%s%v\n", name);
 		else puts(name);
 
 		return 0;
@@ -1136,96 +1567,311 @@ static int listfile(const char *dirname, const char *filename, int flags) {
 
 #ifndef _NO_SELINUX
 	if(flags & LIST_MACLABEL) {
-		return listfile_maclabel(pathname, flags);
+		return listfile_maclabel(ref, st, flags);
 	} else
 #endif
 	if ((flags & LIST_LONG) != 0) {
-		return listfile_long(pathname, flags);
+		return listfile_long(ref, st, flags);
 	} else {
-		return listfile_other(pathname, filename, NULL, flags);
+		return listfile_other(ref, ref->name, st, flags);
 	}
 }
 
-static int listdir(const char *name, int flags) {
-	char tmp[4096];
-	DIR *d;
-	struct dirent *de;
-	strlist_t files = STRLIST_INITIALIZER;
-	int list_all = flags & LIST_ALL;
+static void list_entries(struct file_ref *dir, const struct entry_list *entries, int flags) {
+	if((flags & LIST_SIZE) || (flags & LIST_LONG)) {
+		show_total_size(dir, entries, flags);
+	}
+
+	FOREACH_ENTRY(entries, entry, {
+		dir->name = entry->name;
+		listfile(dir, entry->stat_errno ? NULL : &entry->st, flags);
+	});
+}
+
+/* Whether the entry is a directory to descend into; reports entries that
+ * couldn't be examined */
+static int is_subdir(struct file_ref *dir, const struct file_entry *entry) {
+	if(strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) return 0;
+	if(entry->stat_errno) {
+		char buffer[PATH_BUFFER_SIZE];
+		dir->name = entry->name;
+		errno = entry->stat_errno;
+		perror(ref_path(dir, buffer, sizeof buffer));
+		return 0;
+	}
+	return S_ISDIR(entry->st.st_mode);
+}
 
+static char *subdir_path(const char *name, const char *subdir) {
+	const char *slash = name[strlen(name) - 1] == '/' ? "" : "/";
+	char *path = malloc(strlen(name) + strlen(slash) + strlen(subdir) + 1);
+	if(!path) abort();
+	sprintf(path, "%s%s%s", name, slash, subdir);
+	return path;
+}
+
+static int listdir(const struct file_ref *parent, const char *name, int flags) {
+	DIR *d;
+	struct entry_list entries = ENTRY_LIST_INITIALIZER;
+	struct file_ref dir = { name, NULL };
+	int stream = (flags & LIST_UNSORTED) && !(flags & (LIST_SIZE | LIST_LONG));
+#ifdef HAVE_FSTATAT
+	int fd = openat(parent ? parent->dirfd : AT_FDCWD, parent ? parent->name : name, O_RDONLY | O_DIRECTORY);
+	d = fd < 0 ? NULL : fdopendir(fd);
+	if(!d && fd >= 0) close(fd);
+#else
 	d = opendir(name);
+#endif
 	if(!d) {
 		fprintf(stderr, "ls: opendir '%s' failed, %s\n", name, strerror(errno));
 		return -1;
 	}
+#ifdef HAVE_FSTATAT
+	dir.dirfd = fd;
+#endif
 
-	if((flags & LIST_SIZE) || (flags & LIST_LONG)) {
-		show_total_size(name, d, flags);
+	read_entries(d, &dir, &entries, flags, stream);
+	if(!stream) {
+		entries_sort(&entries, flags);
+		list_entries(&dir, &entries, flags);
 	}
 
-	while((de = readdir(d))) {
-		if(!list_all && (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)) continue;
-		if(de->d_name[0] == '.' && !list_all && !(flags & LIST_ALL_ALMOST)) continue;
-
-		strlist_append_dup(&files, de->d_name);
+	if(flags & LIST_RECURSIVE) {
+		FOREACH_ENTRY(&entries, entry, {
+			char *path;
+			if(!is_subdir(&dir, entry)) continue;
+			path = subdir_path(name, entry->name);
+			printf("\n%s:\n", path);
+			dir.name = entry->name;
+			listdir(&dir, path, flags);
+			free(path);
+		});
 	}
 
-	strlist_sort(&files);
-	STRLIST_FOREACH(&files, filename, listfile(name, filename, flags));
-	strlist_done(&files);
+	entries_done(&entries);
+	closedir(d);
+	return 0;
+}
+
+#ifdef PARALLEL_RECURSION
+/*
+ * Parallel recursive listing. Worker threads open, read and stat directories
+ * ahead of the printer, which walks the tree depth first exactly like
+ * listdir(), so the output stays the same. Loaded subdirectories are pushed
+ * on a shared stack in reverse order, making the workers prefetch in about
+ * the order the printer will want them; if the printer gets to a directory
+ * nobody has taken yet, it reads it itself. At most MAX_READ_AHEAD_DIRS
+ * directories are loaded and waiting to be printed at any time.
+ */
+
+enum { JOB_QUEUED, JOB_LOADING, JOB_LOADED };
+
+struct dir_job {
+	struct dir_job *parent;
+	char *path;
+	const char *name;		/* opened relative to the parent, if any */
+	int state;
+	int error;
+	DIR *dir;
+	int fd_users;			/* the listing, and the subdirectories not opened yet */
+	struct entry_list entries;
+	dynarray_t children;		/* subdirectories, in listing order */
+	struct dir_job *prev, *next;	/* on the stack while queued */
+};
 
-	if(flags & LIST_RECURSIVE) {
-		strlist_t subdirs = STRLIST_INITIALIZER;
+static int thread_count = -1;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static struct dir_job *job_stack;
+static int jobs_ahead;		/* taken but not printed yet */
+static bool stop_workers;
+
+static struct dir_job *new_job(struct dir_job *parent, char *path, const char *name) {
+	struct dir_job *job = calloc(1, sizeof *job);
+	if(!job) abort();
+	job->parent = parent;
+	job->path = path;
+	job->name = name;
+	return job;
+}
 
-		rewinddir(d);
+/* The stack functions are called with job_lock held */
+static void push_job(struct dir_job *job) {
+	job->prev = NULL;
+	job->next = job_stack;
+	if(job_stack) job_stack->prev = job;
+	job_stack = job;
+}
 
-		while((de = readdir(d))) {
-			struct stat s;
-			int err;
+static void take_job(struct dir_job *job) {
+	if(job->prev) job->prev->next = job->next;
+	else job_stack = job->next;
+	if(job->next) job->next->prev = job->prev;
+	job->state = JOB_LOADING;
+	jobs_ahead++;
+}
 
-			if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
-			if(de->d_name[0] == '.' && !list_all && !(flags & LIST_ALL_ALMOST)) continue;
+/* Drops a user of the job's directory fd, returning the directory to close
+ * once it has none left */
+static DIR *release_job_dir(struct dir_job *job) {
+	DIR *d;
+	if(--job->fd_users) return NULL;
+	d = job->dir;
+	job->dir = NULL;
+	return d;
+}
 
-			const char *slash = "/";
-			if(name[strlen(name) - 1] == '/') slash = "";
-			snprintf(tmp, sizeof(tmp), "%s%s%s", name, slash, de->d_name);
+static void load_job(struct dir_job *job, int flags) {
+	struct dir_job *parent = job->parent;
+	struct file_ref dir = { job->path, NULL };
+	int fd = openat(parent ? dirfd(parent->dir) : AT_FDCWD, job->name, O_RDONLY | O_DIRECTORY);
+	int i;
+
+	if(parent) {
+		DIR *d;
+		pthread_mutex_lock(&job_lock);
+		d = release_job_dir(parent);
+		pthread_mutex_unlock(&job_lock);
+		if(d) closedir(d);
+	}
 
-			/*
-			 * If the name ends in a '/', use stat() so we treat it like a
-			 * directory even if it's a symlink.
-			 */
-			err = (tmp[strlen(tmp)-1] == '/' ? stat : lstat)(tmp, &s);
+	if(fd >= 0 && !(job->dir = fdopendir(fd))) {
+		int e = errno;
+		close(fd);
+		errno = e;
+	}
+	if(!job->dir) job->error = errno;
+	else {
+		dir.dirfd = fd;
+		read_entries(job->dir, &dir, &job->entries, flags, 0);
+		entries_sort(&job->entries, flags);
+		FOREACH_ENTRY(&job->entries, entry, {
+			char *path;
+			if(strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) continue;
+			if(entry->stat_errno || !S_ISDIR(entry->st.st_mode)) continue;
+			path = subdir_path(job->path, entry->name);
+			dynarray_append(&job->children, new_job(job, path, path + strlen(path) - strlen(entry->name)));
+		});
+		job->fd_users = 1 + job->children.count;
+	}
 
-			if(err < 0) {
-				perror(tmp);
-				continue;
-			}
+	pthread_mutex_lock(&job_lock);
+	job->state = JOB_LOADED;
+	i = job->children.count;
+	while(i > 0) push_job(job->children.items[--i]);
+	pthread_cond_broadcast(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+}
 
-			if(S_ISDIR(s.st_mode)) {
-				strlist_append_dup(&subdirs, tmp);
-			}
+static void *job_worker(void *arg) {
+	int flags = *(const int *)arg;
+	pthread_mutex_lock(&job_lock);
+	while(1) {
+		struct dir_job *job;
+		while(!stop_workers && (!job_stack || jobs_ahead >= MAX_READ_AHEAD_DIRS)) {
+			pthread_cond_wait(&job_cond, &job_lock);
 		}
-		strlist_sort(&subdirs);
-		STRLIST_FOREACH(&subdirs, path, {
-			printf("\n%s:\n", path);
-			listdir(path, flags);
-		});
-		strlist_done(&subdirs);
+		if(stop_workers) break;
+		job = job_stack;
+		take_job(job);
+		pthread_mutex_unlock(&job_lock);
+		load_job(job, flags);
+		pthread_mutex_lock(&job_lock);
 	}
+	pthread_mutex_unlock(&job_lock);
+	return NULL;
+}
 
-	closedir(d);
-	return 0;
+/* Prints the directory and everything below it, then frees it */
+static int print_job(struct dir_job *job, int flags) {
+	struct file_ref dir = { job->path, NULL };
+	int error, i = 0;
+	DIR *d = NULL;
+
+	pthread_mutex_lock(&job_lock);
+	if(job->state == JOB_QUEUED) {
+		take_job(job);
+		pthread_mutex_unlock(&job_lock);
+		load_job(job, flags);
+		pthread_mutex_lock(&job_lock);
+	}
+	while(job->state != JOB_LOADED) pthread_cond_wait(&job_cond, &job_lock);
+	pthread_mutex_unlock(&job_lock);
+
+	if(job->parent) printf("\n%s:\n", job->path);
+	error = job->error;
+	if(error) {
+		fprintf(stderr, "ls: opendir '%s' failed, %s\n", job->path, strerror(error));
+	} else {
+		dir.dirfd = dirfd(job->dir);
+		list_entries(&dir, &job->entries, flags);
+	}
+
+	pthread_mutex_lock(&job_lock);
+	jobs_ahead--;
+	if(!error) d = release_job_dir(job);
+	pthread_cond_broadcast(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+	if(d) closedir(d);
+
+	FOREACH_ENTRY(&job->entries, entry, {
+		if(!is_subdir(&dir, entry)) continue;
+		print_job(job->children.items[i++], flags);
+	});
+
+	entries_done(&job->entries);
+	dynarray_done(&job->children);
+	free(job->path);
+	free(job);
+	return error ? -1 : 0;
 }
 
+static int listtree(const char *name, int flags) {
+	pthread_t threads[MAX_LIST_THREADS];
+	int count, r;
+	char *path = strdup(name);
+	if(!path) abort();
+
+	stop_workers = false;
+	for(count = 0; count < thread_count; count++) {
+		if(pthread_create(&threads[count], NULL, job_worker, &flags)) break;
+	}
+	r = print_job(new_job(NULL, path, path), flags);
+
+	pthread_mutex_lock(&job_lock);
+	stop_workers = true;
+	pthread_cond_broadcast(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+	while(count > 0) pthread_join(threads[--count], NULL);
+	return r;
+}
+
+/* One worker per CPU by default; on a single CPU the threads only get in
+ * the way of a cached tree, slow storage can still ask for them */
+static void init_thread_count() {
+	long int n;
+	if(thread_count >= 0) return;
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n < 2) n = 0;
+	if(n > 8) n = 8;
+	thread_count = n;
+}
+#endif
+
 static int listpath(const char *name, int flags) {
 	struct stat s;
 	int err;
+	int follow = name[strlen(name)-1] == '/';
+	struct file_ref ref = { NULL, name };
+#ifdef HAVE_FSTATAT
+	ref.dirfd = AT_FDCWD;
+#endif
 
 	/*
 	 * If the name ends in a '/', use stat() so we treat it like a
 	 * directory even if it's a symlink.
 	 */
-	err = (name[strlen(name)-1] == '/' ? stat : lstat)(name, &s);
+	err = (follow ? stat : lstat)(name, &s);
 
 	if(err < 0) {
 		//perror(name);
@@ -1234,17 +1880,21 @@ static int listpath(const char *name, int flags) {
 	}
 
 	if(!(flags & LIST_DIRECTORIES) && S_ISDIR(s.st_mode)) {
+		int r;
 		if(flags & LIST_RECURSIVE || flags & MULTI_FILES) printf("%s:\n", name);
-		int r = listdir(name, flags);
+#ifdef PARALLEL_RECURSION
+		if((flags & LIST_RECURSIVE) && !(flags & LIST_UNSORTED) && thread_count > 0) r = listtree(name, flags);
+		else
+#endif
+		r = listdir(NULL, name, flags);
 		if(flags & LIST_RECURSIVE || flags & MULTI_FILES) putchar('\n');
 		return r;
 	} else {
-		/* yeah this calls stat() again */
-		return listfile(NULL, name, flags);
+		return listfile(&ref, follow ? NULL : &s, flags);
 	}
 }
 
-int ls_main(int argc, char **argv) {
+static int do_ls(int argc, char **argv) {
 	int flags = 0;
 	if(getenv("COLORTERM")) is_color = isatty(STDOUT_FILENO);
 	if(argc > 1) {
@@ -1264,6 +1914,12 @@ int ls_main(int argc, char **argv) {
 						case 's': flags |= LIST_SIZE; break;
 						case 'R': flags |= LIST_RECURSIVE; break;
 						case 'd': flags |= LIST_DIRECTORIES; break;
+						case 'r': sort_reverse = true; break;
+						case 'S': sort_by = SORT_SIZE; break;
+						case 't': sort_by = SORT_TIME; break;
+						case 'X': sort_by = SORT_EXTENSION; break;
+						case 'U': flags |= LIST_UNSORTED; break;
+						case 'f': flags |= LIST_UNSORTED | LIST_ALL; break;
 #ifndef _NO_SELINUX
 						case 'Z': flags |= LIST_MACLABEL; break;
 #endif
@@ -1315,12 +1971,44 @@ int ls_main(int argc, char **argv) {
 #if !defined _WIN32_WCE || defined _USE_LIBPORT
 										" [--color[=<when>]]"
 #endif
-										" [--file-type]"
+										" [--file-type] [--max <n>]"
+#ifdef PARALLEL_RECURSION
+										" [--threads=<n>]"
+#endif
 #ifdef _WIN32_WCE
 										" <file>"
 #endif
 										" [<file>] [...]\n", argv[0]);
 									return 0;
+								} else if(strcmp(long_arg, "id-cache-stats") == 0) {
+#ifndef _WIN32
+									print_id_cache_stats = true;
+#endif
+								} else if(strcmp(long_arg, "max") == 0 || strncmp(long_arg, "max=", 4) == 0) {
+									const char *a = long_arg[3] ? long_arg + 4 : argv[++i];
+									char *end;
+									long int n;
+									if(!a) {
+										fprintf(stderr, "%s: Option '--max' requires an argument\n", argv[0]);
+										return 1;
+									}
+									n = strtol(a, &end, 10);
+									if(!*a || *end || n < 0 || n > INT_MAX) {
+										fprintf(stderr, "%s: Invalid entry count '%s' for --max\n", argv[0], a);
+										return 1;
+									}
+									max_entries = n;
+								} else if(strncmp(long_arg, "threads=", 8) == 0) {
+#ifdef PARALLEL_RECURSION
+									char *end;
+									long int n = strtol(long_arg + 8, &end, 10);
+									if(!long_arg[8] || *end || n < 0 || n > MAX_LIST_THREADS) {
+										fprintf(stderr, "%s: Invalid thread count '%s', expecting 0 to %d\n",
+											argv[0], long_arg + 8, MAX_LIST_THREADS);
+										return 1;
+									}
+									thread_count = n;
+#endif
 								} else if(strcmp(long_arg, "human-readable") == 0) {
 									flags |= LIST_HUMAN_READABLE;
 								} else if(strcmp(long_arg, "inode") == 0) {
@@ -1347,6 +2035,9 @@ not_an_option:
 			}
 		}
 
+#ifdef PARALLEL_RECURSION
+		if(flags & LIST_RECURSIVE) init_thread_count();
+#endif
 #if defined _WIN32_WCE && defined _USE_LIBPORT && _USE_LIBPORT == 2
 		if(is_color) {
 			HMODULE libport = LoadLibraryW(L"port.dll");
@@ -1376,3 +2067,20 @@ not_an_option:
 	return -listpath(".", flags);
 #endif
 }
+
+int ls_main(int argc, char **argv) {
+	int r = do_ls(argc, argv);
+#ifndef _WIN32
+	if(print_id_cache_stats) fflush(stdout);
+	id_cache_done(&user_cache, "user");
+	id_cache_done(&group_cache, "group");
+	print_id_cache_stats = false;
+#endif
+	sort_by = SORT_NAME;
+	sort_reverse = false;
+	max_entries = 0;
+#ifdef PARALLEL_RECURSION
+	thread_count = -1;
+#endif
+	return r;
+}
@@ -13,19 +13,68 @@
  * SUCH DAMAGE.
  */
 
+
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include "lsof.h"
+#include "procfs.h"
 #include <pwd.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/xattr.h>
+#endif
 
-#include <assert.h>
+/*
+ * Processes are scanned by a pool of threads, each formatting the lines of
+ * a process into a buffer of its own, and the buffers are written out in
+ * the order of the pids. Every descriptor is looked at relative to the
+ * /proc/<pid>/fd and /proc/<pid>/fdinfo directory fds.
+ */
+#define MAX_SCAN_THREADS 64
+#define SCAN_WINDOW 1024	/* processes scanned ahead of the output */
+
+struct scan_buf {
+	char *data;
+	size_t len, size;
+	pid_t *fds;
+	size_t fds_size;
+};
+
+struct scan_result {
+	char *data;
+	size_t len;
+	int done;
+};
+
+static int proc_fd;
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+static pid_t *scan_pids;
+static size_t scan_count, scan_next, scan_written;
+static struct scan_result results[SCAN_WINDOW];
+
+#define USER_HASH_SIZE 64
+
+struct user_entry {
+	struct user_entry *next;
+	uid_t uid;
+	char name[USER_DISPLAY_MAX];
+};
+
+static pthread_mutex_t user_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct user_entry *users[USER_HASH_SIZE];
+
+static void usage() {
+	fprintf(stderr, "Usage: lsof [-j <threads>] [<pid>]\n");
+}
 
 static void print_header() {
     printf("%-10s %5s %10s %4s %9s %17s %9s %10s %s\n",
@@ -40,176 +89,405 @@ static void print_header() {
             "NAME");
 }
 
-static void print_type(const char *type, pid_info_t *info) {
-	static ssize_t link_dest_size;
-	static char link_dest[PATH_MAX];
+static void out_printf(struct scan_buf *out, const char *format, ...) {
+	va_list ap;
+	int n;
+	while(1) {
+		if(out->size - out->len < 256) {
+			out->size = out->size ? out->size * 2 : 4096;
+			out->data = realloc(out->data, out->size);
+			if(!out->data) abort();
+		}
+		va_start(ap, format);
+		n = vsnprintf(out->data + out->len, out->size - out->len, format, ap);
+		va_end(ap);
+		if(n < 0) return;
+		if(out->len + n < out->size) break;
+		while(out->size <= out->len + n) out->size *= 2;
+		out->data = realloc(out->data, out->size);
+		if(!out->data) abort();
+	}
+	out->len += n;
+}
+
+static void print_line(struct scan_buf *out, const pid_info_t *info, const char *fd, const char *type,
+const char *device, const char *size, const char *node, const char *name) {
+	out_printf(out, "%-10s %5d %10s %4s %9s %17s %9s %10s %s\n",
+		info->command, (int)info->pid, info->user, fd, type, device, size, node, name);
+}
+
+/* Copies the name of the uid into user, looking it up only once */
+static void user_name(uid_t uid, char *user) {
+	struct user_entry *e;
+	struct passwd *pw;
+	pthread_mutex_lock(&user_lock);
+	for(e = users[uid % USER_HASH_SIZE]; e; e = e->next) {
+		if(e->uid == uid) break;
+	}
+	if(!e) {
+		e = malloc(sizeof *e);
+		if(!e) abort();
+		pw = getpwuid(uid);
+		if(pw) {
+			strncpy(e->name, pw->pw_name, USER_DISPLAY_MAX - 1);
+			e->name[USER_DISPLAY_MAX - 1] = 0;
+		} else {
+			snprintf(e->name, USER_DISPLAY_MAX, "%d", (int)uid);
+		}
+		e->uid = uid;
+		e->next = users[uid % USER_HASH_SIZE];
+		users[uid % USER_HASH_SIZE] = e;
+	}
+	strcpy(user, e->name);
+	pthread_mutex_unlock(&user_lock);
+}
 
-	size_t type_len = strlen(type);
-	if(info->parent_length + type_len > sizeof info->path) {
-		assert(info->parent_length > sizeof info->path);
-		type_len = sizeof info->path - info->parent_length;
+/* The protocol of a socket, from the name its socket family gives it;
+ * node gets the transport protocol for IP sockets */
+static const char *socket_type(const char *path, char *node, size_t node_size) {
+#ifdef __linux__
+	static const char *const ip_protocols[] = {
+		"TCP", "UDP", "UDP-Lite", "UDPLITE", "RAW", "PING", "SCTP", "MPTCP", "DCCP"
+	};
+	char proto[32];
+	ssize_t len = getxattr(path, "system.sockprotoname", proto, sizeof proto - 1);
+	size_t i;
+	if(len <= 0) return "sock";
+	proto[len] = 0;
+	len = strlen(proto);
+	// UNIX, or UNIX-STREAM and the like on newer kernels
+	if(strncmp(proto, "UNIX", 4) == 0) return "unix";
+	if(strcmp(proto, "NETLINK") == 0) return "netlink";
+	if(len > 2 && strcmp(proto + len - 2, "v6") == 0) {
+		proto[len - 2] = 0;
+		snprintf(node, node_size, "%s", proto);
+		return "IPv6";
 	}
-	memcpy(info->path + info->parent_length, type, type_len);
-	info->path[info->parent_length + type_len] = 0;
-	if((link_dest_size = readlink(info->path, link_dest, sizeof(link_dest)-1)) < 0) {
-		if (errno == ENOENT) goto out;
-		snprintf(link_dest, sizeof(link_dest), "%s (readlink: %s)", info->path, strerror(errno));
-	} else {
-		link_dest[link_dest_size] = 0;
+	for(i = 0; i < sizeof ip_protocols / sizeof *ip_protocols; i++) {
+		if(strcmp(proto, ip_protocols[i]) == 0) {
+			snprintf(node, node_size, "%s", proto);
+			return "IPv4";
+		}
 	}
+#endif
+	return "sock";
+}
+
+/* Anonymous inodes, such as eventfd, epoll and inotify descriptors, link
+ * to anon_inode:<kind> and have no file type in their mode */
+static const char *anon_type(const char *link) {
+	static const struct {
+		const char *kind;
+		const char *type;
+	} kinds[] = {
+		{ "[eventfd]", "eventfd" },
+		{ "[eventpoll]", "epoll" },
+		{ "inotify", "inotify" },
+		{ "[fanotify]", "fanotify" },
+		{ "[timerfd]", "timerfd" },
+		{ "[signalfd]", "signalfd" },
+		{ "[pidfd]", "pidfd" }
+	};
+	size_t i;
+	for(i = 0; i < sizeof kinds / sizeof *kinds; i++) {
+		if(strcmp(link + 11, kinds[i].kind) == 0) return kinds[i].type;
+	}
+	return "a_inode";
+}
+
+static const char *file_type(const struct stat *st, const char *link, const char *path, char *node, size_t node_size) {
+	if(strncmp(link, "anon_inode:", 11) == 0) return anon_type(link);
+	switch(st->st_mode & S_IFMT) {
+		case S_IFREG: return "REG";
+		case S_IFDIR: return "DIR";
+		case S_IFCHR: return "CHR";
+		case S_IFBLK: return "BLK";
+		case S_IFIFO: return "FIFO";
+		case S_IFLNK: return "LINK";
+		case S_IFSOCK: return socket_type(path, node, node_size);
+	}
+	return "unknown";
+}
+
+/* Prints the link called name in dir_fd: cwd, exe or root in /proc/<pid>,
+ * or a descriptor in /proc/<pid>/fd, with fdinfo_fd then open on
+ * /proc/<pid>/fdinfo for its offset and open mode */
+static void print_file(struct scan_buf *out, const pid_info_t *info, int dir_fd, int fdinfo_fd, const char *dir, const char *name) {
+	char link_dest[PATH_MAX];
+	char path[PATH_MAX];
+	char fd[32], device[32], size[32], node[32];
+	char buf[256];
+	struct procfs_fdinfo fdinfo;
+	struct stat st;
+	const char *type;
+	ssize_t len;
+
+	snprintf(path, sizeof path, "%s%s%s", info->path, dir, name);
+	if((len = readlinkat(dir_fd, name, link_dest, sizeof(link_dest)-1)) < 0) {
+		if (errno == ENOENT) return;
+		snprintf(link_dest, sizeof(link_dest), "%s (readlink: %s)", path, strerror(errno));
+		print_line(out, info, name, "???", "???", "???", "???", link_dest);
+		return;
+	}
+	link_dest[len] = 0;
 
 	// Things that are just the root filesystem are uninteresting (we already know)
-	if(strcmp(link_dest, "/") == 0) goto out;
+	if(strcmp(link_dest, "/") == 0) return;
+
+	if(fstatat(dir_fd, name, &st, 0) < 0) {
+		if(errno == ENOENT) return;
+		print_line(out, info, name, "???", "???", "???", "???", link_dest);
+		return;
+	}
 
-	printf("%-10s %5d %10s %4s %9s %17s %9s %10s %s\n",
-		info->command, (int)info->pid, info->user, type,
-		"???", "???", "???", "???", link_dest);
+	snprintf(node, sizeof node, "%llu", (unsigned long long int)st.st_ino);
+	type = file_type(&st, link_dest, path, node, sizeof node);
 
-out:
-	info->path[info->parent_length] = 0;
+	if(S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
+		snprintf(device, sizeof device, "%u,%u", major(st.st_rdev), minor(st.st_rdev));
+	} else {
+		snprintf(device, sizeof device, "%u,%u", major(st.st_dev), minor(st.st_dev));
+	}
+
+	strcpy(fd, name);
+	size[0] = 0;
+	if(fdinfo_fd >= 0 && procfs_read_at(fdinfo_fd, name, buf, sizeof buf) >= 0 &&
+	procfs_parse_fdinfo(buf, &fdinfo) == 0) {
+		int mode = fdinfo.flags & O_ACCMODE;
+		snprintf(fd, sizeof fd, "%s%c", name, mode == O_RDONLY ? 'r' : mode == O_WRONLY ? 'w' : 'u');
+		snprintf(size, sizeof size, "0t%llu", fdinfo.pos);
+	}
+	// Files that have a size show it instead of the offset
+	if(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) {
+		snprintf(size, sizeof size, "%lld", (long long int)st.st_size);
+	}
+
+	print_line(out, info, fd, type, device, size, node, link_dest);
 }
 
 // Prints out all file that have been memory mapped
-static void print_maps(pid_info_t *info) {
-    FILE *maps;
-    size_t offset;
-    char device[10];
-    long int inode;
-    char file[PATH_MAX];
-
-    strncat(info->path, "maps", sizeof(info->path));
-    maps = fopen(info->path, "r");
-    if(!maps) goto out;
-
-    while(fscanf(maps, "%*x-%*x %*s %zx %5s %ld %s\n", &offset, device, &inode, file) == 4) {
-        // We don't care about non-file maps
-        if(inode == 0 || strcmp(device, "00:00") == 0) continue;
-        printf("%-10s %5d %10s %4s %9s %17s %9zd %10ld %s\n",
-                info->command, (int)info->pid, info->user, "mem",
-                "???", device, offset, inode, file);
-    }
-    fclose(maps);
-
-out:
-    info->path[info->parent_length] = '\0';
+static void print_maps(struct scan_buf *out, const pid_info_t *info, int pid_fd) {
+	FILE *maps;
+	char *line = NULL;
+	size_t line_size = 0;
+	int fd = openat(pid_fd, "maps", O_RDONLY);
+	if(fd < 0) return;
+	maps = fdopen(fd, "r");
+	if(!maps) {
+		close(fd);
+		return;
+	}
+
+	while(getline(&line, &line_size, maps) > 0) {
+		size_t offset;
+		char device[10];
+		long int inode;
+		char *file;
+		int n = 0;
+		if(sscanf(line, "%*x-%*x %*s %zx %9s %ld %n", &offset, device, &inode, &n) != 3 || !n) continue;
+		// We don't care about non-file maps
+		if(inode == 0 || strcmp(device, "00:00") == 0) continue;
+		// The name is the rest of the line, spaces and all
+		file = line + n;
+		file[strcspn(file, "\n")] = 0;
+		out_printf(out, "%-10s %5d %10s %4s %9s %17s %9zd %10ld %s\n",
+			info->command, (int)info->pid, info->user, "mem",
+			"???", device, offset, inode, file);
+	}
+	free(line);
+	fclose(maps);
 }
 
 // Prints out all open file descriptors
-static void print_fds(pid_info_t *info) {
-    static char *fd_path = "fd/";
-    strncat(info->path, fd_path, sizeof(info->path));
-
-    int previous_length = info->parent_length;
-    info->parent_length += strlen(fd_path);
-
-    DIR *dir = opendir(info->path);
-    if(!dir) {
-        char msg[BUF_MAX];
-        snprintf(msg, sizeof(msg), "%s (opendir: %s)", info->path, strerror(errno));
-        printf("%-10s %5d %10s %4s %9s %17s %9s %10s %s\n",
-                info->command, (int)info->pid, info->user, "FDS",
-                "", "", "", "", msg);
-        goto out;
-    }
-
-    struct dirent *de;
-    while((de = readdir(dir))) {
-        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
-        print_type(de->d_name, info);
-    }
-    closedir(dir);
-
-out:
-    info->parent_length = previous_length;
-    info->path[info->parent_length] = '\0';
+static void print_fds(struct scan_buf *out, const pid_info_t *info, int pid_fd) {
+	char name[16];
+	ssize_t count, i;
+	int fd_dir, fdinfo_dir;
+
+	fd_dir = openat(pid_fd, "fd", O_RDONLY | O_DIRECTORY);
+	if(fd_dir < 0) {
+		char msg[BUF_MAX];
+		snprintf(msg, sizeof(msg), "%sfd/ (opendir: %s)", info->path, strerror(errno));
+		print_line(out, info, "FDS", "", "", "", "", msg);
+		return;
+	}
+	fdinfo_dir = openat(pid_fd, "fdinfo", O_RDONLY | O_DIRECTORY);
+
+	count = procfs_list(fd_dir, &out->fds, &out->fds_size);
+	for(i = 0; i < count; i++) {
+		sprintf(name, "%d", (int)out->fds[i]);
+		print_file(out, info, fd_dir, fdinfo_dir, "fd/", name);
+	}
+
+	if(fdinfo_dir >= 0) close(fdinfo_dir);
+	close(fd_dir);
 }
 
-void lsof_dumpinfo(pid_t pid)
+static void lsof_dumpinfo(pid_t pid, struct scan_buf *out)
 {
-    int fd;
-    pid_info_t info;
-    struct stat pidstat;
-    struct passwd *pw;
-
-    info.pid = pid;
-    snprintf(info.path, sizeof(info.path), "/proc/%d/", (int)pid);
-    info.parent_length = strlen(info.path);
-
-    // Get the UID by calling stat on the proc/pid directory.
-    if(stat(info.path, &pidstat) == 0) {
-        pw = getpwuid(pidstat.st_uid);
-        if(pw) {
-            strcpy(info.user, pw->pw_name);
-        } else {
-            snprintf(info.user, USER_DISPLAY_MAX, "%d", (int)pidstat.st_uid);
-        }
-    } else {
-        strcpy(info.user, "???");
-    }
-
-    // Read the command line information; each argument is terminated with NULL.
-    strncat(info.path, "cmdline", sizeof info.path);
-    fd = open(info.path, O_RDONLY);
-    if(fd < 0) {
-        fprintf(stderr, "Couldn't read %s\n", info.path);
-        return;
-    }
-
-    char command[PATH_MAX];
-    int numRead = read(fd, command, sizeof(command) - 1);
-    close(fd);
-
-    if(numRead < 0) {
-        fprintf(stderr, "Error reading command: %s: %s\n", info.path, strerror(errno));
-        return;
-    }
-
-    command[numRead] = '\0';
-
-    // We only want the basename of the command
-    strncpy(info.command, basename(command), COMMAND_DISPLAY_MAX - 1);
-    info.command[COMMAND_DISPLAY_MAX - 1] = 0;
-
-    // Read each of these symlinks
-    print_type("cwd", &info);
-    print_type("exe", &info);
-    print_type("root", &info);
-
-    print_fds(&info);
-    print_maps(&info);
+	struct procfs_task task;
+	pid_info_t info;
+	int pid_fd;
+
+	info.pid = pid;
+	snprintf(info.path, sizeof(info.path), "/proc/%d/", (int)pid);
+	info.parent_length = strlen(info.path);
+
+	// The owner of the proc/pid directory, and the command line; each argument is terminated with NUL.
+	task.pid = task.tid = 0;
+	if(procfs_read(proc_fd, pid, 0, PROCFS_OWNER | PROCFS_CMDLINE, &task) < 0) {
+		fprintf(stderr, "Couldn't read %s: %s\n", info.path, strerror(errno));
+		return;
+	}
+	user_name(task.owner, info.user);
+
+	// We only want the basename of the command
+	strncpy(info.command, basename(task.cmdline), COMMAND_DISPLAY_MAX - 1);
+	info.command[COMMAND_DISPLAY_MAX - 1] = 0;
+
+	pid_fd = openat(proc_fd, info.path + 6, O_RDONLY | O_DIRECTORY);
+	if(pid_fd < 0) return;
+
+	// Read each of these symlinks
+	print_file(out, &info, pid_fd, -1, "", "cwd");
+	print_file(out, &info, pid_fd, -1, "", "exe");
+	print_file(out, &info, pid_fd, -1, "", "root");
+
+	print_fds(out, &info, pid_fd);
+	print_maps(out, &info, pid_fd);
+	close(pid_fd);
+}
+
+static void *scan_worker(void *arg) {
+	struct scan_buf out = { NULL, 0, 0, NULL, 0 };
+	pthread_mutex_lock(&scan_lock);
+	while(scan_next < scan_count) {
+		size_t i = scan_next;
+		struct scan_result *r;
+		if(i >= scan_written + SCAN_WINDOW) {
+			// Far enough ahead of the output
+			pthread_cond_wait(&scan_cond, &scan_lock);
+			continue;
+		}
+		scan_next++;
+		pthread_mutex_unlock(&scan_lock);
+		out.data = NULL;
+		out.len = out.size = 0;
+		lsof_dumpinfo(scan_pids[i], &out);
+		pthread_mutex_lock(&scan_lock);
+		r = &results[i % SCAN_WINDOW];
+		r->data = out.data;
+		r->len = out.len;
+		r->done = 1;
+		pthread_cond_broadcast(&scan_cond);
+	}
+	pthread_mutex_unlock(&scan_lock);
+	free(out.fds);
+	return NULL;
+}
+
+/* Scans scan_pids with the given number of threads, writing in pid order */
+static void scan_all(int thread_count) {
+	pthread_t threads[MAX_SCAN_THREADS];
+	int count;
+	size_t i;
+
+	scan_next = scan_written = 0;
+	for(count = 0; count < thread_count; count++) {
+		if(pthread_create(&threads[count], NULL, scan_worker, NULL)) break;
+	}
+	if(!count) {
+		struct scan_buf out = { NULL, 0, 0, NULL, 0 };
+		for(i = 0; i < scan_count; i++) {
+			out.len = 0;
+			lsof_dumpinfo(scan_pids[i], &out);
+			if(out.len) fwrite(out.data, 1, out.len, stdout);
+		}
+		free(out.data);
+		free(out.fds);
+		return;
+	}
+
+	for(i = 0; i < scan_count; i++) {
+		struct scan_result *r = &results[i % SCAN_WINDOW];
+		char *data;
+		size_t len;
+		pthread_mutex_lock(&scan_lock);
+		while(!r->done) pthread_cond_wait(&scan_cond, &scan_lock);
+		data = r->data;
+		len = r->len;
+		r->done = 0;
+		scan_written = i + 1;
+		pthread_cond_broadcast(&scan_cond);
+		pthread_mutex_unlock(&scan_lock);
+		if(len) fwrite(data, 1, len, stdout);
+		free(data);
+	}
+	while(count > 0) pthread_join(threads[--count], NULL);
 }
 
 int lsof_main(int argc, char *argv[])
 {
-    long int pid = 0;
-    char *endptr;
-    if(argc == 2) {
-        pid = strtol(argv[1], &endptr, 10);
-    }
-
-    print_header();
-
-    if(pid) {
-        lsof_dumpinfo(pid);
-    } else {
-        DIR *dir = opendir("/proc");
-        if(!dir) {
-            fprintf(stderr, "Couldn't open /proc\n");
-            return -1;
-        }
-
-        struct dirent* de;
-        while((de = readdir(dir))) {
-            if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
-
-            // Only inspect directories that are PID numbers
-            pid = strtol(de->d_name, &endptr, 10);
-            if(*endptr) continue;
-
-            lsof_dumpinfo(pid);
-        }
-        closedir(dir);
-    }
-
-    return 0;
+	long int pid = 0;
+	int thread_count = -1;
+	size_t size = 0;
+	ssize_t count;
+
+	while(1) {
+		int c = getopt(argc, argv, "j:");
+		if(c == -1) break;
+		switch(c) {
+			case 'j':
+				thread_count = atoi(optarg);
+				if(thread_count < 0 || thread_count > MAX_SCAN_THREADS) {
+					fprintf(stderr, "lsof: thread count must be between 0 and %d\n", MAX_SCAN_THREADS);
+					return -1;
+				}
+				break;
+			default:
+				usage();
+				return -1;
+		}
+	}
+	if(argc - optind > 1) {
+		usage();
+		return -1;
+	}
+	if(optind < argc) pid = strtol(argv[optind], NULL, 10);
+
+	proc_fd = procfs_open();
+	if(proc_fd < 0) {
+		fprintf(stderr, "Couldn't open /proc\n");
+		return -1;
+	}
+
+	setvbuf(stdout, NULL, _IOFBF, 65536);
+	print_header();
+
+	if(pid) {
+		scan_pids = malloc(sizeof *scan_pids);
+		if(!scan_pids) abort();
+		scan_pids[0] = pid;
+		scan_count = 1;
+		thread_count = 0;
+	} else {
+		count = procfs_list(proc_fd, &scan_pids, &size);
+		if(count < 0) {
+			fprintf(stderr, "Couldn't read /proc\n");
+			close(proc_fd);
+			return -1;
+		}
+		scan_count = count;
+	}
+	if(thread_count < 0) {
+		long int n = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = n < 2 ? 0 : n > 16 ? 16 : n;
+	}
+	scan_all(thread_count);
+	fflush(stdout);
+
+	free(scan_pids);
+	scan_pids = NULL;
+	close(proc_fd);
+	return 0;
 }
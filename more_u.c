@@ -6,6 +6,8 @@
 	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
 */
 
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -42,7 +44,11 @@
 #endif		/* _WIN32_WCE */
 #else
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <termios.h>
+#include <poll.h>
+#include <signal.h>
+#include <setjmp.h>
 #endif
 
 #if !defined _WIN32 || defined _WIN32_WCE || defined _WINDOWSNT_NATIVE
@@ -84,12 +90,36 @@ static void reset_terminal(void) {
 }
 #endif
 
+#ifndef _WIN32
+/* Called repeatedly while no key is pressed, until it returns 0 */
+static int (*idle_work)(void);
+
+static int key_pressed() {
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	return poll(&pfd, 1, 0) > 0;
+}
+
+static void restore_terminal(int sig) {
+	reset_terminal();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+#endif
+
 /* Read 1 character - echo defines echo mode */
 static char getch_(int echo) {
 	char ch;
+#ifdef _WIN32
 	set_terminal(echo);
+#else
+	// page_file() keeps the terminal in this mode, so keys typed ahead
+	// while paging are neither held back for a line nor echoed
+	while(idle_work && !key_pressed() && idle_work());
+#endif
 	ch = getchar();
+#ifdef _WIN32
 	reset_terminal();
+#endif
 	return ch;
 }
 
@@ -108,151 +138,453 @@ static char getche(void) {
 
 #define SKIP_MULTI_BLACK_LINES (1 << 0)
 
+/* The start of every INDEX_STEP-th line is recorded while scanning the input */
+#define INDEX_STEP 1024
+#define INDEX_CHUNK (4 * 1024 * 1024)
+#define SPILL_CHUNK (64 * 1024)
+
 unsigned int term_row;
 
 static int page_col, page_row;
 static char filename[1024];
 
+/* Regular files are mapped; anything else is read into a growing spill
+ * buffer as far as needed, so backward paging works on pipes too */
+static int input_fd;
+static const char *data;
+static size_t data_len;
+static int data_eof;
+static char *spill;
+static size_t spill_size;
+#ifndef _WIN32
+static void *map;
+static size_t map_len;
+/* A mapped file truncated under us raises SIGBUS; page_file() carries on
+ * from where the last command started with the part that is left */
+static sigjmp_buf map_fault;
+static const char *map_fault_addr;
+static struct sigaction old_bus_action;
+static size_t last_top, last_next;
+#endif
+static off_t file_size = -1;
+
+static size_t *line_marks;
+static size_t mark_count, mark_size;
+static size_t indexed_len, indexed_lines;
+
+static char pattern[256];
+static size_t pattern_len;
+
+static int blank_line;
+
 static int usage(char *name) {
 	fprintf(stdout, "Usage: %s [<options>] [<file>]\n\n"
 		"Options:\n"
 		"	-s	Squeeze multiple blank lines into a single line\n"
-		"	-V	Display version information and exit\n\n", name);
+		"	-V	Display version information and exit\n\n"
+		"Commands, optionally prefixed with a count <n>:\n"
+		"	<Enter>		Next <n> lines\n"
+		"	<Space>		Next <n> lines, default a screen\n"
+		"	b		Back <n> screens\n"
+		"	g, <		Go to line <n>, default the first line\n"
+		"	G, >		Go to the last screen\n"
+		"	%%, p		Go to <n> percent of the file\n"
+		"	/<pattern>	Search forward for <pattern>\n"
+		"	n		Search for the next occurrence\n"
+		"	q		Quit\n\n", name);
 	return 1;
 }
 
-static int read_more() {
-	switch(getch()) {
-		case 13:
-			page_row++;
-#ifdef _WIN32
-			printf("\r		\r");
-#else
-			/* Clean the current line */
-			printf("\x1b[1K");
-			/* Set the cursor to the start of the line */
-			printf("\x1b[%u;0H", term_row);
-#endif
-			break;
-		case 32:
-			page_row = term_row;
-#ifdef _WIN32
-			printf("\r		\r");
-#else
-			/* Clean the current line */
-			printf("\x1b[1K");
-			/* Set the cursor to the start of the line */
-			printf("\x1b[%u;0H", term_row);
+#ifndef _WIN32
+static void map_fault_handler(int sig, siginfo_t *info, void *context) {
+	map_fault_addr = info->si_addr;
+	siglongjmp(map_fault, 1);
+}
+
+/* Cuts the data at the end of the file, or at the page that faulted */
+static void map_truncated() {
+	struct stat st;
+	size_t len = data_len;
+	long int page_size = sysconf(_SC_PAGESIZE);
+	if(map_fault_addr >= data && map_fault_addr < data + data_len) {
+		len = map_fault_addr - data;
+		if(page_size > 0) len -= len % page_size;
+	}
+	if(fstat(input_fd, &st) == 0 && st.st_size < (off_t)len) len = st.st_size;
+	data_len = len;
+	file_size = len;
+	// Lines past the cut may have been indexed
+	mark_count = 0;
+	indexed_len = indexed_lines = 0;
+}
 #endif
-			break;
-		case 'q':
-			putchar('\n');
-			exit(0);
-		default:
-#ifdef _WIN32
-			printf("\r		\r");
-#else
-			/* Clean the current line */
-			printf("\x1b[1K");
-			/* Set the cursor to the start of the line */
-			printf("\x1b[%u;0H", term_row);
+
+static void open_input(FILE *fp) {
+	struct stat st;
+#ifndef _WIN32
+	struct sigaction sa;
 #endif
-			/* If none input, return 1 */
-			return 1;
+	input_fd = fileno(fp);
+	if(fstat(input_fd, &st) < 0 || !S_ISREG(st.st_mode)) return;
+	// Files in /proc report a size of 0, read them instead
+	if(!st.st_size) return;
+	file_size = st.st_size;
+#ifndef _WIN32
+	if((off_t)(size_t)st.st_size != st.st_size) return;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+	if(map == MAP_FAILED) {
+		map = NULL;
+		return;
 	}
-	return 0;
+	data = map;
+	data_len = map_len = st.st_size;
+	data_eof = 1;
+	memset(&sa, 0, sizeof sa);
+	sa.sa_sigaction = map_fault_handler;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGBUS, &sa, &old_bus_action);
+#endif
 }
 
-static int read_file(FILE *fp, int use_pipe, int flags) {
-	char line[page_col];
-	int seek;
-	off_t filesize = -1;
-	int black_line = 0;
-	if(!use_pipe) {
-		struct stat filestat;
-		stat(filename, &filestat);
-		filesize = filestat.st_size;
+static void close_input() {
+#ifndef _WIN32
+	if(map) {
+		sigaction(SIGBUS, &old_bus_action, NULL);
+		munmap(map, map_len);
 	}
-	while(fgets(line, page_col, fp) != NULL) {
-		if((flags & SKIP_MULTI_BLACK_LINES)) {
-			if(*line == '\n') {
-				if(black_line) continue;
-				else black_line = 1;
-			} else black_line = 0;
-		}
-		if(page_row != 1) {
-			fprintf(stdout,"%s",line);
-			//fflush(stdout);
-			page_row--;
-		} else {
-			if(use_pipe) {
-				fprintf(stdout, "--More--");
-			} else {
-				seek = ftell(fp);
-				int percent = ((float)seek / (float)filesize) * 100;
-				fprintf(stdout, "--More-- (%%%d)", percent);
-			}
-			while(read_more() == 1) {
-				fprintf(stdout, "--More--");
+	map = NULL;
+#endif
+	free(spill);
+	spill = NULL;
+	spill_size = 0;
+	free(line_marks);
+	line_marks = NULL;
+	mark_count = mark_size = 0;
+	data = NULL;
+	data_len = indexed_len = indexed_lines = 0;
+	data_eof = 0;
+	file_size = -1;
+}
+
+/* Makes at least len bytes available, unless the input ends before */
+static void load_to(size_t len) {
+	while(!data_eof && data_len < len) {
+		ssize_t s;
+		if(spill_size - data_len < SPILL_CHUNK) {
+			size_t new_size = spill_size ? spill_size * 2 : SPILL_CHUNK * 4;
+			char *p = realloc(spill, new_size);
+			if(!p) {
+				data_eof = 1;
+				break;
 			}
+			data = spill = p;
+			spill_size = new_size;
 		}
+		s = read(input_fd, spill + data_len, spill_size - data_len);
+		if(s < 0) {
+			if(errno == EINTR) continue;
+			perror("read");
+		}
+		if(s <= 0) data_eof = 1;
+		else data_len += s;
+	}
+}
+
+static int at_end(size_t off) {
+	load_to(off + 1);
+	return off >= data_len;
+}
 
+/* Returns the offset just past the line starting at off */
+static size_t line_end(size_t off) {
+	size_t from = off;
+	while(1) {
+		const char *p = from < data_len ? memchr(data + from, '\n', data_len - from) : NULL;
+		if(p) return p - data + 1;
+		if(data_eof) return data_len;
+		from = data_len;
+		load_to(data_len + SPILL_CHUNK);
 	}
+}
 
-#if 0
-	// There is no need to read all data from a pipe that just for calculate the length
-	} else {
-		char **buff;
-		int i = 1;
-		char line[page_col];
-		/* First alloc */
-		buff = (char **)malloc(sizeof(char *));
-		if(!buff) return -1;
-		while(fgets(line, page_col, fp) != NULL) {
-			/* Alloc buff[i-1] */
-			buff[i-1] = (char *)malloc(sizeof(char)*page_col+1);
-			strcpy(buff[i-1], line);
-			i++;
-			/* realloc */
-			buff = (char **)realloc(buff, sizeof(char *)*i);
-			if(!buff) return -1;
-			//printf("%s",buff[i-1]);
+static size_t line_start(size_t off) {
+	while(off > 0 && data[off - 1] != '\n') off--;
+	return off;
+}
+
+static size_t back_lines(size_t off, unsigned long int n) {
+	while(n-- > 0 && off > 0) off = line_start(off - 1);
+	return off;
+}
+
+static void add_mark(size_t off) {
+	if(mark_count == mark_size) {
+		size_t new_size = mark_size ? mark_size * 2 : 256;
+		size_t *p = realloc(line_marks, new_size * sizeof *line_marks);
+		if(!p) return;
+		line_marks = p;
+		mark_size = new_size;
+	}
+	line_marks[mark_count++] = off;
+}
+
+/* Extends the line index by up to max bytes; returns 0 once it covers the
+ * whole input */
+static int index_more(size_t max) {
+	size_t end;
+	if(!mark_count) add_mark(0);
+	load_to(indexed_len + max);
+	end = indexed_len + max < data_len ? indexed_len + max : data_len;
+	while(indexed_len < end) {
+		const char *p = memchr(data + indexed_len, '\n', end - indexed_len);
+		if(!p) {
+			indexed_len = end;
+			break;
 		}
-		if(close(STDIN_FILENO)) {
-			perror("STDIN_FILENO close faild");
-			return errno;
+		indexed_len = p - data + 1;
+		if(++indexed_lines % INDEX_STEP == 0) add_mark(indexed_len);
+	}
+	return !data_eof || indexed_len < data_len;
+}
+
+#ifndef _WIN32
+/* Indexes the input while waiting for a key; a pipe that hasn't been read
+ * to the end is left alone since reading it may block */
+static int index_idle() {
+	if(!data_eof) return 0;
+	return index_more(INDEX_CHUNK);
+}
+#endif
+
+/* Returns the offset of line n (counting from 0), or data_len if the input
+ * has fewer lines */
+static size_t offset_of_line(size_t n) {
+	size_t off, i;
+	while(indexed_lines < n && index_more(INDEX_CHUNK));
+	if(indexed_lines < n || n / INDEX_STEP >= mark_count) return data_len;
+	off = line_marks[n / INDEX_STEP];
+	for(i = n % INDEX_STEP; i > 0; i--) off = line_end(off);
+	return off;
+}
+
+static const char *find_substring(const char *s, size_t len, const char *sub, size_t sub_len) {
+	const char *end = s + len;
+	while((size_t)(end - s) >= sub_len) {
+		s = memchr(s, *sub, end - s - sub_len + 1);
+		if(!s) return NULL;
+		if(memcmp(s + 1, sub + 1, sub_len - 1) == 0) return s;
+		s++;
+	}
+	return NULL;
+}
+
+/* Returns the offset of the first match at or after off, or -1 */
+static size_t search(size_t off) {
+	size_t from = off;
+	while(1) {
+		if(from < data_len) {
+			const char *p = find_substring(data + from, data_len - from, pattern, pattern_len);
+			if(p) return p - data;
+			if(data_len - from >= pattern_len) from = data_len - pattern_len + 1;
 		}
-		if((fp = fopen("/dev/tty", "r")) == NULL) {
-			perror("Error open TTY");
-			return errno;
+		if(data_eof) return (size_t)-1;
+		load_to(data_len + SPILL_CHUNK);
+	}
+}
+
+static void print_lines(size_t *next, unsigned long int rows, int flags) {
+	size_t off = *next;
+	while(rows > 0 && !at_end(off)) {
+		size_t end = line_end(off);
+		size_t len = end - off;
+		unsigned long int used;
+		int has_newline = data[end - 1] == '\n';
+		if(has_newline) len--;
+		if(flags & SKIP_MULTI_BLACK_LINES) {
+			if(!len) {
+				if(blank_line) {
+					off = end;
+					continue;
+				}
+				blank_line = 1;
+			} else blank_line = 0;
 		}
-		int line_num = i -1;
-		int l = 0;
-		for(i-- ; i > 0; i--) {
-			if(page_row != 1) {
-				fprintf(stdout,"%s",buff[l]);
-				//fflush(stdout);
-				page_row--;
-			} else {
-				int percent = ((float)l/(float)line_num) * 100;
-				fprintf(stdout, "--More-- (%%%d)",percent);
-				read_more();
+		fwrite(data + off, 1, len, stdout);
+		putchar('\n');
+		used = len > (size_t)page_col ? (len - 1) / page_col + 1 : 1;
+		rows = used < rows ? rows - used : 0;
+		off = end;
+	}
+	*next = off;
+}
+
+static void clear_screen() {
+#ifndef _WIN32
+	printf("\x1b[H\x1b[2J");
+#endif
+	blank_line = 0;
+}
+
+static void clear_prompt() {
+#ifdef _WIN32
+	printf("\r		\r");
+#else
+	/* Clean the current line */
+	printf("\x1b[1K");
+	/* Set the cursor to the start of the line */
+	printf("\x1b[%u;0H", term_row);
+#endif
+}
+
+static void show_prompt(size_t next, const char *message) {
+	if(message) printf("--More-- (%s)", message);
+	else if(at_end(next)) printf("--More-- (END)");
+	else if(file_size > 0) printf("--More-- (%%%d)", (int)((double)next / file_size * 100));
+	else printf("--More--");
+	fflush(stdout);
+}
+
+static int read_pattern() {
+	size_t len;
+	putchar('/');
+	fflush(stdout);
+#ifdef _WIN32
+	if(!fgets(pattern, sizeof pattern, stdin)) return 0;
+	len = strlen(pattern);
+	if(len && pattern[len - 1] == '\n') pattern[--len] = 0;
+	if(len && pattern[len - 1] == '\r') pattern[--len] = 0;
+#else
+	// Still in key mode, so that a pattern typed ahead reads the same way;
+	// echo and erase by hand
+	len = 0;
+	while(1) {
+		int c = getchar();
+		if(c == EOF) return 0;
+		if(c == '\r' || c == '\n') break;
+		if(c == '\b' || c == 0x7f) {
+			if(len) {
+				len--;
+				printf("\b \b");
 			}
-			l++;
+		} else if(len < sizeof pattern - 1) {
+			pattern[len++] = c;
+			putchar(c);
 		}
-		/* Free memory */
-		for(i=0; i<=line_num; i++) {
-			free(buff[i]);
-		}
-		free(buff);
+		fflush(stdout);
 	}
+	pattern[len] = 0;
+#endif
+	pattern_len = len;
+	return len > 0;
+}
+
+static int page_file(FILE *fp, int flags) {
+	unsigned long int rows = term_row > 1 ? term_row - 1 : 1;
+	unsigned long int count = 0;
+	size_t top = 0, next = 0;
+	const char *message = NULL;
+	// Set once the user navigated, so that reaching the end doesn't quit
+	int stay = 0;
+
+	open_input(fp);
+#ifndef _WIN32
+	idle_work = index_idle;
+	set_terminal(0);
+	signal(SIGINT, restore_terminal);
+	signal(SIGTERM, restore_terminal);
+	last_top = last_next = 0;
+	if(sigsetjmp(map_fault, 1)) {
+		map_truncated();
+		top = line_start(last_top < data_len ? last_top : data_len);
+		next = last_next < data_len ? last_next : data_len;
+		count = 0;
+		stay = 1;
+		message = "File truncated";
+	} else
+#endif
+	print_lines(&next, rows, flags);
+	while(stay || !at_end(next)) {
+		size_t target = (size_t)-1;
+		int c;
+#ifndef _WIN32
+		last_top = top;
+		last_next = next;
 #endif
-/*	Should close in main
-	if(fclose(fp) != 0) {
-		perror("Error to close");
-		return errno;
+		show_prompt(next, message);
+		message = NULL;
+		c = getch();
+		clear_prompt();
+		if(c >= '0' && c <= '9') {
+			count = count * 10 + (c - '0');
+			continue;
+		}
+		switch(c) {
+			case '\r':
+			case '\n':
+				print_lines(&next, count ? count : 1, flags);
+				stay = 0;
+				break;
+			case ' ':
+				print_lines(&next, count ? count : rows, flags);
+				stay = 0;
+				break;
+			case 'b':
+				target = back_lines(top, (count ? count : 1) * rows);
+				break;
+			case 'g':
+			case '<':
+				target = offset_of_line(count ? count - 1 : 0);
+				if(target >= data_len) target = back_lines(data_len, rows);
+				break;
+			case 'G':
+			case '>':
+				while(!data_eof) load_to(data_len + SPILL_CHUNK);
+				target = back_lines(data_len, rows);
+				break;
+			case '%':
+			case 'p':
+				while(!data_eof) load_to(data_len + SPILL_CHUNK);
+				target = count < 100 ? (size_t)((double)data_len * count / 100) : data_len;
+				target = target < data_len ? line_start(target) : back_lines(data_len, rows);
+				break;
+			case '/':
+				if(!read_pattern()) {
+					clear_prompt();
+					break;
+				}
+				clear_prompt();
+				// Fall through
+			case 'n':
+				if(!pattern_len) {
+					message = "No previous pattern";
+					break;
+				}
+				target = search(at_end(top) ? top : line_end(top));
+				if(target == (size_t)-1) message = "Pattern not found";
+				else target = line_start(target);
+				break;
+			case 'q':
+			case 'Q':
+				putchar('\n');
+				goto quit;
+		}
+		count = 0;
+		if(target != (size_t)-1) {
+			clear_screen();
+			next = top = target;
+			print_lines(&next, rows, flags);
+			stay = 1;
+		} else top = back_lines(next, rows);
 	}
-*/
+quit:
+	fflush(stdout);
+#ifndef _WIN32
+	reset_terminal();
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+#endif
+	close_input();
 	return 0;
 }
 
@@ -305,8 +637,9 @@ int more_main(int argc, char *argv[]) {
 			return -errno;
 		}
 
-		page_col = winsz.ws_col;
-		page_row = winsz.ws_row;
+		// Serial and some device consoles report a size of 0
+		page_col = winsz.ws_col ? winsz.ws_col : 80;
+		page_row = winsz.ws_row ? winsz.ws_row : 24;
 #endif
 #endif
 		term_row = page_row;
@@ -336,7 +669,12 @@ int more_main(int argc, char *argv[]) {
 		return -1;
 	}
 
-	setvbuf(stdout, NULL, _IOLBF, 0);
+	setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
+#ifndef _WIN32
+	// Keys are read one at a time, so type-ahead stays in the terminal where
+	// key_pressed() sees it instead of in the stdio buffer
+	setvbuf(stdin, NULL, _IONBF, 0);
+#endif
 
 	int r = 0;
 	int fd = -1;
@@ -346,7 +684,7 @@ int more_main(int argc, char *argv[]) {
 	 */
 	FILE *fp;
 
-	if(argc != 1) {
+	if(optind < argc) {
 		strcpy(filename, argv[optind]);
 		fp = fopen(filename, "r");
 		if(!fp) {
@@ -391,7 +729,7 @@ int more_main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	if(read_file(fp, use_pipe, flags) < 0) {
+	if(page_file(fp, flags) < 0) {
 		perror(argv[0]);
 		r = 1;
 	}
@@ -7,24 +7,88 @@
 	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
 */
 
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include "copyfile.h"
+#include "rmtree.h"
 
 #if defined _WIN32 && !defined _WIN32_WNT_NATIVE
 #define lstat stat
 #endif
 
+#ifdef COPY_TREE
+/* rename(2) can't cross filesystems; copy everything with its attributes
+ * and then remove the source */
+static int move_across(const char *source, const char *dest, const struct stat *st, const struct copy_options *options) {
+	struct stat dest_st;
+	if(lstat(dest, &dest_st) == 0) {
+		// Same rules as rename(2)
+		if(S_ISDIR(st->st_mode) != S_ISDIR(dest_st.st_mode)) {
+			errno = S_ISDIR(st->st_mode) ? ENOTDIR : EISDIR;
+			fprintf(stderr, "%s: %s: %s\n", options->prog, dest, strerror(errno));
+			return -1;
+		}
+		if(S_ISDIR(dest_st.st_mode) ? rmdir(dest) < 0 : unlink(dest) < 0) {
+			fprintf(stderr, "%s: %s: %s\n", options->prog, dest, strerror(errno));
+			return -1;
+		}
+	}
+	if(copy_tree(source, dest, options) < 0) return -1;
+	if(remove_recursive(source, options->threads) < 0) {
+		fprintf(stderr, "%s: %s: %s\n", options->prog, source, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+#endif
+
 int mv_main(int argc, char *argv[]) {
 	char *dest;
 	struct stat st;
 	int i;
+#ifdef COPY_TREE
+	struct copy_options options = { argv[0], COPY_ALL, -1, 0 };
+	int copied = 0;
+
+	while(1) {
+		int c = getopt(argc, argv, "gj:");
+		if(c == -1) break;
+		switch(c) {
+			case 'g':
+				options.progress = 1;
+				break;
+			case 'j':
+				options.threads = atoi(optarg);
+				if(options.threads < 0 || options.threads > COPY_MAX_THREADS) {
+					fprintf(stderr, "%s: thread count must be between 0 and %d\n", argv[0], COPY_MAX_THREADS);
+					return -1;
+				}
+				break;
+			default:
+				return -1;
+		}
+	}
+	argv[optind - 1] = argv[0];
+	argc -= optind - 1;
+	argv += optind - 1;
+	if(options.threads < 0) {
+		long int n = sysconf(_SC_NPROCESSORS_ONLN);
+		options.threads = n < 2 ? 0 : n > 8 ? 8 : n;
+	}
+#endif
 
 	if (argc < 3) {
-		fprintf(stderr,"Usage: %s <source...> <destination>\n", argv[0]);
+		fprintf(stderr,"Usage: %s"
+#ifdef COPY_TREE
+			" [-g] [-j <threads>]"
+#endif
+			" <source...> <destination>\n", argv[0]);
 		return -1;
 	}
 
@@ -47,6 +111,8 @@ int mv_main(int argc, char *argv[]) {
 		fprintf(stderr, "%s: %s: %s\n", argv[0], dest, strerror(ENOTDIR));
 		return 1;
 	}
+	// st is reused for each source below
+	int dest_is_dir = S_ISDIR(st.st_mode);
 
 	for (i = 1; i < argc - 1; i++) {
 		const char *source = argv[i];
@@ -59,7 +125,7 @@ int mv_main(int argc, char *argv[]) {
 		strcpy(fullDest, dest);
 
 		/* if destination is a directory, concat the source file name */
-		if(S_ISDIR(st.st_mode)) {
+		if(dest_is_dir) {
 			const char *fileName = strrchr(source, '/');
 			if(fullDest[strlen(fullDest)-1] != '/') {
 				strcat(fullDest, "/");
@@ -79,11 +145,21 @@ int mv_main(int argc, char *argv[]) {
 
 		/* attempt to move it */
 		if(rename(source, fullDest) < 0) {
+#ifdef COPY_TREE
+			if(errno == EXDEV) {
+				copied = 1;
+				if(move_across(source, fullDest, &st, &options) < 0) return 4;
+				continue;
+			}
+#endif
 			//perror("mv");
 			perror(argv[0]);
 			return 4;
 		}
 	}
 
+#ifdef COPY_TREE
+	if(copied && options.progress) copy_summary();
+#endif
 	return 0;
 }
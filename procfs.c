@@ -0,0 +1,334 @@
+/*	Reading processes and threads from /proc, shared by ps, top, lsof and schedtop.
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+#ifndef _WIN32
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#else
+#include <dirent.h>
+#endif
+#include "procfs.h"
+
+#ifdef __linux__
+/* As the kernel lays it out; older C libraries have no getdents64 wrapper */
+struct procfs_dirent {
+	unsigned long long int d_ino;
+	long long int d_off;
+	unsigned short int d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+#endif
+
+int procfs_open(void) {
+	return open("/proc", O_RDONLY | O_DIRECTORY);
+}
+
+static void add_id(const char *name, pid_t **ids, size_t *size, size_t *count) {
+	pid_t id = 0;
+	if(*name < '0' || *name > '9') return;
+	while(*name >= '0' && *name <= '9') id = id * 10 + (*name++ - '0');
+	if(*name) return;
+	if(*count == *size) {
+		*size = *size ? *size * 2 : 256;
+		*ids = realloc(*ids, *size * sizeof **ids);
+		if(!*ids) abort();
+	}
+	(*ids)[(*count)++] = id;
+}
+
+ssize_t procfs_list(int dir_fd, pid_t **ids, size_t *size) {
+	size_t count = 0;
+#ifdef __linux__
+	union {
+		unsigned long long int align;
+		char buf[16384];
+	} u;
+	long int len, off;
+	if(lseek(dir_fd, 0, SEEK_SET) < 0) return -1;
+	while((len = syscall(SYS_getdents64, dir_fd, u.buf, sizeof u.buf)) > 0) {
+		for(off = 0; off < len; off += ((struct procfs_dirent *)(u.buf + off))->d_reclen) {
+			add_id(((struct procfs_dirent *)(u.buf + off))->d_name, ids, size, &count);
+		}
+	}
+	if(len < 0) return -1;
+#else
+	struct dirent *de;
+	DIR *d;
+	int fd = dup(dir_fd);
+	if(fd < 0) return -1;
+	if(!(d = fdopendir(fd))) {
+		close(fd);
+		return -1;
+	}
+	rewinddir(d);
+	while((de = readdir(d))) add_id(de->d_name, ids, size, &count);
+	closedir(d);
+#endif
+	return count;
+}
+
+ssize_t procfs_tasks(int proc_fd, pid_t pid, pid_t **ids, size_t *size) {
+	char path[32];
+	ssize_t count;
+	int fd;
+	sprintf(path, "%d/task", (int)pid);
+	fd = openat(proc_fd, path, O_RDONLY | O_DIRECTORY);
+	if(fd < 0) return -1;
+	count = procfs_list(fd, ids, size);
+	close(fd);
+	return count;
+}
+
+ssize_t procfs_read_file(int fd, char *buf, size_t size) {
+	ssize_t len = pread(fd, buf, size - 1, 0);
+	if(len < 0) return -1;
+	buf[len] = 0;
+	return len;
+}
+
+ssize_t procfs_read_at(int proc_fd, const char *path, char *buf, size_t size) {
+	ssize_t len;
+	int fd = openat(proc_fd, path, O_RDONLY);
+	if(fd < 0) return -1;
+	len = procfs_read_file(fd, buf, size);
+	close(fd);
+	return len;
+}
+
+const char *procfs_skip_fields(const char *p, int n) {
+	while(n-- > 0) {
+		while(*p == ' ' || *p == '\t') p++;
+		while(*p && *p != ' ' && *p != '\t') p++;
+	}
+	return p;
+}
+
+unsigned long long int procfs_scan_ull(const char **p) {
+	const char *s = *p;
+	unsigned long long int v = 0;
+	int negative = 0;
+	while(*s == ' ' || *s == '\t') s++;
+	if(*s == '-') {
+		negative = 1;
+		s++;
+	}
+	while(*s >= '0' && *s <= '9') v = v * 10 + (*s++ - '0');
+	*p = s;
+	return negative ? -v : v;
+}
+
+unsigned long int procfs_scan_ulong(const char **p) {
+	return procfs_scan_ull(p);
+}
+
+int procfs_parse_stat(const char *buf, struct procfs_stat *st) {
+	/* Split at first '(' and last ')' to get process name. */
+	const char *open_paren = strchr(buf, '(');
+	const char *close_paren = strrchr(buf, ')');
+	const char *p;
+	if(!open_paren || !close_paren || close_paren < open_paren || close_paren[1] != ' ') return -1;
+	st->comm = open_paren + 1;
+	st->comm_len = close_paren - open_paren - 1;
+
+	/* Fields are counted from 1 as in proc(5); the state is the 3rd */
+	st->state = close_paren[2];
+	p = close_paren + 3;
+	st->ppid = procfs_scan_ulong(&p);
+	st->pgrp = procfs_scan_ulong(&p);
+	st->session = procfs_scan_ulong(&p);
+	st->tty_nr = procfs_scan_ulong(&p);
+	st->tpgid = procfs_scan_ulong(&p);
+	p = procfs_skip_fields(p, 1);
+	st->minflt = procfs_scan_ulong(&p);	/* 10 */
+	p = procfs_skip_fields(p, 1);
+	st->majflt = procfs_scan_ulong(&p);
+	p = procfs_skip_fields(p, 1);
+	st->utime = procfs_scan_ulong(&p);	/* 14 */
+	st->stime = procfs_scan_ulong(&p);
+	st->cutime = procfs_scan_ulong(&p);
+	st->cstime = procfs_scan_ulong(&p);
+	st->priority = procfs_scan_ulong(&p);
+	st->nice = procfs_scan_ulong(&p);
+	st->num_threads = procfs_scan_ulong(&p);	/* 20 */
+	p = procfs_skip_fields(p, 1);
+	st->starttime = procfs_scan_ull(&p);
+	st->vsize = procfs_scan_ulong(&p);	/* 23 */
+	st->rss = procfs_scan_ulong(&p);
+	p = procfs_skip_fields(p, 5);
+	st->kstkeip = procfs_scan_ulong(&p);	/* 30 */
+	p = procfs_skip_fields(p, 4);
+	st->wchan = procfs_scan_ulong(&p);	/* 35 */
+	p = procfs_skip_fields(p, 3);
+	st->processor = procfs_scan_ulong(&p);	/* 39 */
+	st->rt_priority = procfs_scan_ulong(&p);
+	st->policy = procfs_scan_ulong(&p);
+	return 0;
+}
+
+int procfs_parse_status(const char *buf, struct procfs_status *st) {
+	const char *p;
+	if(strncmp(buf, "Name:", 5)) return -1;
+	memset(st, 0, sizeof *st);
+	st->vm_size = st->vm_rss = st->vm_swap = -1;
+	for(p = buf; p; p = strchr(p, '\n')) {
+		if(*p == '\n') p++;
+		switch(*p) {
+			case 'G':
+				if(strncmp(p, "Gid:", 4) == 0) {
+					p += 4;
+					st->gid = procfs_scan_ulong(&p);
+					st->egid = procfs_scan_ulong(&p);
+				}
+				break;
+			case 'T':
+				if(strncmp(p, "Tgid:", 5) == 0) {
+					p += 5;
+					st->tgid = procfs_scan_ulong(&p);
+				} else if(strncmp(p, "Threads:", 8) == 0) {
+					p += 8;
+					st->threads = procfs_scan_ulong(&p);
+				}
+				break;
+			case 'U':
+				if(strncmp(p, "Uid:", 4) == 0) {
+					p += 4;
+					st->uid = procfs_scan_ulong(&p);
+					st->euid = procfs_scan_ulong(&p);
+				}
+				break;
+			case 'V':
+				if(strncmp(p, "VmSize:", 7) == 0) {
+					p += 7;
+					st->vm_size = procfs_scan_ulong(&p);
+				} else if(strncmp(p, "VmRSS:", 6) == 0) {
+					p += 6;
+					st->vm_rss = procfs_scan_ulong(&p);
+				} else if(strncmp(p, "VmSwap:", 7) == 0) {
+					p += 7;
+					st->vm_swap = procfs_scan_ulong(&p);
+				}
+				break;
+			case 'v':
+				if(strncmp(p, "voluntary_ctxt_switches:", 24) == 0) {
+					p += 24;
+					st->voluntary_ctxt_switches = procfs_scan_ulong(&p);
+				}
+				break;
+			case 'n':
+				if(strncmp(p, "nonvoluntary_ctxt_switches:", 27) == 0) {
+					p += 27;
+					st->nonvoluntary_ctxt_switches = procfs_scan_ulong(&p);
+				}
+				break;
+		}
+	}
+	return 0;
+}
+
+int procfs_parse_statm(const char *buf, struct procfs_statm *st) {
+	const char *p = buf;
+	if(*buf < '0' || *buf > '9') return -1;
+	st->size = procfs_scan_ulong(&p);
+	st->resident = procfs_scan_ulong(&p);
+	st->shared = procfs_scan_ulong(&p);
+	st->text = procfs_scan_ulong(&p);
+	p = procfs_skip_fields(p, 1);		/* lib, always 0 */
+	st->data = procfs_scan_ulong(&p);
+	return 0;
+}
+
+int procfs_parse_schedstat(const char *buf, struct procfs_schedstat *st) {
+	const char *p = buf;
+	if(*buf < '0' || *buf > '9') return -1;
+	st->exec_time = procfs_scan_ull(&p);
+	st->delay_time = procfs_scan_ull(&p);
+	st->run_count = procfs_scan_ulong(&p);
+	return 0;
+}
+
+int procfs_parse_fdinfo(const char *buf, struct procfs_fdinfo *st) {
+	const char *p;
+	if(strncmp(buf, "pos:", 4)) return -1;
+	memset(st, 0, sizeof *st);
+	for(p = buf; p; p = strchr(p, '\n')) {
+		if(*p == '\n') p++;
+		if(strncmp(p, "pos:", 4) == 0) {
+			p += 4;
+			st->pos = procfs_scan_ull(&p);
+		} else if(strncmp(p, "flags:", 6) == 0) {
+			// In octal
+			for(p += 6; *p == ' ' || *p == '\t'; p++);
+			while(*p >= '0' && *p <= '7') st->flags = st->flags * 8 + (*p++ - '0');
+		} else if(strncmp(p, "mnt_id:", 7) == 0) {
+			p += 7;
+			st->mnt_id = procfs_scan_ulong(&p);
+		}
+	}
+	return 0;
+}
+
+int procfs_read(int proc_fd, pid_t pid, pid_t tid, unsigned int fields, struct procfs_task *task) {
+	char path[64];
+	char buf[PROCFS_STATUS_SIZE];
+	ssize_t len;
+	int n;
+
+	if(task->pid != pid || task->tid != tid) {
+		task->pid = pid;
+		task->tid = tid;
+		task->fields = 0;
+	}
+
+	if(fields & PROCFS_OWNER) {
+		struct stat st;
+		sprintf(path, "%d", (int)pid);
+		if(fstatat(proc_fd, path, &st, 0) < 0) return -1;
+		task->owner = st.st_uid;
+	}
+
+	if(tid) n = sprintf(path, "%d/task/%d/", (int)pid, (int)tid);
+	else n = sprintf(path, "%d/", (int)pid);
+
+	if(fields & PROCFS_STAT) {
+		strcpy(path + n, "stat");
+		if(procfs_read_at(proc_fd, path, task->stat_buf, sizeof task->stat_buf) < 0) return -1;
+		if(procfs_parse_stat(task->stat_buf, &task->stat) < 0) return -1;
+	}
+	if(fields & PROCFS_STATUS) {
+		strcpy(path + n, "status");
+		if(procfs_read_at(proc_fd, path, buf, sizeof buf) < 0) return -1;
+		if(procfs_parse_status(buf, &task->status) < 0) return -1;
+	}
+	if(fields & PROCFS_STATM) {
+		strcpy(path + n, "statm");
+		if(procfs_read_at(proc_fd, path, buf, sizeof buf) < 0) return -1;
+		if(procfs_parse_statm(buf, &task->statm) < 0) return -1;
+	}
+	if(fields & PROCFS_SCHEDSTAT) {
+		strcpy(path + n, "schedstat");
+		if(procfs_read_at(proc_fd, path, buf, sizeof buf) < 0) return -1;
+		if(procfs_parse_schedstat(buf, &task->schedstat) < 0) return -1;
+	}
+	if(fields & PROCFS_CMDLINE) {
+		strcpy(path + n, "cmdline");
+		len = procfs_read_at(proc_fd, path, task->cmdline, sizeof task->cmdline);
+		if(len < 0) return -1;
+		task->cmdline_len = len;
+	}
+
+	task->fields |= fields;
+	return 0;
+}
+#endif
@@ -16,6 +16,10 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <pwd.h>
+#ifdef __linux__
+#include <time.h>
+#include "procfs.h"
+#endif
 
 #ifdef __INTERIX
 static char *nextline(char **s) {
@@ -27,7 +31,7 @@ static char *getvalue(char **s) {
 	while(**s && *(*s)++ != '	');
 	return *s;
 }
-#else
+#elif !defined __linux__
 static char *nexttoksep(char **strp, const char *sep) {
 	char *p = strsep(strp, sep);
 	return p ? : "";
@@ -46,10 +50,268 @@ static char *nexttok(char **strp) {
 
 static int display_flags = 0;
 
-static int ps_line(int pid, int tid, const char *namefilter) {
+#ifdef __linux__
+/*
+ * Tasks are listed and read through procfs.c, relative to one descriptor
+ * for /proc. Only the files that the shown columns need are read at all,
+ * so 'ps -o pid,rss' never opens cmdline, and the output goes out through
+ * one large stdout buffer.
+ */
+
+/* Beyond the PROCFS_* bits */
+#define NEED_LABEL	(1U << 16)
+
+struct ps_info {
+	struct procfs_task task;
+	pid_t pid, ppid;
+	const char *name;
+	char comm[64];
+	char label[1024];
+};
+
+enum {
+	COL_USER, COL_UID, COL_PID, COL_PPID, COL_VSIZE, COL_RSS, COL_CPU,
+	COL_PRIO, COL_NICE, COL_RTPRI, COL_SCHED, COL_WCHAN, COL_PC, COL_STATE,
+	COL_UTIME, COL_STIME, COL_LABEL, COL_COMM, COL_NAME
+};
+
+/* In the order of the enum above; widths are at least the header length,
+ * and a width of 0 is for values of any length, only shown last */
+static const struct ps_column {
+	const char *name;
+	const char *header;
+	int width;
+	unsigned int need;
+} columns[] = {
+	{ "user", "USER", 9, PROCFS_OWNER },
+	{ "uid", "UID", 5, PROCFS_OWNER },
+	{ "pid", "PID", 5, 0 },
+	{ "ppid", "PPID", 5, PROCFS_STAT },
+	{ "vsize", "VSIZE", 6, PROCFS_STAT },
+	{ "rss", "RSS", 5, PROCFS_STAT },
+	{ "cpu", "CPU", 3, PROCFS_STAT },
+	{ "prio", "PRIO", 5, PROCFS_STAT },
+	{ "nice", "NICE", 5, PROCFS_STAT },
+	{ "rtpri", "RTPRI", 5, PROCFS_STAT },
+	{ "sched", "SCHED", 5, PROCFS_STAT },
+	{ "wchan", "WCHAN", 8, PROCFS_STAT },
+	{ "pc", "PC", 8, PROCFS_STAT },
+	{ "s", "S", 1, PROCFS_STAT },
+	{ "utime", "UTIME", 6, PROCFS_STAT },
+	{ "stime", "STIME", 6, PROCFS_STAT },
+	{ "label", "LABEL", 30, NEED_LABEL },
+	{ "comm", "COMM", 15, PROCFS_STAT },
+	{ "name", "NAME", 0, PROCFS_CMDLINE }
+};
+
+#define MAX_COLUMNS 32
+
+static int shown[MAX_COLUMNS];
+static int num_shown;
+static unsigned int page_kb;
+static int proc_fd;
+
+#define USER_HASH_SIZE 64
+
+struct user_entry {
+	struct user_entry *next;
+	uid_t uid;
+	char name[32];
+};
+
+static struct user_entry *users[USER_HASH_SIZE];
+
+/* Looks the uid up in the password database once, and remembers the name */
+static const char *user_name(uid_t uid) {
+	struct user_entry **slot = &users[uid % USER_HASH_SIZE];
+	struct user_entry *e;
+	struct passwd *pw;
+	for(e = *slot; e; e = e->next) {
+		if(e->uid == uid) return e->name;
+	}
+	e = malloc(sizeof *e);
+	if(!e) abort();
+	pw = getpwuid(uid);
+	if(pw) snprintf(e->name, sizeof e->name, "%s", pw->pw_name);
+	else snprintf(e->name, sizeof e->name, "%d", (int)uid);
+	e->uid = uid;
+	e->next = *slot;
+	*slot = e;
+	return e->name;
+}
+
+static int parse_columns(const char *list) {
+	char *copy = strdup(list);
+	char *p = copy, *name;
+	size_t i;
+	if(!copy) abort();
+	while((name = strsep(&p, ","))) {
+		for(i = 0; i < sizeof columns / sizeof *columns; i++) {
+			if(strcmp(name, columns[i].name) == 0) break;
+		}
+		if(i == sizeof columns / sizeof *columns) {
+			fprintf(stderr, "ps: unknown column '%s'\n", name);
+			free(copy);
+			return -1;
+		}
+		if(num_shown == MAX_COLUMNS) {
+			fprintf(stderr, "ps: too many columns\n");
+			free(copy);
+			return -1;
+		}
+		if(num_shown && !columns[shown[num_shown - 1]].width) {
+			fprintf(stderr, "ps: column '%s' can only be the last\n", columns[shown[num_shown - 1]].name);
+			free(copy);
+			return -1;
+		}
+		shown[num_shown++] = i;
+	}
+	free(copy);
+	return 0;
+}
+
+/* Pads the value to its column, less what earlier values on the line took
+ * beyond theirs, so a wide value shifts the following columns only as far
+ * as it has to */
+static void print_field(int i, const char *value, int *excess) {
+	int width = columns[shown[i]].width - *excess;
+	int len = strlen(value);
+	if(i == num_shown - 1) {
+		fputs(value, stdout);
+		return;
+	}
+	if(width < 0) width = 0;
+	printf("%-*s ", width, value);
+	*excess += (len > width ? len : width) - columns[shown[i]].width;
+}
+
+static int ps_read(int pid, int tid, unsigned int need, struct ps_info *info) {
+	struct procfs_task *task = &info->task;
+	// Threads show the name from stat
+	unsigned int fields = need & (tid ? PROCFS_STAT | PROCFS_OWNER : PROCFS_STAT | PROCFS_OWNER | PROCFS_CMDLINE);
+	char path[64];
+	size_t len;
+	ssize_t r;
+
+	if(procfs_read(proc_fd, pid, tid, fields, task) < 0) return -1;
+	if((need & PROCFS_CMDLINE) && !(fields & PROCFS_STAT) && (tid || !task->cmdline[0])) {
+		if(procfs_read(proc_fd, pid, tid, PROCFS_STAT, task) < 0) return -1;
+		fields |= PROCFS_STAT;
+	}
+
+	info->name = info->comm;
+	info->comm[0] = 0;
+	if(fields & PROCFS_STAT) {
+		len = task->stat.comm_len;
+		if(len >= sizeof info->comm) len = sizeof info->comm - 1;
+		memcpy(info->comm, task->stat.comm, len);
+		info->comm[len] = 0;
+	}
+	if((fields & PROCFS_CMDLINE) && task->cmdline[0]) info->name = task->cmdline;
+
+	if(need & NEED_LABEL) {
+		if(tid) sprintf(path, "%d/task/%d/attr/current", pid, tid);
+		else sprintf(path, "%d/attr/current", pid);
+		r = procfs_read_at(proc_fd, path, info->label, sizeof info->label);
+		if(r > 0 && info->label[r - 1] == '\n') info->label[--r] = 0;
+		if(r <= 0) strcpy(info->label, "-");
+	}
+
+	if(tid) {
+		info->pid = tid;
+		info->ppid = pid;
+	} else {
+		info->pid = pid;
+		info->ppid = task->stat.ppid;
+	}
+	return 0;
+}
+
+static void print_header() {
+	int excess = 0;
+	int i;
+	for(i = 0; i < num_shown; i++) print_field(i, columns[shown[i]].header, &excess);
+	putchar('\n');
+}
+
+static void print_columns(const struct ps_info *info) {
+	const struct procfs_stat *st = &info->task.stat;
+	char field[32];
+	int excess = 0;
+	int i;
+	for(i = 0; i < num_shown; i++) {
+		const char *value = field;
+		switch(shown[i]) {
+			case COL_USER: value = user_name(info->task.owner); break;
+			case COL_UID: sprintf(field, "%u", (unsigned int)info->task.owner); break;
+			case COL_PID: sprintf(field, "%d", (int)info->pid); break;
+			case COL_PPID: sprintf(field, "%d", (int)info->ppid); break;
+			case COL_VSIZE: sprintf(field, "%lu", st->vsize / 1024); break;
+			case COL_RSS: sprintf(field, "%lu", (unsigned long int)st->rss * page_kb); break;
+			case COL_CPU: sprintf(field, "%d", st->processor); break;
+			case COL_PRIO: sprintf(field, "%ld", st->priority); break;
+			case COL_NICE: sprintf(field, "%ld", st->nice); break;
+			case COL_RTPRI: sprintf(field, "%u", st->rt_priority); break;
+			case COL_SCHED: sprintf(field, "%u", st->policy); break;
+			case COL_WCHAN: sprintf(field, "%08x", (unsigned int)st->wchan); break;
+			case COL_PC: sprintf(field, "%08x", (unsigned int)st->kstkeip); break;
+			case COL_STATE: sprintf(field, "%c", st->state); break;
+			case COL_UTIME: sprintf(field, "%lu", st->utime); break;
+			case COL_STIME: sprintf(field, "%lu", st->stime); break;
+			case COL_LABEL: value = info->label; break;
+			case COL_COMM: value = info->comm; break;
+			case COL_NAME: value = info->name; break;
+		}
+		print_field(i, value, &excess);
+	}
+	putchar('\n');
+}
+
+static void print_default(const struct ps_info *info) {
+	const struct procfs_stat *st = &info->task.stat;
+	const char *user = user_name(info->task.owner);
+	if (display_flags & SHOW_MACLABEL) {
+		printf("%-30s %-9s %-5d %-5d %s\n", info->label, user, (int)info->pid, (int)info->ppid, info->name);
+		return;
+	}
+
+	printf("%-9s %-5d %-5d %-6lu %-5ld", user, (int)info->pid, (int)info->ppid, st->vsize / 1024, st->rss * page_kb);
+	if(display_flags & SHOW_CPU) printf(" %-2d", st->processor);
+	if(display_flags & SHOW_PRIO) printf(" %-5ld %-5ld %-5u %-5u", st->priority, st->nice, st->rt_priority, st->policy);
+
+	printf(" %08x %08x %c %s", (unsigned int)st->wchan, (unsigned int)st->kstkeip, st->state, info->name);
+	if(display_flags&SHOW_TIME) printf(" (u:%lu, s:%lu)", st->utime, st->stime);
+
+	putchar('\n');
+}
+
+/* Returns 1 if the task could be read */
+static int ps_task(int pid, int tid, unsigned int need, const char *namefilter) {
+	static struct ps_info info;
+	if(ps_read(pid, tid, need, &info) < 0) return 0;
+	if(namefilter && strcmp(info.comm, namefilter)) return 1;
+	if(num_shown) print_columns(&info);
+	else print_default(&info);
+	return 1;
+}
+
+static int ps_threads(int pid, unsigned int need, const char *namefilter) {
+	static pid_t *tids;
+	static size_t tids_size;
+	ssize_t count, i;
+	int n = 0;
+	count = procfs_tasks(proc_fd, pid, &tids, &tids_size);
+	for(i = 0; i < count; i++) {
+		if(tids[i] == pid) continue;
+		n += ps_task(pid, tids[i], need, namefilter);
+	}
+	return n;
+}
+#else
+
+static int ps_line(int pid, const char *namefilter) {
 	char statline[1024];
 	char command[1024];
-	char macline[1024];
 	char user[32];
 	struct stat stats;
 	int fd, r;
@@ -63,34 +325,21 @@ static int ps_line(int pid, int tid, const char *namefilter) {
 	sprintf(statline, "/proc/%d", pid);
 	stat(statline, &stats);
 
-#ifdef __linux__
-	if(tid) {
-		sprintf(statline, "/proc/%d/task/%d/stat", pid, tid);
-		command[0] = 0;
-		snprintf(macline, sizeof(macline), "/proc/%d/task/%d/attr/current", pid, tid);
-	} else {
-#endif
 #ifdef __FreeBSD__
-		sprintf(statline, "/proc/%d/status", pid);
+	sprintf(statline, "/proc/%d/status", pid);
 #else
-		sprintf(statline, "/proc/%d/stat", pid);
+	sprintf(statline, "/proc/%d/stat", pid);
 #endif
-		sprintf(command, "/proc/%d/cmdline", pid);
-#ifdef __linux__
-		snprintf(macline, sizeof(macline), "/proc/%d/attr/current", pid);
-#endif
-		fd = open(command, O_RDONLY);
-		if(fd == -1) {
-			r = 0;
-		} else {
-			r = read(fd, command, 1023);
-			close(fd);
-			if(r < 0) r = 0;
-		}
-		command[r] = 0;
-#ifdef __linux__
+	sprintf(command, "/proc/%d/cmdline", pid);
+	fd = open(command, O_RDONLY);
+	if(fd == -1) {
+		r = 0;
+	} else {
+		r = read(fd, command, 1023);
+		close(fd);
+		if(r < 0) r = 0;
 	}
-#endif
+	command[r] = 0;
 	fd = open(statline, O_RDONLY);
 	if(fd == -1) return -1;
 	r = read(fd, statline, 1023);
@@ -208,12 +457,6 @@ static int ps_line(int pid, int tid, const char *namefilter) {
 	sched = atoi(nexttok(&ptr)); // scheduling policy
 	
 	tty = atoi(nexttok(&ptr));
-#ifdef __linux__
-	if(tid != 0) {
-		ppid = pid;
-		pid = tid;
-	}
-#endif
 #endif
 
 	pw = getpwuid(stats.st_uid);
@@ -224,18 +467,6 @@ static int ps_line(int pid, int tid, const char *namefilter) {
 	}
 
 	if(!namefilter || strcmp(name, namefilter) == 0) {
-		if (display_flags & SHOW_MACLABEL) {
-			fd = open(macline, O_RDONLY);
-			strcpy(macline, "-");
-			if(fd >= 0) {
-				r = read(fd, macline, sizeof(macline)-1);
-				close(fd);
-				if(r > 0) macline[r] = 0;
-			}
-			printf("%-30s %-9s %-5d %-5d %s\n", macline, user, pid, ppid, command[0] ? command : name);
-			return 0;
-		}
-
 		printf("%-9s %-5d %-5d %-6d %-5d", user, pid, ppid, vss / 1024, rss * 4);
 		if(display_flags & SHOW_CPU) printf(" %-2d", psr);
 		if(display_flags & SHOW_PRIO) printf(" %-5d %-5d %-5d %-5d", prio, nice, rtprio, sched);
@@ -247,46 +478,38 @@ static int ps_line(int pid, int tid, const char *namefilter) {
 	}
 	return 0;
 }
-
-#ifdef __linux__
-static void ps_threads(int pid, const char *namefilter) {
-	char tmp[128];
-	DIR *d;
-	struct dirent *de;
-
-	sprintf(tmp,"/proc/%d/task",pid);
-	d = opendir(tmp);
-	if(!d) return;
-	while((de = readdir(d))) {
-		if(isdigit(de->d_name[0])) {
-			int tid = atoi(de->d_name);
-			if(tid == pid) continue;
-			ps_line(pid, tid, namefilter);
-		}
-	}
-	closedir(d);
-}
 #endif
 
 int ps_main(int argc, char **argv) {
+#ifdef __linux__
+	static pid_t *pids;
+	static size_t pids_size;
+	struct timespec start, end;
+	ssize_t count, i;
+	const char *format = NULL;
+	unsigned int need;
+	int threads = 0, timing = 0, tasks = 0;
+#else
 	DIR *d;
 	struct dirent *de;
+#endif
 	const char *namefilter = 0;
 	int pidfilter = 0;
-#ifdef __linux__
-	int threads = 0;
-#endif
-
-	d = opendir("/proc");
-	if(!d) {
-		perror("/proc");
-		return -1;
-	}
 
 	while(argc > 1) {
 #ifdef __linux__
 		if(strcmp(argv[1], "-t") == 0) {
 			threads = 1;
+		} else if(strcmp(argv[1], "-T") == 0) {
+			timing = 1;
+		} else if(strcmp(argv[1], "-o") == 0) {
+			if(argc < 3) {
+				fprintf(stderr, "ps: -o needs a list of columns\n");
+				return -1;
+			}
+			format = argv[2];
+			argc--;
+			argv++;
 		} else
 #endif
 		if(strcmp(argv[1],"-x") == 0) {
@@ -308,6 +531,33 @@ int ps_main(int argc, char **argv) {
 		argv++;
 	}
 
+#ifdef __linux__
+	if(format && parse_columns(format) < 0) return -1;
+	need = PROCFS_STAT | PROCFS_CMDLINE | PROCFS_OWNER;
+	if(display_flags & SHOW_MACLABEL) need |= NEED_LABEL;
+	if(num_shown) {
+		need = 0;
+		for(i = 0; i < num_shown; i++) need |= columns[shown[i]].need;
+	}
+	if(namefilter) need |= PROCFS_STAT;
+	page_kb = getpagesize() / 1024;
+	proc_fd = procfs_open();
+	if(proc_fd < 0) {
+		perror("/proc");
+		return -1;
+	}
+	setvbuf(stdout, NULL, _IOFBF, 65536);
+
+	if(num_shown) {
+		print_header();
+	} else
+#else
+	d = opendir("/proc");
+	if(!d) {
+		perror("/proc");
+		return -1;
+	}
+#endif
 	if (display_flags & SHOW_MACLABEL) {
 		printf("LABEL                          USER     PID   PPID  NAME\n");
 	} else {
@@ -315,17 +565,34 @@ int ps_main(int argc, char **argv) {
 			(display_flags & SHOW_CPU) ? "CPU " : "",
 			(display_flags & SHOW_PRIO) ? "PRIO  NICE  RTPRI SCHED " : "");
 	}
+#ifdef __linux__
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	count = procfs_list(proc_fd, &pids, &pids_size);
+	if(count < 0) {
+		perror("/proc");
+		return -1;
+	}
+	for(i = 0; i < count; i++) {
+		if(pidfilter && pidfilter != pids[i]) continue;
+		tasks += ps_task(pids[i], 0, need, namefilter);
+		if(threads) tasks += ps_threads(pids[i], need, namefilter);
+	}
+	fflush(stdout);
+	if(timing) {
+		// How long taking the listing took, for comparing against other tools
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		fprintf(stderr, "ps: %d tasks in %.3f ms\n", tasks,
+			(end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0);
+	}
+	close(proc_fd);
+#else
 	while((de = readdir(d))) {
 		if(isdigit(de->d_name[0])) {
 			int pid = atoi(de->d_name);
-			if(!pidfilter || pidfilter == pid) {
-				ps_line(pid, 0, namefilter);
-#ifdef __linux__
-				if(threads) ps_threads(pid, namefilter);
-#endif
-			}
+			if(!pidfilter || pidfilter == pid) ps_line(pid, namefilter);
 		}
 	}
 	closedir(d);
+#endif
 	return 0;
 }
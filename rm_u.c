@@ -8,8 +8,10 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <dirent.h>
 #include <limits.h>
@@ -20,6 +22,8 @@
 #define lstat stat
 #endif
 
+#include "rmtree.h"
+
 #define OPT_RECURSIVE 1
 #define OPT_FORCE 2
 
@@ -28,10 +32,23 @@ static void usage() {
 #if defined _WIN32 && !defined _WIN32_WNT_NATIVE
 		".exe"
 #endif
-		" [-rR] [-f] <target> [...]\n");
+		" [-rR] [-f]"
+#ifdef FD_RELATIVE_REMOVAL
+		" [-j <threads>]"
+#endif
+		" <target> [...]\n");
 	//return -1;
 }
 
+#ifdef FD_RELATIVE_REMOVAL
+static int thread_count;
+
+/* return -1 on failure, with errno set to the first error */
+static int unlink_recursive(const char *name, int flags) {
+	if(remove_recursive(name, thread_count) == 0) return 0;
+	return errno == ENOENT && flags & OPT_FORCE ? 0 : -1;
+}
+#else
 /* return -1 on failure, with errno set to the first error */
 static int unlink_recursive(const char* name, int flags)
 {
@@ -82,6 +99,7 @@ static int unlink_recursive(const char* name, int flags)
     /* delete target directory */
     return rmdir(name);
 }
+#endif
 
 int rm_main(int argc, char *argv[])
 {
@@ -90,6 +108,9 @@ int rm_main(int argc, char *argv[])
 	int i;
 	int flags = 0;
 
+#ifdef FD_RELATIVE_REMOVAL
+	thread_count = 0;
+#endif
 /*
 	if(argc < 2) {
 		usage();
@@ -98,7 +119,11 @@ int rm_main(int argc, char *argv[])
 */
 	/* check flags */
 	while(1) {
-		int c = getopt(argc, argv, "frR");
+		int c = getopt(argc, argv, "frR"
+#ifdef FD_RELATIVE_REMOVAL
+			"j:"
+#endif
+			);
 		if(c == -1) break;
 		switch (c) {
 			case 'f':
@@ -111,6 +136,15 @@ int rm_main(int argc, char *argv[])
 			case 'R':
 				flags |= OPT_RECURSIVE;
 				break;
+#ifdef FD_RELATIVE_REMOVAL
+			case 'j':
+				thread_count = atoi(optarg);
+				if(thread_count < 0 || thread_count > MAX_RM_THREADS) {
+					fprintf(stderr, "rm: thread count must be between 0 and %d\n", MAX_RM_THREADS);
+					return -1;
+				}
+				break;
+#endif
 		}
 	}
 
@@ -0,0 +1,328 @@
+/*	Recursive removal, shared by the tools that delete trees.
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+#ifndef _RMTREE_H
+#define _RMTREE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined AT_REMOVEDIR && !defined _WIN32
+#define FD_RELATIVE_REMOVAL
+#include <pthread.h>
+
+/*
+ * Recursive removal works on an explicit stack of open directories, each
+ * entry removed relative to its directory's fd, so the depth of the tree
+ * is limited neither by the C stack nor by PATH_MAX. Entries are unlinked
+ * without looking at them first; only those d_type says are directories,
+ * or that unlinkat(2) refuses as such, are descended into. Past
+ * MAX_OPEN_DIRS levels the outer directories are closed and later reopened
+ * through "..".
+ *
+ * With a thread pool, a walker whose subdirectory would leave a thread
+ * idle hands it to the pool instead of descending; a directory is only
+ * removed once all subtrees handed off from it are gone, and a walker
+ * waiting for that works on queued subtrees meanwhile.
+ */
+
+#define MAX_OPEN_DIRS 64
+#define MAX_RM_THREADS 64
+
+struct rm_frame {
+	struct rm_frame *parent;
+	DIR *dir;
+	char *name;		/* in the parent */
+	dev_t dev;		/* to check a reopened directory */
+	ino_t ino;
+	int pending;		/* subtrees handed to the pool */
+};
+
+struct rm_task {
+	struct rm_frame *parent;
+	char *name;
+	struct rm_task *next;
+};
+
+static int rm_threads;		/* in the pool, besides the calling one */
+static pthread_mutex_t rm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rm_cond = PTHREAD_COND_INITIALIZER;
+static struct rm_task *task_queue;
+static int queued_tasks, idle_threads;
+static int rm_error;		/* the first error of the current argument */
+static int stop_workers;
+
+static int rm_failed() {
+	int e;
+	if(!rm_threads) return rm_error;
+	pthread_mutex_lock(&rm_lock);
+	e = rm_error;
+	pthread_mutex_unlock(&rm_lock);
+	return e;
+}
+
+static void rm_set_error(int e) {
+	if(rm_threads) pthread_mutex_lock(&rm_lock);
+	if(!rm_error) rm_error = e;
+	if(rm_threads) {
+		pthread_cond_broadcast(&rm_cond);
+		pthread_mutex_unlock(&rm_lock);
+	}
+}
+
+static struct rm_frame *open_frame(struct rm_frame *parent, int dirfd, const char *name) {
+	struct rm_frame *frame;
+	DIR *d = NULL;
+	int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if(fd >= 0 && !(d = fdopendir(fd))) {
+		int e = errno;
+		close(fd);
+		errno = e;
+	}
+	if(!d) return NULL;
+	frame = malloc(sizeof *frame);
+	if(!frame || !(frame->name = strdup(name))) {
+		free(frame);
+		closedir(d);
+		errno = ENOMEM;
+		return NULL;
+	}
+	frame->parent = parent;
+	frame->dir = d;
+	frame->pending = 0;
+	return frame;
+}
+
+/* Closes the outermost open directories of the walk that nothing else uses */
+static void limit_open_dirs(struct rm_frame *top) {
+	struct rm_frame *frame, *outermost = NULL;
+	struct stat st;
+	int count = 0;
+	for(frame = top; frame; frame = frame->parent) {
+		if(!frame->dir) break;
+		count++;
+		outermost = frame;
+	}
+	if(count <= MAX_OPEN_DIRS) return;
+	if(rm_threads) pthread_mutex_lock(&rm_lock);
+	if(!outermost->pending && fstat(dirfd(outermost->dir), &st) == 0) {
+		outermost->dev = st.st_dev;
+		outermost->ino = st.st_ino;
+		closedir(outermost->dir);
+		outermost->dir = NULL;
+	}
+	if(rm_threads) pthread_mutex_unlock(&rm_lock);
+}
+
+/* Reopens a closed directory from its child */
+static int reopen_frame(struct rm_frame *frame, struct rm_frame *child) {
+	struct stat st;
+	int fd = openat(dirfd(child->dir), "..", O_RDONLY | O_DIRECTORY);
+	if(fd < 0) return -1;
+	if(fstat(fd, &st) < 0 || st.st_dev != frame->dev || st.st_ino != frame->ino) {
+		// Something moved the tree under us
+		close(fd);
+		errno = ESTALE;
+		return -1;
+	}
+	if(!(frame->dir = fdopendir(fd))) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+	return 0;
+}
+
+static void remove_tree(int dirfd, const char *name);
+
+static void run_task(struct rm_task *task) {
+	if(!rm_failed()) remove_tree(dirfd(task->parent->dir), task->name);
+	pthread_mutex_lock(&rm_lock);
+	task->parent->pending--;
+	pthread_cond_broadcast(&rm_cond);
+	pthread_mutex_unlock(&rm_lock);
+	free(task->name);
+	free(task);
+}
+
+/* Called with rm_lock held */
+static struct rm_task *take_task() {
+	struct rm_task *task = task_queue;
+	task_queue = task->next;
+	queued_tasks--;
+	return task;
+}
+
+/* Waits until the subtrees handed off from the directory are gone */
+static void wait_pending(struct rm_frame *frame) {
+	if(!rm_threads) return;
+	pthread_mutex_lock(&rm_lock);
+	while(frame->pending) {
+		if(task_queue) {
+			struct rm_task *task = take_task();
+			pthread_mutex_unlock(&rm_lock);
+			run_task(task);
+			pthread_mutex_lock(&rm_lock);
+		} else pthread_cond_wait(&rm_cond, &rm_lock);
+	}
+	pthread_mutex_unlock(&rm_lock);
+}
+
+/* Hands the subdirectory to the pool if a thread would be idle otherwise */
+static int hand_off(struct rm_frame *frame, const char *name) {
+	struct rm_task *task;
+	if(!rm_threads) return 0;
+	pthread_mutex_lock(&rm_lock);
+	if(queued_tasks >= idle_threads || !(task = malloc(sizeof *task)) || !(task->name = strdup(name))) {
+		if(queued_tasks < idle_threads) free(task);
+		pthread_mutex_unlock(&rm_lock);
+		return 0;
+	}
+	task->parent = frame;
+	task->next = task_queue;
+	task_queue = task;
+	queued_tasks++;
+	frame->pending++;
+	pthread_cond_signal(&rm_cond);
+	pthread_mutex_unlock(&rm_lock);
+	return 1;
+}
+
+static void *rm_worker(void *arg) {
+	pthread_mutex_lock(&rm_lock);
+	while(1) {
+		struct rm_task *task;
+		idle_threads++;
+		while(!stop_workers && !task_queue) pthread_cond_wait(&rm_cond, &rm_lock);
+		idle_threads--;
+		if(stop_workers) break;
+		task = take_task();
+		pthread_mutex_unlock(&rm_lock);
+		run_task(task);
+		pthread_mutex_lock(&rm_lock);
+	}
+	pthread_mutex_unlock(&rm_lock);
+	return NULL;
+}
+
+/* Removes the directory name and everything in it, recording the first
+ * error in rm_error */
+static void remove_tree(int base_fd, const char *name) {
+	struct rm_frame *top = open_frame(NULL, base_fd, name);
+	if(!top) {
+		rm_set_error(errno);
+		return;
+	}
+	while(top) {
+		struct dirent *de;
+		int fd = dirfd(top->dir);
+		if(rm_failed()) break;
+		errno = 0;
+		if(!(de = readdir(top->dir))) {
+			struct rm_frame *frame = top;
+			if(errno) {
+				rm_set_error(errno);
+				break;
+			}
+			wait_pending(frame);
+			if(frame->parent && !frame->parent->dir && reopen_frame(frame->parent, frame) < 0) {
+				rm_set_error(errno);
+				break;
+			}
+			top = frame->parent;
+			closedir(frame->dir);
+			if(unlinkat(top ? dirfd(top->dir) : base_fd, frame->name, AT_REMOVEDIR) < 0) rm_set_error(errno);
+			free(frame->name);
+			free(frame);
+			continue;
+		}
+		if(de->d_name[0] == '.' && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2]))) continue;
+#ifdef DT_DIR
+		if(de->d_type != DT_DIR)
+#endif
+		{
+			int e;
+			if(unlinkat(fd, de->d_name, 0) == 0 || errno == ENOENT) continue;
+			if(errno != EISDIR && errno != EPERM) {
+				rm_set_error(errno);
+				break;
+			}
+			e = errno;
+			{
+				struct rm_frame *frame = open_frame(top, fd, de->d_name);
+				if(!frame) {
+					// Refused for some other reason than being a directory
+					rm_set_error(errno == ENOTDIR ? e : errno);
+					break;
+				}
+				top = frame;
+			}
+		} else if(!hand_off(top, de->d_name)) {
+			struct rm_frame *frame = open_frame(top, fd, de->d_name);
+			if(!frame) {
+				if(errno == ENOENT) continue;
+				rm_set_error(errno);
+				break;
+			}
+			top = frame;
+		}
+		limit_open_dirs(top);
+	}
+	// Unwinding after an error, handed off subtrees still use the directories
+	while(top) {
+		struct rm_frame *frame = top;
+		wait_pending(frame);
+		top = frame->parent;
+		if(frame->dir) closedir(frame->dir);
+		free(frame->name);
+		free(frame);
+	}
+}
+
+/* Removes name, with everything in it if it is a directory, with a pool of
+ * threads besides the calling one; returns -1 on failure, with errno set
+ * to the first error */
+static int remove_recursive(const char *name, int threads) {
+	pthread_t pool[MAX_RM_THREADS];
+	int count = 0;
+	int e;
+
+	if(unlinkat(AT_FDCWD, name, 0) == 0) return 0;
+	if(errno != EISDIR && errno != EPERM) return -1;
+	e = errno;
+
+	rm_threads = threads;
+	rm_error = 0;
+	stop_workers = 0;
+	for(count = 0; count < rm_threads; count++) {
+		if(pthread_create(&pool[count], NULL, rm_worker, NULL)) break;
+	}
+	remove_tree(AT_FDCWD, name);
+	if(rm_threads) {
+		pthread_mutex_lock(&rm_lock);
+		stop_workers = 1;
+		pthread_cond_broadcast(&rm_cond);
+		pthread_mutex_unlock(&rm_lock);
+		while(count > 0) pthread_join(pool[--count], NULL);
+		idle_threads = 0;
+	}
+
+	if(!rm_error) return 0;
+	errno = rm_error == ENOTDIR && e != EISDIR ? e : rm_error;
+	return -1;
+}
+
+#endif
+
+#endif
@@ -9,10 +9,10 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <dirent.h>
 #include <signal.h>
 
 #include <pwd.h>
+#include "procfs.h"
 
 struct thread_info {
 	int pid;
@@ -74,23 +74,13 @@ static void commit_item(struct thread_table *table)
 	table->active++;
 }
 
-static int read_line(char *line, size_t line_size) {
-	int fd;
-	int len;
-	fd = open(line, O_RDONLY);
-	if(fd == -1) return -1;
-	len = read(fd, line, line_size - 1);
-	close(fd);
-	if(len <= 0) return -1;
-	line[len] = 0;
-	return 0;
-}
+static int proc_fd = -1;
 
-static void add_thread(int pid, int tid, struct thread_info *proc_info) {
+/* Returns the new entry, or NULL if the task couldn't be read */
+static struct thread_info *add_thread(int pid, int tid, struct thread_info *proc_info) {
 	//fprintf(stderr, "function: add_thread(%d, %d, %p)\n", pid, tid, proc_info);
-	unsigned long long int exec_time, delay_time;
-	char line[1024];
-	char *name, *name_end;
+	static struct procfs_task task;
+	const char *name;
 	size_t name_len;
 	struct thread_info *info;
 	if(tid == 0) info = get_item(&processes);
@@ -98,59 +88,39 @@ static void add_thread(int pid, int tid, struct thread_info *proc_info) {
 	info->pid = pid;
 	info->tid = tid;
 
-	if(tid) sprintf(line, "/proc/%d/task/%d/schedstat", pid, tid);
-	else sprintf(line, "/proc/%d/schedstat", pid);
-	if(read_line(line, sizeof line)) return;
-	if(sscanf(line, "%llu %llu %u", &exec_time, &delay_time, &info->run_count) != 3) return;
-	info->exec_time = exec_time;
-	info->delay_time = delay_time;
+	if(procfs_read(proc_fd, pid, tid, tid ? PROCFS_SCHEDSTAT : PROCFS_SCHEDSTAT | PROCFS_CMDLINE, &task) < 0) return NULL;
+	info->exec_time = task.schedstat.exec_time;
+	info->delay_time = task.schedstat.delay_time;
+	info->run_count = task.schedstat.run_count;
 	if(proc_info) {
 		proc_info->exec_time += info->exec_time;
 		proc_info->delay_time += info->delay_time;
 		proc_info->run_count += info->run_count;
 	}
 
-	name = NULL;
-	if (!tid) {
-		sprintf(line, "/proc/%d/cmdline", pid);
-		if (read_line(line, sizeof(line)) == 0 && line[0]) {
-			name = line;
-			name_len = strlen(name);
-		}
-	}
-	if(!name) {
-		if(tid) sprintf(line, "/proc/%d/task/%d/stat", pid, tid);
-		else sprintf(line, "/proc/%d/stat", pid);
-		if(read_line(line, sizeof(line))) return;
-		name = strchr(line, '(');
-		if(name == NULL) return;
-		name_end = strchr(name, ')');
-		if(name_end == NULL) return;
-		name++;
-		name_len = name_end - name;
+	if(!tid && task.cmdline[0]) {
+		name = task.cmdline;
+		name_len = strlen(name);
+	} else {
+		if(procfs_read(proc_fd, pid, tid, PROCFS_STAT, &task) < 0) return NULL;
+		name = task.stat.comm;
+		name_len = task.stat.comm_len;
 	}
 	if (name_len >= sizeof(info->name))
 		name_len = sizeof(info->name) - 1;
 	memcpy(info->name, name, name_len);
 	info->name[name_len] = '\0';
 	commit_item(tid ? &threads : &processes);
+	return info;
 }
 
 static void add_threads(int pid, struct thread_info *proc_info)
 {
-	char path[1024];
-	DIR *d;
-	struct dirent *de;
-	sprintf(path, "/proc/%d/task", pid);
-	d = opendir(path);
-	if(!d) return;
-	while((de = readdir(d))) {
-		if(isdigit(de->d_name[0])) {
-			int tid = atoi(de->d_name);
-			add_thread(pid, tid, proc_info);
-		}
-	}
-	closedir(d);
+	static pid_t *tids;
+	static size_t tids_size;
+	ssize_t count = procfs_tasks(proc_fd, pid, &tids, &tids_size);
+	ssize_t i;
+	for(i = 0; i < count; i++) add_thread(pid, tids[i], proc_info);
 }
 
 static void print_threads(int pid, uint32_t flags)
@@ -173,24 +143,21 @@ static void print_threads(int pid, uint32_t flags)
 	}
 }
 
-static void update_table(DIR *d, uint32_t flags)
+static void update_table(uint32_t flags)
 {
+	static pid_t *pids;
+	static size_t pids_size;
+	ssize_t count = procfs_list(proc_fd, &pids, &pids_size);
+	ssize_t k;
 	size_t i, j;
-	struct dirent *de;
 
-	rewinddir(d);
-	while((de = readdir(d))) {
-		//puts(de->d_name);
-		if(isdigit(de->d_name[0])) {
-			int pid = atoi(de->d_name);
-			struct thread_info *proc_info;
-			add_thread(pid, 0, NULL);
-			proc_info = processes.data + processes.active - 1;
-			proc_info->exec_time = 0;
-			proc_info->delay_time = 0;
-			proc_info->run_count = 0;
-			add_threads(pid, proc_info);
-		}
+	for(k = 0; k < count; k++) {
+		struct thread_info *proc_info = add_thread(pids[k], 0, NULL);
+		if(!proc_info) continue;
+		proc_info->exec_time = 0;
+		proc_info->delay_time = 0;
+		proc_info->run_count = 0;
+		add_threads(pids[k], proc_info);
 	}
 	if(!(flags & FLAG_BATCH)) printf("\e[H\e[0J");
 	printf("Processes: %lu, Threads %lu\n", (long int)processes.active, (long int)threads.active);
@@ -245,7 +212,6 @@ static void sig(int signum) {
 }
 
 int schedtop_main(int argc, char **argv) {
-	DIR *d;
 	char *namefilter = 0;
 	int pidfilter = 0;
 	uint32_t flags = 0;
@@ -287,8 +253,8 @@ int schedtop_main(int argc, char **argv) {
 		}
 	}
 
-	d = opendir("/proc");
-	if(!d) return -1;
+	proc_fd = procfs_open();
+	if(proc_fd < 0) return -1;
 
 	if(!(flags & FLAG_BATCH)) {
 		if(flags & FLAG_USE_ALTERNATE_SCREEN) {
@@ -300,9 +266,9 @@ int schedtop_main(int argc, char **argv) {
 		printf("\e[2J");
 	}
 	while(1) {
-		update_table(d, flags);
+		update_table(flags);
 		usleep(delay);
 	}
-	closedir(d);
+	close(proc_fd);
 	return 0;
 }
@@ -12,6 +12,7 @@
 #include <errno.h>
 #include <time.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -22,40 +23,262 @@
 #endif
 extern struct tm *gmtime_r(const time_t *, struct tm *);
 extern struct tm *localtime_r(const time_t *, struct tm *);
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
 #else
-#define BUFFER_SIZE 4096
+#include <sys/uio.h>
+#include <poll.h>
+#define BUFFER_SIZE (64 * 1024)
+#endif
+
+#if defined IOV_MAX && IOV_MAX < 1024
+#define MAX_IOV IOV_MAX
+#elif defined IOV_MAX
+#define MAX_IOV 1024
+#else
+#define MAX_IOV 16
 #endif
 
 #define DEFAULT_FORMAT "%a %b %e %H:%M:%S %Z %Y "
+#define MAX_TAG_LEN 512
+#define NSEC_PER_SEC 1000000000ULL
+
+enum {
+	TAG_WALL_CLOCK,
+	TAG_MONOTONIC,
+	TAG_ELAPSED,
+	TAG_DELTA
+};
+
+static int utc;
+static const char *format;
+static int tag_mode = TAG_WALL_CLOCK;
+static int nanoseconds;
+static int summary;
+
+/* Time of the last read, taken as soon as it returned */
+static time_t read_time;
+static unsigned long long int read_ns;
+static unsigned long long int start_ns, last_line_ns;
+static unsigned long int line_count;
+
+/* Formatted tags of the queued lines. A tag is reused while its key (the
+ * second for strftime(3) formats, the printed value otherwise) is unchanged */
+static char tag_buf[16 * 1024];
+static size_t tag_buf_len;
+static const char *tag;
+static size_t tag_len;
+static unsigned long long int tag_key;
+static int have_tag;
+
+/* Pending output; entries point into tag_buf and the input buffer */
+static struct iovec iov[MAX_IOV];
+static int iov_count;
+
+/* Inter-line gaps, in decades starting below 1 microsecond */
+#define GAP_BUCKETS 9
+static const char *const gap_bucket_names[GAP_BUCKETS] = {
+	"< 1us", "< 10us", "< 100us", "< 1ms", "< 10ms", "< 100ms", "< 1s", "< 10s", ">= 10s"
+};
+static unsigned long int gap_buckets[GAP_BUCKETS];
+static unsigned long long int gap_min, gap_max, gap_total;
 
 static void print_usage(const char *name) {
-	fprintf(stderr, "Usage: %s [-u] [<format>]\n", name);
+	fprintf(stderr, "Usage: %s [-s] [-u] [<format>]\n"
+		"   or: %s [-s] [-n] {-m|-e|-d}\n\n"
+		"Options:\n"
+		"	-u	Use UTC for <format>\n"
+		"	-m	Tag lines with the monotonic clock, in seconds\n"
+		"	-e	Tag lines with the time elapsed since start\n"
+		"	-d	Tag lines with the time since the previous line\n"
+		"	-n	Use nanosecond instead of microsecond resolution for -m, -e and -d\n"
+		"	-s	Print a histogram of inter-line gaps to stderr at the end\n\n",
+		name, name);
 }
 
+static unsigned long long int get_monotonic_ns() {
+#ifdef _WIN32
+	return GetTickCount() * 1000000ULL;
+#else
+	struct timespec ts;
+	if(clock_gettime(CLOCK_MONOTONIC, &ts) < 0) return 0;
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+#endif
+}
+
+static size_t format_seconds(char *buffer, unsigned long long int ns) {
+	if(nanoseconds) {
+		return sprintf(buffer, "%llu.%09llu", ns / NSEC_PER_SEC, ns % NSEC_PER_SEC);
+	}
+	return sprintf(buffer, "%llu.%06llu", ns / NSEC_PER_SEC, ns % NSEC_PER_SEC / 1000);
+}
+
+#define ONES ((unsigned long int)-1 / 0xff)
+#define HAS_ZERO(X) (((X) - ONES) & ~(X) & (ONES << 7))
+
+/* Finds the first c1 or c2 in s, a word at a time once s is aligned */
 static void *mem2chr(const void *s, int c1, int c2, size_t n) {
-	char *p = (void *)s;
-	unsigned int i = 0;
-	while(i < n) {
-		if(p[i] == c1 || p[i] == c2) return p + i;
-		i++;
+	const unsigned char *p = s;
+	unsigned long int m1 = ONES * (unsigned char)c1;
+	unsigned long int m2 = ONES * (unsigned char)c2;
+	while(n && ((size_t)p & (sizeof(unsigned long int) - 1))) {
+		if(*p == (unsigned char)c1 || *p == (unsigned char)c2) return (void *)p;
+		p++;
+		n--;
+	}
+	while(n >= sizeof(unsigned long int)) {
+		unsigned long int w, x1, x2;
+		memcpy(&w, p, sizeof w);
+		x1 = w ^ m1;
+		x2 = w ^ m2;
+		if(HAS_ZERO(x1) || HAS_ZERO(x2)) break;
+		p += sizeof w;
+		n -= sizeof w;
+	}
+	while(n) {
+		if(*p == (unsigned char)c1 || *p == (unsigned char)c2) return (void *)p;
+		p++;
+		n--;
 	}
 	return NULL;
 }
 
-static void print_timetag(int utc, const char *format, const char *message, size_t msg_len) {
-	char buffer[512];
-	time_t t = time(NULL);
-	struct tm tm;
-	(utc ? gmtime_r : localtime_r)(&t, &tm);
-	size_t tag_len = strftime(buffer, sizeof buffer, format, &tm);
-	write(STDOUT_FILENO, buffer, tag_len);
-	write(STDOUT_FILENO, message, msg_len);
-	//write(STDOUT_FILENO, "\n", 1);
+#ifdef _WIN32
+static ssize_t writev(int fd, const struct iovec *v, int count) {
+	ssize_t total = 0;
+	int i;
+	for(i = 0; i < count; i++) {
+		ssize_t s = write(fd, v[i].iov_base, v[i].iov_len);
+		if(s < 0) return total ? total : -1;
+		total += s;
+		if((size_t)s < v[i].iov_len) break;
+	}
+	return total;
+}
+#endif
+
+static void flush_output() {
+	struct iovec *v = iov;
+	int count = iov_count;
+	while(count > 0) {
+		ssize_t s = writev(STDOUT_FILENO, v, count);
+		if(s < 0) {
+			if(errno == EINTR) continue;
+			break;
+		}
+		while(count > 0 && (size_t)s >= v->iov_len) {
+			s -= v->iov_len;
+			v++;
+			count--;
+		}
+		if(count > 0) {
+			v->iov_base = (char *)v->iov_base + s;
+			v->iov_len -= s;
+		}
+	}
+	iov_count = 0;
+	tag_buf_len = 0;
+	have_tag = 0;
+}
+
+static void queue_output(const void *p, size_t len) {
+	if(iov_count == MAX_IOV) flush_output();
+	iov[iov_count].iov_base = (void *)p;
+	iov[iov_count].iov_len = len;
+	iov_count++;
+}
+
+static void record_gap(unsigned long long int gap) {
+	unsigned long long int limit = 1000;
+	int i = 0;
+	while(i < GAP_BUCKETS - 1 && gap >= limit) {
+		limit *= 10;
+		i++;
+	}
+	gap_buckets[i]++;
+	if(line_count == 2 || gap < gap_min) gap_min = gap;
+	if(gap > gap_max) gap_max = gap;
+	gap_total += gap;
+}
+
+static void print_summary() {
+	unsigned long int max_count = 0;
+	char min_s[32], avg_s[32], max_s[32];
+	int i;
+	fprintf(stderr, "%lu lines\n", line_count);
+	if(line_count < 2) return;
+	format_seconds(min_s, gap_min);
+	format_seconds(avg_s, gap_total / (line_count - 1));
+	format_seconds(max_s, gap_max);
+	fprintf(stderr, "gap min %s avg %s max %s\n", min_s, avg_s, max_s);
+	for(i = 0; i < GAP_BUCKETS; i++) {
+		if(gap_buckets[i] > max_count) max_count = gap_buckets[i];
+	}
+	for(i = 0; i < GAP_BUCKETS; i++) {
+		int bar = gap_buckets[i] * 40 / max_count;
+		fprintf(stderr, "%8s %10lu ", gap_bucket_names[i], gap_buckets[i]);
+		while(bar-- > 0) fputc('#', stderr);
+		fputc('\n', stderr);
+	}
+}
+
+static void print_timetag(const char *message, size_t msg_len) {
+	unsigned long long int key;
+	switch(tag_mode) {
+		case TAG_WALL_CLOCK:
+			key = read_time;
+			break;
+		case TAG_MONOTONIC:
+			key = read_ns;
+			break;
+		case TAG_ELAPSED:
+			key = read_ns - start_ns;
+			break;
+		default:
+			key = line_count ? read_ns - last_line_ns : 0;
+			break;
+	}
+	line_count++;
+	if(summary && line_count > 1) record_gap(read_ns - last_line_ns);
+	last_line_ns = read_ns;
+
+	if(iov_count + 2 > MAX_IOV) flush_output();
+	if(!have_tag || key != tag_key) {
+		char *p;
+		if(sizeof tag_buf - tag_buf_len < MAX_TAG_LEN) flush_output();
+		p = tag_buf + tag_buf_len;
+		if(tag_mode == TAG_WALL_CLOCK) {
+			time_t t = key;
+			struct tm tm;
+			(utc ? gmtime_r : localtime_r)(&t, &tm);
+			tag_len = strftime(p, MAX_TAG_LEN, format, &tm);
+		} else {
+			tag_len = format_seconds(p, key);
+			p[tag_len++] = ' ';
+		}
+		tag = p;
+		tag_buf_len += tag_len;
+		tag_key = key;
+		have_tag = 1;
+	}
+	queue_output(tag, tag_len);
+	queue_output(message, msg_len);
+}
+
+/* Whether more input can be read without blocking; when it can't, pending
+ * output is flushed before the next read so interactive use isn't delayed */
+static int input_pending() {
+#ifdef _WIN32
+	return 0;
+#else
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	return poll(&pfd, 1, 0) > 0;
+#endif
 }
 
 int timetag_main(int argc, char **argv) {
-	int utc = 0;
-	const char *format = NULL;
 	int i = 1;
 	int end_of_options = 0;
 	while(argv[i]) {
@@ -67,6 +290,21 @@ int timetag_main(int argc, char **argv) {
 					putenv("TZ=UTC");
 					tzset();
 					break;
+				case 'm':
+					tag_mode = TAG_MONOTONIC;
+					break;
+				case 'e':
+					tag_mode = TAG_ELAPSED;
+					break;
+				case 'd':
+					tag_mode = TAG_DELTA;
+					break;
+				case 'n':
+					nanoseconds = 1;
+					break;
+				case 's':
+					summary = 1;
+					break;
 				case 'h':
 					print_usage(argv[0]);
 					return 0;
@@ -90,51 +328,66 @@ int timetag_main(int argc, char **argv) {
 		i++;
 	}
 	if(!format) format = DEFAULT_FORMAT;
+	else if(tag_mode != TAG_WALL_CLOCK) {
+		fprintf(stderr, "%s: <format> can't be used with -m, -e or -d\n", argv[0]);
+		return -1;
+	}
+	start_ns = get_monotonic_ns();
 
-	char buffer[BUFFER_SIZE];
-	int s, ss = 0;
+	static char buffer[BUFFER_SIZE];
+	// Bytes in [start, end) of buffer are an incomplete line not yet queued
+	size_t start = 0, end = 0;
+	ssize_t s;
 	int no_tag = 0;
 	int r = 0;
-	do {
-		s = read(STDIN_FILENO, buffer + ss, sizeof buffer - ss);
+	while(1) {
+		if(iov_count && !input_pending()) flush_output();
+		if(!iov_count && start == end) start = end = 0;
+		if(end == sizeof buffer) {
+			flush_output();
+			if(start == 0) {
+				// A line longer than the buffer, continue it untagged
+				if(no_tag) queue_output(buffer, end);
+				else print_timetag(buffer, end);
+				flush_output();
+				end = 0;
+				no_tag = 1;
+			} else {
+				memmove(buffer, buffer + start, end - start);
+				end -= start;
+				start = 0;
+			}
+		}
+		s = read(STDIN_FILENO, buffer + end, sizeof buffer - end);
 		if(s < 0) {
 			if(errno == EINTR) continue;
 			perror("read");
 			r = 1;
 			break;
 		}
-		char *br = mem2chr(buffer + ss, 0, '\n', s);
-		if(br) {
-			int skip_len = 0;
-			char *last_br;
-			do {
-				if(!*br) *br = '\n';
-				br++;
-				int msg_len = br - buffer - skip_len;
-				if(no_tag) {
-					write(STDOUT_FILENO, buffer + skip_len, msg_len);
-					no_tag = 0;
-				} else print_timetag(utc, format, buffer + skip_len, msg_len);
-				last_br = br;
-				br = mem2chr(br, 0, '\n', s - (br - (buffer + ss)));
-				skip_len += msg_len;
-				//fprintf(stderr, "br = %p, *br = '%c', skip_len = %d\n", br, br ? *br : 0, skip_len);
-			} while(br);
-			ss += s - skip_len;
-			memmove(buffer, last_br, ss);
-		} else {
-			ss += s;
-			if(ss == sizeof buffer) {
-				print_timetag(utc, format, buffer, sizeof buffer);
-				ss = 0;
-				no_tag = 1;
-			}
+		if(!s) break;
+		read_ns = get_monotonic_ns();
+		if(tag_mode == TAG_WALL_CLOCK) read_time = time(NULL);
+		char *p = buffer + end;
+		char *br;
+		end += s;
+		while((br = mem2chr(p, 0, '\n', buffer + end - p))) {
+			if(!*br) *br = '\n';
+			br++;
+			if(no_tag) {
+				queue_output(buffer + start, br - buffer - start);
+				no_tag = 0;
+			} else print_timetag(buffer + start, br - buffer - start);
+			start = br - buffer;
+			p = br;
 		}
-	} while(s > 0);
-	if(ss) {
-		if(no_tag) write(STDOUT_FILENO, buffer, ss);
-		else print_timetag(utc, format, buffer, ss);
-		putchar('\n');
 	}
+	if(end > start) {
+		if(no_tag) queue_output(buffer + start, end - start);
+		else print_timetag(buffer + start, end - start);
+		queue_output("\n", 1);
+	}
+	flush_output();
+	if(summary) print_summary();
 	return r;
 }
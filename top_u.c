@@ -17,9 +17,10 @@
  */
 
 #include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
+#include <limits.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,6 +31,19 @@
 #include <termios.h>
 #include <signal.h>
 #include <sys/select.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "procfs.h"
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#ifdef CN_IDX_PROC
+#define PROC_CONNECTOR
+#endif
+#endif
 
 struct cpu_info {
 	unsigned long int utime, ntime, stime, itime;
@@ -43,12 +57,18 @@ struct cpu_info {
 #define PRINT_BUF() \
 	do { \
 		if(use_tty) { \
-			fprintf(stdout, "%-*.*s", sz.ws_col, sz.ws_col, buf); \
+			frame_line(buf, 0); \
 		} else { \
 			fputs(buf, stdout); \
 		} \
 	} while(0)
 
+/* On a terminal every line is a row of the frame */
+#define END_LINE() \
+	do { \
+		if(!use_tty) putchar('\n'); \
+	} while(0)
+
 struct proc_info {
 	struct proc_info *next;
 	pid_t pid;
@@ -58,6 +78,7 @@ struct proc_info {
 	char name[PROC_NAME_LEN];
 	char tname[THREAD_NAME_LEN];
 	char state;
+	pid_t ppid;
 	unsigned long int utime;
 	unsigned long int stime;
 	unsigned long int delta_utime;
@@ -67,9 +88,37 @@ struct proc_info {
 	unsigned long int rss;
 	int prs;
 	int num_threads;
+	long int pss, uss, swap;	/* KiB, or -1 if not known */
+	struct proc_source *src;
 	//char policy[POLICY_NAME_LEN];
 };
 
+/*
+ * What is known about a process, or a thread in thread mode, for as long as
+ * it lives: its stat file is kept open and just read again from the start
+ * on each refresh, and its command line and owner are only read once.
+ * In thread mode a record with a tid of 0 holds the process wide part and
+ * keeps the task directory open instead.
+ */
+struct proc_source {
+	struct proc_source *next;	/* in the hash chain */
+	pid_t pid;
+	pid_t tid;
+	int stat_fd;			/* NO_FD until opened, NO_FD_KEPT if over the budget */
+	int task_fd;			/* same */
+	unsigned int generation;	/* of the last refresh that saw it */
+	unsigned long int utime, stime;	/* as of that refresh */
+	unsigned long int child_time;	/* of children that exited since */
+	int needs_info;			/* new from a fork, or exec'ed */
+	uid_t uid;
+	gid_t gid;
+	long int pss, uss, swap;	/* from the last read of smaps_rollup */
+	char name[PROC_NAME_LEN];
+};
+
+#define NO_FD (-1)
+#define NO_FD_KEPT (-2)
+
 struct proc_list {
 	struct proc_info **array;
 	int size;
@@ -79,18 +128,90 @@ struct proc_list {
 
 #define INIT_PROCS 50
 #define THREAD_MULT 8
-static struct proc_info **old_procs, **new_procs;
-static int num_old_procs, num_new_procs;
+static struct proc_info **new_procs;
+static int num_new_procs, new_procs_size;
 static struct proc_info *free_procs;
 static int num_used_procs, num_free_procs;
 
-static int max_procs, iterations, threads;
+static int max_procs, iterations, threads, timing;
+static struct timespec read_time, sort_time;
+
+#define INIT_SOURCE_BUCKETS 256
+#define STAT_BUF_SIZE 1024
+#define STATUS_BUF_SIZE 4096
+#define SMAPS_BUF_SIZE 4096
+static struct proc_source **sources;
+static unsigned int source_mask, num_sources, generation;
+static int proc_fd = -1, cpu_stat_fd = -1;
+
+/* Files are only kept open up to a budget below RLIMIT_NOFILE, leaving
+ * room for those opened just once; past it they are opened on each read */
+#define FD_HEADROOM 64
+static int kept_fds, kept_fd_limit;
+
+/*
+ * With the proc connector, forks and exits come in as netlink events and
+ * the table is kept up to date from them, so /proc is only listed again
+ * when events were lost. The time a process used since the last refresh
+ * is read when it exits and added to its parent; a reaped process can't
+ * be read anymore, those are counted as missed.
+ */
+static int events_fd = -1, events_lost;
+static unsigned int num_forks, num_exits, num_short_lived, num_missed;
+static unsigned long int exited_time;
 
 static struct cpu_info old_cpu, new_cpu;
 
+/* Per CPU, indexed by the N of the cpuN lines; offline ones aren't seen */
+static struct cpu_info *old_cpus, *new_cpus;
+static unsigned char *old_cpu_seen, *new_cpu_seen;
+static int num_cpus, per_cpu;
+#define CPU_LINE_SIZE 256
+#define CPU_CELL_GAP 3
+#define CPU_BATCH_WIDTH 132
+
+/* Memory mode: smaps_rollup is costly, so it is read only every
+ * mem_delay_ms, and only for as many of the largest processes by RSS as
+ * are shown */
+#define MEM_PROCS_DEFAULT 20
+static int memory, mem_delay_ms, mem_procs;
+static struct timespec mem_time;
+static long int mem_pss, mem_uss, mem_swap;
+
+/* Batch recording */
+#define RECORD_CSV 1
+#define RECORD_JSON 2
+enum {
+	COL_TIME, COL_PID, COL_TID, COL_UID, COL_USER, COL_NAME, COL_THREAD, COL_STATE,
+	COL_CPU, COL_TICKS, COL_RSS, COL_VSS, COL_PSS, COL_USS, COL_SWAP, COL_THR, COL_PRS, COL_CPUS,
+	COL_FORKS, COL_EXITS, COL_SHORT, COL_SELF, NUM_COLUMNS
+};
+static const char *const column_names[NUM_COLUMNS] = {
+	"time", "pid", "tid", "uid", "user", "name", "thread", "state",
+	"cpu", "ticks", "rss", "vss", "pss", "uss", "swap", "thr", "prs", "cpus",
+	"forks", "exits", "short", "self"
+};
+static int record_format;
+static unsigned char record_columns[NUM_COLUMNS];
+static int num_record_columns;
+static long long int self_us;
+
 #ifndef _WIN32
 /* windows size struct */
 static struct winsize sz;
+
+/*
+ * A terminal is redrawn from a frame of sz.ws_row rows of sz.ws_col
+ * characters, compared to a shadow of what the terminal shows, so that
+ * only what changed is sent, in a single write.
+ */
+static char *frame, *shadow;
+static unsigned char *frame_attr, *shadow_attr;
+static int frame_rows, frame_cols, frame_row, shadow_valid;
+static char *out_buf;
+static size_t out_len, out_size, last_frame_bytes;
+static unsigned long long int total_frame_bytes;
+static unsigned long int num_frames;
 static int use_tty;
 static struct termios orig_termios;
 #endif
@@ -98,19 +219,33 @@ static struct termios orig_termios;
 static struct proc_info *alloc_proc(void);
 static void free_proc(struct proc_info *proc);
 static void read_procs(void);
-static int read_stat(const char *filename, struct proc_info *proc);
+static int read_stat(struct proc_source *src, struct proc_info *proc);
 static void add_proc(int proc_num, struct proc_info *proc);
-static int read_cmdline(const char *filename, struct proc_info *proc);
-static int read_status(const char *filename, struct proc_info *proc);
+static void read_cmdline(struct proc_source *src);
+static void read_status(struct proc_source *src);
 static void print_procs(void);
-static struct proc_info *find_old_proc(pid_t pid, pid_t tid);
-static void free_old_procs(void);
+static void frame_begin(void);
+static void frame_line(const char *text, int highlight);
+static void frame_flush(void);
+static int print_cpus(int width, int count_only);
+static const char *allowed_cpus(pid_t tid, size_t max_len);
+static int parse_columns(const char *list);
+static void record_procs(void);
+static long long int cpu_used_us(void);
+static void select_procs(int count);
+static void open_events(void);
+static void read_events(void);
+static void refresh_memory(int count);
 static int (*proc_cmp)(const void *, const void *);
 static int proc_cpu_cmp(const void *, const void *);
 static int proc_vss_cmp(const void *, const void *);
 static int proc_rss_cmp(const void *, const void *);
 static int proc_thr_cmp(const void *, const void *);
+static int proc_pss_cmp(const void *, const void *);
+static int proc_uss_cmp(const void *, const void *);
+static int proc_swap_cmp(const void *, const void *);
 static int numcmp(long long, long long);
+static int id_cmp(const struct proc_info *, const struct proc_info *);
 static void usage(const char *);
 static void SIGINT_handler(int);
 
@@ -118,22 +253,45 @@ static void restore_terminal() {
 	if(!use_tty) return;
 	//printf("\x1b[?47l\x1b[?25h");
 	printf("\x1b[?25h");
+	// Leave the cursor below the last frame
+	if(frame_rows) printf("\x1b[%d;1H\n", frame_rows);
 	tcsetattr(STDIN_FILENO, TCSANOW, &orig_termios);
 }
 
 int top_main(int argc, char *argv[]) {
 	int i;
 	int end_of_options;
-	fd_set *fdset = NULL;
-	int delay;
+	fd_set fdset;
+	int delay_ms;
+	const char *columns = NULL;
+	char *end;
+	double secs;
+	struct timespec next, now;
 	struct timeval delay_tv;
 
 	num_used_procs = num_free_procs = 0;
 
+#ifdef RLIMIT_NOFILE
+	{
+		// Every process, or thread with -t, keeps a file open
+		struct rlimit rl;
+		if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+			rl.rlim_cur = rl.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &rl);
+		}
+		kept_fd_limit = INT_MAX;
+		if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < INT_MAX) {
+			kept_fd_limit = rl.rlim_cur > 2 * FD_HEADROOM ? rl.rlim_cur - FD_HEADROOM : rl.rlim_cur / 2;
+		}
+	}
+#else
+	kept_fd_limit = INT_MAX;
+#endif
+
 	max_procs = -1;
-	delay = 3;
+	delay_ms = 3000;
 	iterations = -1;
-	proc_cmp = &proc_cpu_cmp;
+	proc_cmp = NULL;
 	use_tty = -1;
 	end_of_options = 0;
 
@@ -173,7 +331,34 @@ int top_main(int argc, char *argv[]) {
 							usage(argv[0]);
 							return EXIT_FAILURE;
 						}
-						delay = atoi(argv[++i]);
+						secs = strtod(argv[++i], &end);
+						if(*end || end == argv[i] || secs < 0 || secs > 86400) {
+							fprintf(stderr, "Invalid delay \"%s\".\n", argv[i]);
+							return EXIT_FAILURE;
+						}
+						delay_ms = secs * 1000 + 0.5;
+						break;
+					case 'o':
+						if(i + 1 >= argc) {
+							fprintf(stderr, "Option -o expects an argument.\n");
+							usage(argv[0]);
+							return EXIT_FAILURE;
+						}
+						i++;
+						if(strcmp(argv[i], "csv") == 0) record_format = RECORD_CSV;
+						else if(strcmp(argv[i], "json") == 0) record_format = RECORD_JSON;
+						else {
+							fprintf(stderr, "Invalid argument \"%s\" for option -o.\n", argv[i]);
+							return EXIT_FAILURE;
+						}
+						break;
+					case 'c':
+						if(i + 1 >= argc) {
+							fprintf(stderr, "Option -c expects an argument.\n");
+							usage(argv[0]);
+							return EXIT_FAILURE;
+						}
+						columns = argv[++i];
 						break;
 					case 's':
 						if(i + 1 >= argc) {
@@ -186,6 +371,9 @@ int top_main(int argc, char *argv[]) {
 						else if(strcmp(argv[i], "vss") == 0) { proc_cmp = &proc_vss_cmp; }
 						else if(strcmp(argv[i], "rss") == 0) { proc_cmp = &proc_rss_cmp; }
 						else if(strcmp(argv[i], "thr") == 0) { proc_cmp = &proc_thr_cmp; }
+						else if(strcmp(argv[i], "pss") == 0) { proc_cmp = &proc_pss_cmp; }
+						else if(strcmp(argv[i], "uss") == 0) { proc_cmp = &proc_uss_cmp; }
+						else if(strcmp(argv[i], "swap") == 0) { proc_cmp = &proc_swap_cmp; }
 						else {
 							fprintf(stderr, "Invalid argument \"%s\" for option -s.\n", argv[i]);
 							return EXIT_FAILURE;
@@ -194,6 +382,26 @@ int top_main(int argc, char *argv[]) {
 					case 't':
 						threads = 1;
 						break;
+					case 'T':
+						timing = 1;
+						break;
+					case 'P':
+						per_cpu = 1;
+						break;
+					case 'M':
+						if(i + 1 >= argc) {
+							fprintf(stderr, "Option -M expects an argument.\n");
+							usage(argv[0]);
+							return EXIT_FAILURE;
+						}
+						secs = strtod(argv[++i], &end);
+						if(*end || end == argv[i] || secs < 0 || secs > 86400) {
+							fprintf(stderr, "Invalid delay \"%s\".\n", argv[i]);
+							return EXIT_FAILURE;
+						}
+						memory = 1;
+						mem_delay_ms = secs * 1000 + 0.5;
+						break;
 					case 'h':
 						usage(argv[0]);
 						return EXIT_SUCCESS;
@@ -218,11 +426,50 @@ int top_main(int argc, char *argv[]) {
 		fprintf(stderr, "%s: Sorting by threads per thread makes no sense!\n", argv[0]);
 		return EXIT_FAILURE;
 	}
+	if(threads && memory) {
+		fprintf(stderr, "%s: Memory is shared by the threads of a process, -M is per process.\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if(!memory && (proc_cmp == &proc_pss_cmp || proc_cmp == &proc_uss_cmp || proc_cmp == &proc_swap_cmp)) {
+		fprintf(stderr, "%s: Sorting by PSS, USS or swap needs -M.\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if(!proc_cmp) proc_cmp = memory ? &proc_pss_cmp : &proc_cpu_cmp;
+
+	num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	if(num_cpus < 1) num_cpus = 1;
+	if(per_cpu) {
+		old_cpus = calloc(num_cpus, sizeof(struct cpu_info));
+		new_cpus = calloc(num_cpus, sizeof(struct cpu_info));
+		old_cpu_seen = calloc(num_cpus, 1);
+		new_cpu_seen = calloc(num_cpus, 1);
+		if(!old_cpus || !new_cpus || !old_cpu_seen || !new_cpu_seen) die("Could not allocate CPU table.\n");
+	}
+
+	if(columns && !record_format) {
+		fprintf(stderr, "%s: Option -c only applies with -o.\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if(record_format) {
+		if(!columns) columns = threads ? "time,pid,tid,thread,cpu,rss,self" : "time,pid,name,cpu,rss,thr,self";
+		if(parse_columns(columns) < 0) return EXIT_FAILURE;
+		use_tty = 0;
+		// Records go out through stdio in one write per sample
+		setvbuf(stdout, NULL, _IOFBF, 65536);
+		if(record_format == RECORD_CSV) {
+			for(i = 0; i < num_record_columns; i++) {
+				if(i) putchar(',');
+				fputs(column_names[record_columns[i]], stdout);
+			}
+			putchar('\n');
+		}
+		self_us = cpu_used_us();
+	}
 
 	free_procs = NULL;
 
-	num_new_procs = num_old_procs = 0;
-	new_procs = old_procs = NULL;
+	num_new_procs = new_procs_size = 0;
+	new_procs = NULL;
 
 	if(use_tty == -1) use_tty = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
 	if(use_tty) {
@@ -241,40 +488,68 @@ int top_main(int argc, char *argv[]) {
 		struct termios new_termios = orig_termios;
 		new_termios.c_lflag &= ~(ICANON | ECHO);
 		tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
-
-		fdset = malloc(sizeof(fd_set));
 	}
 
+	// Subscribe before the first scan, so no process falls in between
+	if(!threads) open_events();
 	read_procs();
+	clock_gettime(CLOCK_MONOTONIC, &next);
 	while(iterations == -1 || iterations-- > 0) {
-		if(use_tty && fdset) {
-			FD_ZERO(fdset);
-			FD_SET(STDIN_FILENO, fdset);
-		}
-		delay_tv.tv_sec = delay;
-		delay_tv.tv_usec = 0;
-		old_procs = new_procs;
-		num_old_procs = num_new_procs;
+		long int wait_ms;
+		// Sleep to a fixed schedule, so that slow refreshes don't make it drift
+		next.tv_sec += delay_ms / 1000;
+		next.tv_nsec += delay_ms % 1000 * 1000000L;
+		if(next.tv_nsec >= 1000000000L) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if((next.tv_sec - now.tv_sec) * 1000 + (next.tv_nsec - now.tv_nsec) / 1000000 < 0) {
+			// Fell behind; start the schedule again from here
+			next = now;
+		}
 		memcpy(&old_cpu, &new_cpu, sizeof(old_cpu));
+		if(per_cpu) {
+			memcpy(old_cpus, new_cpus, num_cpus * sizeof(struct cpu_info));
+			memcpy(old_cpu_seen, new_cpu_seen, num_cpus);
+		}
 		//sleep(delay);
-		switch(select(STDIN_FILENO + 1, fdset, NULL, NULL, &delay_tv)) {
-			case -1:
+		while(1) {
+			// Events are handled as they come, while the exited processes can still be read
+			int n = 0;
+			FD_ZERO(&fdset);
+			if(use_tty) FD_SET(STDIN_FILENO, &fdset);
+			if(events_fd >= 0) {
+				FD_SET(events_fd, &fdset);
+				n = events_fd;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			wait_ms = (next.tv_sec - now.tv_sec) * 1000 + (next.tv_nsec - now.tv_nsec) / 1000000;
+			if(wait_ms < 0) wait_ms = 0;
+			delay_tv.tv_sec = wait_ms / 1000;
+			delay_tv.tv_usec = wait_ms % 1000 * 1000;
+			n = select((n > STDIN_FILENO ? n : STDIN_FILENO) + 1, &fdset, NULL, NULL, &delay_tv);
+			if(n < 0) {
+				if(errno == EINTR) continue;
 				perror("select");
 				return 1;
-			case 0:
-				break;
-			default:
-				if(use_tty) switch(getchar()) {
+			}
+			if(!n) break;
+			if(events_fd >= 0 && FD_ISSET(events_fd, &fdset)) read_events();
+			if(use_tty && FD_ISSET(STDIN_FILENO, &fdset)) {
+				switch(getchar()) {
 					case EOF:
 					case 'q':
 						iterations = 0;
 						break;
 				}
 				break;
+			}
 		}
+		if(timing) clock_gettime(CLOCK_MONOTONIC, &read_time);
 		read_procs();
-		print_procs();
-		free_old_procs();
+		if(record_format) record_procs();
+		else print_procs();
 	}
 	restore_terminal();
 	return 0;
@@ -305,234 +580,749 @@ static void free_proc(struct proc_info *proc) {
 	num_free_procs++;
 }
 
-#define MAX_LINE 256
+static void close_kept(int *fd) {
+	if(*fd >= 0) {
+		close(*fd);
+		kept_fds--;
+	}
+	*fd = NO_FD_KEPT;
+}
 
-static void read_procs(void) {
-	DIR *proc_dir, *task_dir;
-	struct dirent *pid_dir, *tid_dir;
-	char filename[64];
-	//FILE *file;
-	int proc_num;
-	struct proc_info *proc;
-	pid_t pid, tid;
+/* Out of fds all the same, with other files open: stop keeping some, and
+ * keep no more than are left from now on; returns how many were closed */
+static int release_kept_fds(void) {
+	unsigned int i;
+	int n = 0;
+	for(i = 0; sources && i <= source_mask && n < FD_HEADROOM; i++) {
+		struct proc_source *src;
+		for(src = sources[i]; src && n < FD_HEADROOM; src = src->next) {
+			if(src->stat_fd >= 0) {
+				close_kept(&src->stat_fd);
+				n++;
+			}
+			if(src->task_fd >= 0) {
+				close_kept(&src->task_fd);
+				n++;
+			}
+		}
+	}
+	if(kept_fd_limit > kept_fds) kept_fd_limit = kept_fds;
+	return n;
+}
 
-	int i;
+static int open_proc_path(const char *path, int flags) {
+	int fd = openat(proc_fd, path, flags);
+	if(fd < 0 && (errno == EMFILE || errno == ENFILE) && release_kept_fds()) fd = openat(proc_fd, path, flags);
+	return fd;
+}
 
-	proc_dir = opendir("/proc");
-	if(!proc_dir) die("Could not open /proc.\n");
+static int open_proc_file(const struct proc_source *src, const char *name) {
+	char path[64];
+	if(threads && src->tid) sprintf(path, "%d/task/%d/%s", (int)src->pid, (int)src->tid, name);
+	else sprintf(path, "%d/%s", (int)src->pid, name);
+	return open_proc_path(path, O_RDONLY);
+}
 
-	new_procs = calloc(INIT_PROCS * (threads ? THREAD_MULT : 1), sizeof(struct proc_info *));
-	num_new_procs = INIT_PROCS * (threads ? THREAD_MULT : 1);
-#ifdef __linux__
-	FILE *file = fopen("/proc/stat", "r");
-	if(!file) die("Could not open /proc/stat.\n");
-	fscanf(file, "cpu  %lu %lu %lu %lu %lu %lu %lu", &new_cpu.utime, &new_cpu.ntime, &new_cpu.stime,
-			&new_cpu.itime, &new_cpu.iowtime, &new_cpu.irqtime, &new_cpu.sirqtime);
-	fclose(file);
-#endif
-	proc_num = 0;
-	while((pid_dir = readdir(proc_dir))) {
-		if(!isdigit(pid_dir->d_name[0])) continue;
+/* Same as procfs_read_file, for files read only once */
+static ssize_t read_proc_file_once(const struct proc_source *src, const char *name, char *buf, size_t size) {
+	ssize_t len;
+	int fd = open_proc_file(src, name);
+	if(fd < 0) return -1;
+	len = procfs_read_file(fd, buf, size);
+	close(fd);
+	return len;
+}
 
-		pid = atoi(pid_dir->d_name);
+static unsigned int source_hash(pid_t pid, pid_t tid) {
+	return ((unsigned int)pid * 31 + (unsigned int)tid) & source_mask;
+}
 
-		struct proc_info cur_proc;
+static struct proc_source *find_source(pid_t pid, pid_t tid) {
+	struct proc_source *src;
+	if(!sources) return NULL;
+	for(src = sources[source_hash(pid, tid)]; src; src = src->next) {
+		if(src->pid == pid && src->tid == tid) return src;
+	}
+	return NULL;
+}
 
-		if(!threads) {
-			proc = alloc_proc();
-			proc->pid = proc->tid = pid;
+static struct proc_source *add_source(pid_t pid, pid_t tid) {
+	struct proc_source *src;
+	unsigned int i;
+	if(!sources || num_sources > source_mask) {
+		// Rehash into twice the buckets
+		unsigned int old_size = sources ? source_mask + 1 : 0;
+		struct proc_source **old = sources;
+		source_mask = old_size ? old_size * 2 - 1 : INIT_SOURCE_BUCKETS - 1;
+		sources = calloc(source_mask + 1, sizeof *sources);
+		if(!sources) die("Could not allocate process table.\n");
+		for(i = 0; i < old_size; i++) {
+			while(old[i]) {
+				struct proc_source *next = old[i]->next;
+				unsigned int h = source_hash(old[i]->pid, old[i]->tid);
+				old[i]->next = sources[h];
+				sources[h] = old[i];
+				old[i] = next;
+			}
+		}
+		free(old);
+	}
+	src = malloc(sizeof *src);
+	if(!src) die("Could not allocate process table.\n");
+	src->pid = pid;
+	src->tid = tid;
+	src->stat_fd = NO_FD;
+	src->task_fd = NO_FD;
+	src->generation = 0;
+	src->child_time = 0;
+	src->needs_info = 0;
+	src->uid = 0;
+	src->gid = 0;
+	src->pss = src->uss = src->swap = -1;
+	src->name[0] = 0;
+	i = source_hash(pid, tid);
+	src->next = sources[i];
+	sources[i] = src;
+	num_sources++;
+	return src;
+}
 
-			sprintf(filename, "/proc/%d/stat", (int)pid);
-			read_stat(filename, proc);
+static void drop_source(struct proc_source *src) {
+	struct proc_source **p = &sources[source_hash(src->pid, src->tid)];
+	while(*p != src) p = &(*p)->next;
+	*p = src->next;
+	close_kept(&src->stat_fd);
+	close_kept(&src->task_fd);
+	free(src);
+	num_sources--;
+}
 
-			sprintf(filename, "/proc/%d/cmdline", (int)pid);
-			read_cmdline(filename, proc);
+/* Forgets the processes that the last refresh didn't find */
+static void sweep_sources(void) {
+	unsigned int i;
+	for(i = 0; i <= source_mask && sources; i++) {
+		struct proc_source **p = &sources[i];
+		while(*p) {
+			struct proc_source *src = *p;
+			if(src->generation == generation) {
+				p = &src->next;
+				continue;
+			}
+			*p = src->next;
+			close_kept(&src->stat_fd);
+			close_kept(&src->task_fd);
+			free(src);
+			num_sources--;
+		}
+	}
+}
 
-			sprintf(filename, "/proc/%d/status", (int)pid);
-			read_status(filename, proc);
+#ifdef __linux__
+static void scan_cpu_info(const char **p, struct cpu_info *cpu) {
+	cpu->utime = procfs_scan_ulong(p);
+	cpu->ntime = procfs_scan_ulong(p);
+	cpu->stime = procfs_scan_ulong(p);
+	cpu->itime = procfs_scan_ulong(p);
+	cpu->iowtime = procfs_scan_ulong(p);
+	cpu->irqtime = procfs_scan_ulong(p);
+	cpu->sirqtime = procfs_scan_ulong(p);
+}
+#endif
 
-			//read_policy(pid, proc);
+static void read_cpu_stat(void) {
+#ifdef __linux__
+	static char *buf;
+	static size_t size;
+	const char *p;
+	if(!buf) {
+		// Enough for the cpu lines; the rest of the file isn't needed
+		size = per_cpu ? (num_cpus + 1) * CPU_LINE_SIZE : STAT_BUF_SIZE;
+		buf = malloc(size);
+		if(!buf) die("Could not allocate buffer for /proc/stat.\n");
+	}
+	if(cpu_stat_fd < 0 && (cpu_stat_fd = open("/proc/stat", O_RDONLY)) < 0) die("Could not open /proc/stat.\n");
+	if(procfs_read_file(cpu_stat_fd, buf, size) < 0) die("Could not read /proc/stat.\n");
+	if(strncmp(buf, "cpu ", 4)) return;
+	p = buf + 4;
+	scan_cpu_info(&p, &new_cpu);
+	if(!per_cpu) return;
+	memset(new_cpu_seen, 0, num_cpus);
+	while((p = strchr(p, '\n')) && strncmp(++p, "cpu", 3) == 0 && isdigit(p[3])) {
+		unsigned long int n;
+		p += 3;
+		n = procfs_scan_ulong(&p);
+		if(n >= (unsigned long int)num_cpus) continue;
+		scan_cpu_info(&p, &new_cpus[n]);
+		new_cpu_seen[n] = 1;
+	}
+#endif
+}
 
-			proc->num_threads = 0;
-		} else {
-			sprintf(filename, "/proc/%d/cmdline", (int)pid);
-			read_cmdline(filename, &cur_proc);
+/* Refreshes proc from the source's stat file; returns -1 if the task is gone */
+static int refresh_source(pid_t pid, pid_t tid, struct proc_info *proc) {
+	struct proc_source *src = find_source(pid, tid);
+	if(src && read_stat(src, proc) < 0) {
+		if(errno == EMFILE || errno == ENFILE) {
+			// Not gone, just not readable this time
+			src->generation = generation;
+			return -1;
+		}
+		// Gone, or exited and the pid reused since the last refresh
+		drop_source(src);
+		src = NULL;
+	}
+	if(!src) {
+		src = add_source(pid, tid);
+		if(read_stat(src, proc) < 0) {
+			drop_source(src);
+			return -1;
+		}
+		src->needs_info = 1;
+	}
+	if(src->needs_info) {
+		if(!threads) {
+			read_cmdline(src);
+			read_status(src);
+		}
+		src->needs_info = 0;
+	}
+	// Anything still in the table was seen by the previous refresh
+	if(src->generation == generation - 1) {
+		proc->delta_utime = proc->utime - src->utime;
+		proc->delta_stime = proc->stime - src->stime;
+	} else {
+		proc->delta_utime = 0;
+		proc->delta_stime = 0;
+	}
+	proc->delta_time = proc->delta_utime + proc->delta_stime + src->child_time;
+	src->child_time = 0;
+	src->utime = proc->utime;
+	src->stime = proc->stime;
+	src->generation = generation;
+	proc->pid = pid;
+	proc->tid = tid;
+	proc->pss = src->pss;
+	proc->uss = src->uss;
+	proc->swap = src->swap;
+	proc->src = src;
+	if(!threads) {
+		memcpy(proc->name, src->name, PROC_NAME_LEN);
+		proc->uid = src->uid;
+		proc->gid = src->gid;
+	}
+	return 0;
+}
 
-			sprintf(filename, "/proc/%d/status", (int)pid);
-			read_status(filename, &cur_proc);
+/* The process wide record in thread mode, with its task directory open */
+static struct proc_source *process_source(pid_t pid, int *is_new) {
+	struct proc_source *src = find_source(pid, 0);
+	char path[32];
+	*is_new = !src;
+	if(src) return src;
+	src = add_source(pid, 0);
+	sprintf(path, "%d/task", (int)pid);
+	src->task_fd = open_proc_path(path, O_RDONLY | O_DIRECTORY);
+	if(src->task_fd < 0) {
+		drop_source(src);
+		return NULL;
+	}
+	if(kept_fds < kept_fd_limit) kept_fds++;
+	else {
+		close(src->task_fd);
+		src->task_fd = NO_FD_KEPT;
+	}
+	read_cmdline(src);
+	read_status(src);
+	return src;
+}
 
-			proc = NULL;
+/* Adds the threads of the process; returns how many were found */
+static int read_tasks(struct proc_source *psrc, int *proc_num) {
+	static pid_t *tids;
+	static size_t tids_size;
+	ssize_t count, i;
+	if(psrc->task_fd < 0) {
+		char path[32];
+		int fd;
+		sprintf(path, "%d/task", (int)psrc->pid);
+		if((fd = open_proc_path(path, O_RDONLY | O_DIRECTORY)) < 0) return 0;
+		count = procfs_list(fd, &tids, &tids_size);
+		close(fd);
+	} else count = procfs_list(psrc->task_fd, &tids, &tids_size);
+	if(count < 0) return 0;
+	for(i = 0; i < count; i++) {
+		struct proc_info *proc = alloc_proc();
+		if(refresh_source(psrc->pid, tids[i], proc) < 0) {
+			free_proc(proc);
+			continue;
 		}
+		memcpy(proc->name, psrc->name, PROC_NAME_LEN);
+		proc->uid = psrc->uid;
+		proc->gid = psrc->gid;
+		add_proc((*proc_num)++, proc);
+	}
+	return count;
+}
 
-		sprintf(filename, "/proc/%d/task", (int)pid);
-		task_dir = opendir(filename);
-		if(!task_dir) continue;
+static void read_procs(void) {
+	int proc_num;
+	struct proc_info *proc;
+	pid_t pid;
+	static pid_t *pids;
+	static size_t pids_size;
+	ssize_t count;
 
-		while((tid_dir = readdir(task_dir))) {
-			if(!isdigit(tid_dir->d_name[0]))continue;
+	int i;
+	unsigned int j, n;
 
-			if(threads) {
-				tid = atoi(tid_dir->d_name);
+	if(proc_fd < 0 && (proc_fd = procfs_open()) < 0) die("Could not open /proc.\n");
+	generation++;
 
-				proc = alloc_proc();
-				proc->pid = pid; proc->tid = tid;
+	// The array and the entries are reused from the last refresh
+	for(i = 0; i < num_new_procs; i++) free_proc(new_procs[i]);
+	if(!new_procs) {
+		new_procs_size = INIT_PROCS * (threads ? THREAD_MULT : 1);
+		new_procs = malloc(new_procs_size * sizeof(struct proc_info *));
+		if(!new_procs) die("Could not allocate procs array.\n");
+	}
+	read_cpu_stat();
+	proc_num = 0;
 
-				sprintf(filename, "/proc/%d/task/%d/stat", (int)pid, (int)tid);
-				read_stat(filename, proc);
+	if(events_fd >= 0) read_events();
+	if(events_fd >= 0 && !events_lost && generation > 1) {
+		// The table already has every process; refreshing may drop some, so list them first
+		if(pids_size < num_sources) {
+			pids_size = num_sources * 2;
+			pids = realloc(pids, pids_size * sizeof *pids);
+			if(!pids) die("Could not allocate pid list.\n");
+		}
+		for(n = 0, j = 0; j <= source_mask; j++) {
+			struct proc_source *src;
+			for(src = sources[j]; src; src = src->next) pids[n++] = src->pid;
+		}
+		for(j = 0; j < n; j++) {
+			proc = alloc_proc();
+			if(refresh_source(pids[j], pids[j], proc) < 0) {
+				free_proc(proc);
+				continue;
+			}
+			add_proc(proc_num++, proc);
+		}
+		num_new_procs = proc_num;
+		return;
+	}
+	events_lost = 0;
 
-				//read_policy(tid, proc);
+	count = procfs_list(proc_fd, &pids, &pids_size);
+	if(count < 0) die("Could not read /proc.\n");
+	for(i = 0; i < count; i++) {
+		struct proc_source *psrc;
+		int is_new;
 
-				strcpy(proc->name, cur_proc.name);
-				proc->uid = cur_proc.uid;
-				proc->gid = cur_proc.gid;
+		pid = pids[i];
 
-				add_proc(proc_num++, proc);
-			} else {
-				proc->num_threads++;
+		if(!threads) {
+			proc = alloc_proc();
+			if(refresh_source(pid, pid, proc) < 0) {
+				free_proc(proc);
+				continue;
 			}
+			add_proc(proc_num++, proc);
+			continue;
 		}
 
-		closedir(task_dir);
-
-		if(!threads) add_proc(proc_num++, proc);
+		psrc = process_source(pid, &is_new);
+		if(!psrc) continue;
+		if(!read_tasks(psrc, &proc_num) && !is_new) {
+			// A process always has a thread; the directory belonged to an earlier one with that pid
+			drop_source(psrc);
+			psrc = process_source(pid, &is_new);
+			if(!psrc) continue;
+			read_tasks(psrc, &proc_num);
+		}
+		psrc->generation = generation;
 	}
 
-	for(i = proc_num; i < num_new_procs; i++) new_procs[i] = NULL;
+	num_new_procs = proc_num;
 
-	closedir(proc_dir);
+	sweep_sources();
 }
 
-static int read_stat(const char *filename, struct proc_info *proc) {
-	FILE *file;
-	char buf[MAX_LINE], *open_paren, *close_paren;
+static int read_stat(struct proc_source *src, struct proc_info *proc) {
+	static char buf[STAT_BUF_SIZE];
+	struct procfs_stat st;
+	ssize_t len;
+	size_t name_len;
 
-	file = fopen(filename, "r");
-	if(!file) return -1;
-	char *p = fgets(buf, MAX_LINE, file);
-	fclose(file);
-	if(!p) return -1;
+	if(src->stat_fd == NO_FD && kept_fds < kept_fd_limit) {
+		if((src->stat_fd = open_proc_file(src, "stat")) < 0) return -1;
+		kept_fds++;
+	}
+	if(src->stat_fd < 0) len = read_proc_file_once(src, "stat", buf, sizeof buf);
+	else len = procfs_read_file(src->stat_fd, buf, sizeof buf);
+	if(len <= 0) {
+		if(!len) errno = ESRCH;
+		return -1;
+	}
 
-	/* Split at first '(' and last ')' to get process name. */
-	open_paren = strchr(buf, '(');
-	close_paren = strrchr(buf, ')');
-	if(!open_paren || !close_paren) return -1;
+	if(procfs_parse_stat(buf, &st) < 0) {
+		errno = ESRCH;
+		return -1;
+	}
 
-	*open_paren = *close_paren = '\0';
-	strncpy(proc->tname, open_paren + 1, THREAD_NAME_LEN);
-	proc->tname[THREAD_NAME_LEN-1] = 0;
+	name_len = st.comm_len;
+	if(name_len >= THREAD_NAME_LEN) name_len = THREAD_NAME_LEN - 1;
+	memcpy(proc->tname, st.comm, name_len);
+	proc->tname[name_len] = 0;
 
-	/* Scan rest of string. */
-	sscanf(close_paren + 1, " %c %*d %*d %*d %*d %*d %*d %*d %*d %*d %*d "
-			"%lu %lu %*d %*d %*d %*d %*d %*d %*d %lu %lu "
-			"%*d %*d %*d %*d %*d %*d %*d %*d %*d %*d %*d %*d %*d %*d %d",
-			&proc->state, &proc->utime, &proc->stime, &proc->vss, &proc->rss, &proc->prs);
+	proc->state = st.state;
+	proc->ppid = st.ppid;
+	proc->utime = st.utime;
+	proc->stime = st.stime;
+	proc->num_threads = st.num_threads;
+	proc->vss = st.vsize;
+	proc->rss = st.rss;
+	proc->prs = st.processor;
 
 	return 0;
 }
 
 static void add_proc(int proc_num, struct proc_info *proc) {
-	int i;
-
-	if (proc_num >= num_new_procs) {
-		new_procs = realloc(new_procs, 2 * num_new_procs * sizeof(struct proc_info *));
+	if (proc_num >= new_procs_size) {
+		new_procs = realloc(new_procs, 2 * new_procs_size * sizeof(struct proc_info *));
 		if(!new_procs) die("Could not expand procs array.\n");
-		for(i = num_new_procs; i < 2 * num_new_procs; i++) new_procs[i] = NULL;
-		num_new_procs = 2 * num_new_procs;
+		new_procs_size = 2 * new_procs_size;
 	}
 	new_procs[proc_num] = proc;
 }
 
-static int read_cmdline(const char *filename, struct proc_info *proc) {
-	FILE *file;
-	char line[MAX_LINE];
+static void read_cmdline(struct proc_source *src) {
+	ssize_t len = read_proc_file_once(src, "cmdline", src->name, PROC_NAME_LEN);
+	if(len < 0) src->name[0] = 0;
+}
 
-	line[0] = 0;
-	file = fopen(filename, "r");
-	if(!file) return -1;
-	if(fgets(line, MAX_LINE, file) && strlen(line) > 0) {
-		strncpy(proc->name, line, PROC_NAME_LEN);
-		proc->name[PROC_NAME_LEN-1] = 0;
-	} else proc->name[0] = 0;
-	fclose(file);
-	return 0;
+static void read_status(struct proc_source *src) {
+	static char buf[STATUS_BUF_SIZE];
+	struct procfs_status st;
+	if(read_proc_file_once(src, "status", buf, sizeof buf) < 0) return;
+	if(procfs_parse_status(buf, &st) < 0) return;
+	src->uid = st.uid;
+	src->gid = st.gid;
+}
+
+static void open_events(void) {
+#ifdef PROC_CONNECTOR
+	struct sockaddr_nl addr;
+	enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+	char req[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof op)];
+	struct nlmsghdr *nlh = (struct nlmsghdr *)req;
+	struct cn_msg *msg = NLMSG_DATA(nlh);
+	int size = 1 << 20;
+
+	events_fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if(events_fd < 0) return;
+	// Room for a burst of forks between two refreshes
+	setsockopt(events_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+	memset(&addr, 0, sizeof addr);
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = CN_IDX_PROC;
+	memset(req, 0, sizeof req);
+	nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof op);
+	nlh->nlmsg_type = NLMSG_DONE;
+	msg->id.idx = CN_IDX_PROC;
+	msg->id.val = CN_VAL_PROC;
+	msg->len = sizeof op;
+	memcpy(msg->data, &op, sizeof op);
+	// Needs privileges, and a kernel with CONFIG_PROC_EVENTS; otherwise just scan /proc
+	if(bind(events_fd, (struct sockaddr *)&addr, sizeof addr) < 0 || send(events_fd, req, nlh->nlmsg_len, 0) < 0) {
+		close(events_fd);
+		events_fd = -1;
+	}
+#endif
 }
 
-static int read_status(const char *filename, struct proc_info *proc) {
-	FILE *file;
-	char line[MAX_LINE];
-	unsigned int uid, gid;
+#ifdef PROC_CONNECTOR
+/* Takes an exited process out of the table, giving the time it used since
+ * the last refresh to its parent */
+static void process_exited(struct proc_source *src) {
+	struct proc_info proc;
+	int seen = src->generation && src->generation == generation;
+	if(!seen) num_short_lived++;
+	if(read_stat(src, &proc) == 0) {
+		struct proc_source *parent = find_source(proc.ppid, proc.ppid);
+		unsigned long int used = proc.utime + proc.stime;
+		if(seen) used -= src->utime + src->stime;
+		exited_time += used;
+		// Along with what its own exited children left to it
+		if(parent) parent->child_time += used + src->child_time;
+	} else num_missed++;
+	drop_source(src);
+}
+#endif
 
-	file = fopen(filename, "r");
-	if(!file) return -1;
-	while(fgets(line, MAX_LINE, file)) {
-		sscanf(line, "Uid: %u", &uid);
-		sscanf(line, "Gid: %u", &gid);
+static void read_events(void) {
+#ifdef PROC_CONNECTOR
+	union {
+		struct nlmsghdr nlh;
+		char buf[8192];
+	} u;
+	ssize_t len;
+	while(1) {
+		struct nlmsghdr *nlh;
+		len = recv(events_fd, &u, sizeof u, 0);
+		if(len < 0) {
+			if(errno == EINTR) continue;
+			// The socket overflowed; the next refresh lists /proc again
+			if(errno == ENOBUFS) {
+				events_lost = 1;
+				continue;
+			}
+			break;
+		}
+		for(nlh = &u.nlh; NLMSG_OK(nlh, (size_t)len); nlh = NLMSG_NEXT(nlh, len)) {
+			struct cn_msg *msg = NLMSG_DATA(nlh);
+			struct proc_event *ev = (struct proc_event *)msg->data;
+			struct proc_source *src;
+			pid_t pid;
+			if(nlh->nlmsg_type != NLMSG_DONE || msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC) continue;
+			switch(ev->what) {
+				case PROC_EVENT_FORK:
+					pid = ev->event_data.fork.child_pid;
+					if(pid != ev->event_data.fork.child_tgid) break;
+					num_forks++;
+					if(!find_source(pid, pid)) add_source(pid, pid)->needs_info = 1;
+					break;
+				case PROC_EVENT_EXEC:
+					pid = ev->event_data.exec.process_pid;
+					if(pid != ev->event_data.exec.process_tgid) break;
+					if((src = find_source(pid, pid))) src->needs_info = 1;
+					break;
+				case PROC_EVENT_EXIT:
+					pid = ev->event_data.exit.process_pid;
+					if(pid != ev->event_data.exit.process_tgid) break;
+					num_exits++;
+					if((src = find_source(pid, pid))) process_exited(src);
+					break;
+				default:
+					break;
+			}
+		}
 	}
-	fclose(file);
-	proc->uid = uid; proc->gid = gid;
-	return 0;
+#endif
+}
+
+static void read_smaps(struct proc_source *src) {
+	static char buf[SMAPS_BUF_SIZE];
+	const char *p;
+	ssize_t len = read_proc_file_once(src, "smaps_rollup", buf, sizeof buf);
+	src->pss = src->uss = src->swap = -1;
+	if(len < 0) return;
+	// Kernel threads have no mappings, and an empty file
+	src->pss = src->uss = src->swap = 0;
+	for(p = buf; p; p = strchr(p, '\n')) {
+		if(*p == '\n') p++;
+		if(strncmp(p, "Pss:", 4) == 0) {
+			p += 4;
+			src->pss = procfs_scan_ulong(&p);
+		} else if(strncmp(p, "Private_Clean:", 14) == 0 || strncmp(p, "Private_Dirty:", 14) == 0) {
+			p += 14;
+			src->uss += procfs_scan_ulong(&p);
+		} else if(strncmp(p, "Swap:", 5) == 0) {
+			p += 5;
+			src->swap = procfs_scan_ulong(&p);
+		}
+	}
+}
+
+/* Rereads smaps_rollup for the count largest processes by RSS, if the
+ * last read was mem_delay_ms or longer ago */
+static void refresh_memory(int count) {
+	int (*cmp)(const void *, const void *) = proc_cmp;
+	struct timespec now;
+	int i;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if((mem_time.tv_sec || mem_time.tv_nsec) && (now.tv_sec - mem_time.tv_sec) * 1000 + (now.tv_nsec - mem_time.tv_nsec) / 1000000 < mem_delay_ms) return;
+	mem_time = now;
+	if(count < 0) count = MEM_PROCS_DEFAULT;
+	if(count > num_new_procs) count = num_new_procs;
+	proc_cmp = &proc_rss_cmp;
+	select_procs(count);
+	proc_cmp = cmp;
+	mem_procs = count;
+	mem_pss = mem_uss = mem_swap = 0;
+	for(i = 0; i < count; i++) {
+		struct proc_info *proc = new_procs[i];
+		read_smaps(proc->src);
+		proc->pss = proc->src->pss;
+		proc->uss = proc->src->uss;
+		proc->swap = proc->src->swap;
+		if(proc->pss < 0) continue;
+		mem_pss += proc->pss;
+		mem_uss += proc->uss;
+		mem_swap += proc->swap;
+	}
+}
+
+/* Right aligned in 9 columns, like the other memory sizes */
+static const char *kib_str(long int kib, char *buf) {
+	if(kib < 0) strcpy(buf, "        -");
+	else sprintf(buf, "%7ldKi", kib);
+	return buf;
+}
+
+static unsigned long int cpu_delta(void) {
+	unsigned long int total = (new_cpu.utime + new_cpu.ntime + new_cpu.stime + new_cpu.itime + new_cpu.iowtime + new_cpu.irqtime + new_cpu.sirqtime) -
+		(old_cpu.utime + old_cpu.ntime + old_cpu.stime + old_cpu.itime + old_cpu.iowtime + old_cpu.irqtime + old_cpu.sirqtime);
+	// Refreshes can come within a single clock tick
+	return total ? total : 1;
+}
+
+static void frame_begin(void) {
+	if(sz.ws_row != frame_rows || sz.ws_col != frame_cols) {
+		// Resized; everything is drawn again
+		frame_rows = sz.ws_row;
+		frame_cols = sz.ws_col;
+		free(frame);
+		free(shadow);
+		free(frame_attr);
+		free(shadow_attr);
+		frame = malloc(frame_rows * frame_cols + 1);
+		shadow = malloc(frame_rows * frame_cols + 1);
+		frame_attr = malloc(frame_rows + 1);
+		shadow_attr = malloc(frame_rows + 1);
+		if(!frame || !shadow || !frame_attr || !shadow_attr) die("Could not allocate screen buffer.\n");
+		shadow_valid = 0;
+	}
+	frame_row = 0;
+}
+
+/* Sets the next row, cut or padded with spaces to the width */
+static void frame_line(const char *text, int highlight) {
+	char *line;
+	size_t len;
+	if(frame_row >= frame_rows) return;
+	line = frame + frame_row * frame_cols;
+	len = strlen(text);
+	if(len > (size_t)frame_cols) len = frame_cols;
+	memcpy(line, text, len);
+	memset(line + len, ' ', frame_cols - len);
+	frame_attr[frame_row++] = highlight;
+}
+
+static void out_append(const char *s, size_t len) {
+	if(out_len + len > out_size) {
+		out_size = (out_len + len) * 2;
+		out_buf = realloc(out_buf, out_size);
+		if(!out_buf) die("Could not allocate output buffer.\n");
+	}
+	memcpy(out_buf + out_len, s, len);
+	out_len += len;
+}
+
+/* Sends the difference between the frame and the shadow, then swaps them */
+static void frame_flush(void) {
+	char pos[32], *t;
+	size_t done;
+	ssize_t n;
+	int r;
+
+	while(frame_row < frame_rows) frame_line("", 0);
+	out_len = 0;
+	// Hide the cursor and start from a clear screen
+	if(!shadow_valid) out_append("\x1b[?25l\x1b[H\x1b[2J", 13);
+	for(r = 0; r < frame_rows; r++) {
+		const char *new_line = frame + r * frame_cols, *old_line = shadow + r * frame_cols;
+		int first = 0, last = frame_cols, blank = frame_cols;
+		if(shadow_valid && shadow_attr[r] == frame_attr[r]) {
+			if(memcmp(new_line, old_line, frame_cols) == 0) continue;
+			while(new_line[first] == old_line[first]) first++;
+			while(new_line[last - 1] == old_line[last - 1]) last--;
+		}
+		// Blanks through the end of the line are erased, not written
+		if(!frame_attr[r]) {
+			while(blank > first && new_line[blank - 1] == ' ') blank--;
+			if(!shadow_valid && !blank) continue;
+		}
+		out_append(pos, sprintf(pos, "\x1b[%d;%dH", r + 1, first + 1));
+		if(frame_attr[r]) out_append("\x1b[30;47m", 8);
+		if(blank < last) {
+			out_append(new_line + first, blank - first);
+			out_append("\x1b[K", 3);
+		} else out_append(new_line + first, last - first);
+		if(frame_attr[r]) out_append("\x1b[39;49m", 8);
+	}
+	t = frame;
+	frame = shadow;
+	shadow = t;
+	t = (char *)frame_attr;
+	frame_attr = shadow_attr;
+	shadow_attr = (unsigned char *)t;
+	shadow_valid = 1;
+
+	for(done = 0; done < out_len; done += n) {
+		n = write(STDOUT_FILENO, out_buf + done, out_len - done);
+		if(n < 0) {
+			if(errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			// The terminal no longer shows what the shadow says
+			shadow_valid = 0;
+			break;
+		}
+	}
+	last_frame_bytes = out_len;
+	total_frame_bytes += out_len;
+	num_frames++;
 }
 
 static void print_procs(void) {
 	int i;
-	struct proc_info *old_proc, *proc;
+	struct proc_info *proc;
 	unsigned long int total_delta_time;
+	struct timespec now;
 	struct passwd *user;
 	//struct group *group;
-	char *user_str, user_buf[20], buf[4096];
+	char *user_str, user_buf[20], buf[4096], cpus_buf[16], mem_buf[64];
+	char pss_buf[24], uss_buf[24], swap_buf[24];
 	//char *group_str, group_buf[20];
 	int current_max_processes = max_procs;
+	int extra_lines;
 
 	if(use_tty) {
 		/* ANSI/VT100 Terminal Support */
 
-		/* Clear the screen */
-		printf("\x1b[1J");
-		
-		/* Save screen */
-		//printf("\x1b[?47h");
-
-		/* Home-positioning to 0 and 0 coordinates */
-		printf("\x1b[1;1H");
-
-		/* Save current cursor position */
-		// But some terminals doesn't support this...
-		//printf("\x1b[7");
-
-		/* Switch cursor invisible */
-		printf("\x1b[?25l");
-
-		/* Clear whole line (cursor position unchanged) */
-		printf("\x1b[2K");
-
 		if(ioctl(0, TIOCGWINSZ, &sz) == -1) {
 			perror("Could not get Terminal window size");
 			return;
 		}
-		if(max_procs == -1 || max_procs > sz.ws_row - 3) {
+		frame_begin();
+		extra_lines = 3 + timing + memory + (events_fd >= 0);
+#ifdef __linux__
+		if(per_cpu) extra_lines += print_cpus(sz.ws_col, 1);
+#endif
+		if(max_procs == -1 || max_procs > sz.ws_row - extra_lines) {
 			/* To change the max proc row, when terminal size change */
-			current_max_processes = sz.ws_row - 3;
+			current_max_processes = sz.ws_row - extra_lines;
 		}
 	}
 
-	for (i = 0; i < num_new_procs; i++) {
-		if (new_procs[i]) {
-			old_proc = find_old_proc(new_procs[i]->pid, new_procs[i]->tid);
-			if (old_proc) {
-				new_procs[i]->delta_utime = new_procs[i]->utime - old_proc->utime;
-				new_procs[i]->delta_stime = new_procs[i]->stime - old_proc->stime;
-			} else {
-				new_procs[i]->delta_utime = 0;
-				new_procs[i]->delta_stime = 0;
-			}
-			new_procs[i]->delta_time = new_procs[i]->delta_utime + new_procs[i]->delta_stime;
-		}
+	if(timing) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		read_time.tv_sec = now.tv_sec - read_time.tv_sec;
+		read_time.tv_nsec = now.tv_nsec - read_time.tv_nsec;
+		sort_time = now;
 	}
 
-	total_delta_time = (new_cpu.utime + new_cpu.ntime + new_cpu.stime + new_cpu.itime + new_cpu.iowtime + new_cpu.irqtime + new_cpu.sirqtime) -
-		(old_cpu.utime + old_cpu.ntime + old_cpu.stime + old_cpu.itime + old_cpu.iowtime + old_cpu.irqtime + old_cpu.sirqtime);
+	total_delta_time = cpu_delta();
 
-	qsort(new_procs, num_new_procs, sizeof(struct proc_info *), proc_cmp);
+	if(memory) refresh_memory(current_max_processes);
+	select_procs(current_max_processes);
+	if(timing) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		sort_time.tv_sec = now.tv_sec - sort_time.tv_sec;
+		sort_time.tv_nsec = now.tv_nsec - sort_time.tv_nsec;
+	}
 
 	//printf("\n\n\n");
 	if(!use_tty) putchar('\n');
@@ -545,7 +1335,7 @@ static void print_procs(void) {
 			((new_cpu.irqtime + new_cpu.sirqtime)
 			 - (old_cpu.irqtime + old_cpu.sirqtime)) * 100 / total_delta_time);
 	PRINT_BUF();
-	putchar('\n');
+	END_LINE();
 	snprintf(buf, sizeof(buf), "User %ld + Nice %ld + Sys %ld + Idle %ld + IOW %ld + IRQ %ld + SIRQ %ld = %ld",
 			new_cpu.utime - old_cpu.utime,
 			new_cpu.ntime - old_cpu.ntime,
@@ -556,23 +1346,50 @@ static void print_procs(void) {
 			new_cpu.sirqtime - old_cpu.sirqtime,
 			total_delta_time);
 	PRINT_BUF();
-	putchar('\n');
+	END_LINE();
+	if(per_cpu) print_cpus(use_tty ? sz.ws_col : CPU_BATCH_WIDTH, 0);
 #endif
+	if(memory) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		snprintf(buf, sizeof(buf), "PSS %ldKi, USS %ldKi, Swap %ldKi in the %d largest by RSS, as of %.1f s ago",
+			mem_pss, mem_uss, mem_swap, mem_procs,
+			(now.tv_sec - mem_time.tv_sec) + (now.tv_nsec - mem_time.tv_nsec) / 1e9);
+		PRINT_BUF();
+		END_LINE();
+	}
+	if(events_fd >= 0) {
+		snprintf(buf, sizeof(buf), "Forks %u, exits %u, %u of them short-lived, %lu ticks of exited processes given to their parents, %u missed",
+			num_forks, num_exits, num_short_lived, exited_time, num_missed);
+		PRINT_BUF();
+		END_LINE();
+	}
+	if(timing) {
+		i = snprintf(buf, sizeof(buf), "Read %d entries in %.3f ms, sorted in %.3f ms",
+			num_new_procs, read_time.tv_sec * 1e3 + read_time.tv_nsec / 1e6,
+			sort_time.tv_sec * 1e3 + sort_time.tv_nsec / 1e6);
+		if(use_tty && num_frames) {
+			snprintf(buf + i, sizeof(buf) - i, ", last frame %lu bytes, %llu on average",
+				(unsigned long int)last_frame_bytes, total_frame_bytes / num_frames);
+		}
+		PRINT_BUF();
+		END_LINE();
+	}
 
 	if(!threads) {
-		snprintf(buf, sizeof(buf), "%5s %2s %4s %1s %5s %9s %9s %-8s %s", "PID", "PR", "CPU%", "S", "#THR", "VSS", "RSS", "USER", "COMMAND");
+		if(memory) snprintf(mem_buf, sizeof mem_buf, "%9s %9s %9s %9s", "RSS", "PSS", "USS", "SWAP");
+		else snprintf(mem_buf, sizeof mem_buf, "%9s %9s", "VSS", "RSS");
+		snprintf(buf, sizeof(buf), "%5s %2s %s%4s %1s %5s %s %-8s %s", "PID", "PR", per_cpu ? "CPUS      " : "", "CPU%", "S", "#THR", mem_buf, "USER", "COMMAND");
 	} else {
-		snprintf(buf, sizeof(buf), "%5s %5s %2s %4s %1s %9s %9s %-8s %-15s %s", "PID", "TID", "PR", "CPU%", "S", "VSS", "RSS", "USER", "Thread", "Proc");
+		snprintf(buf, sizeof(buf), "%5s %5s %2s %s%4s %1s %9s %9s %-8s %-15s %s", "PID", "TID", "PR", per_cpu ? "CPUS      " : "", "CPU%", "S", "VSS", "RSS", "USER", "Thread", "Proc");
 	}
-	if(use_tty) printf("\x1b[30;47m");
-	PRINT_BUF();
-	if(use_tty) printf("\x1b[39;49m");
+	if(use_tty) frame_line(buf, 1);
+	else fputs(buf, stdout);
 	// No new line for this line
 
 	for(i = 0; i < num_new_procs; i++) {
 		proc = new_procs[i];
 
-		if(!proc || (current_max_processes != -1 && (i >= current_max_processes))) break;
+		if(current_max_processes != -1 && (i >= current_max_processes)) break;
 		user = getpwuid(proc->uid);
 		//group = getgrgid(proc->gid);
 		if(user && user->pw_name) {
@@ -588,48 +1405,326 @@ static void print_procs(void) {
 		   snprintf(group_buf, 20, "%d", proc->gid);
 		   group_str = group_buf;
 		   }*/
-		putchar('\n');
+		END_LINE();
+		if(per_cpu) snprintf(cpus_buf, sizeof cpus_buf, "%-9s ", allowed_cpus(proc->tid, 9));
+		else cpus_buf[0] = 0;
 		if(!threads) {
-			snprintf(buf, sizeof(buf), "%5d %2d %3ld%% %c %5d %7luKi %7luKi %-8.8s %s", (int)proc->pid, proc->prs, proc->delta_time * 100 / total_delta_time, proc->state, proc->num_threads,
-				proc->vss / 1024, proc->rss * getpagesize() / 1024, user_str, *proc->name ? proc->name : proc->tname);
+			if(memory) {
+				snprintf(mem_buf, sizeof mem_buf, "%7luKi %s %s %s", proc->rss * getpagesize() / 1024,
+					kib_str(proc->pss, pss_buf), kib_str(proc->uss, uss_buf), kib_str(proc->swap, swap_buf));
+			} else snprintf(mem_buf, sizeof mem_buf, "%7luKi %7luKi", proc->vss / 1024, proc->rss * getpagesize() / 1024);
+			snprintf(buf, sizeof(buf), "%5d %2d %s%3ld%% %c %5d %s %-8.8s %s", (int)proc->pid, proc->prs, cpus_buf, proc->delta_time * 100 / total_delta_time, proc->state, proc->num_threads,
+				mem_buf, user_str, *proc->name ? proc->name : proc->tname);
 			PRINT_BUF();
 		} else {
-			snprintf(buf, sizeof(buf), "%5d %5d %2d %3ld%% %c %7luKi %7luKi %-8.8s %-15s %s", (int)proc->pid, (int)proc->tid, proc->prs, proc->delta_time * 100 / total_delta_time, proc->state,
+			snprintf(buf, sizeof(buf), "%5d %5d %2d %s%3ld%% %c %7luKi %7luKi %-8.8s %-15s %s", (int)proc->pid, (int)proc->tid, proc->prs, cpus_buf, proc->delta_time * 100 / total_delta_time, proc->state,
 				proc->vss / 1024, proc->rss * getpagesize() / 1024, user_str, proc->tname, proc->name);
 			PRINT_BUF();
 		}
 	}
-	fflush(stdout);
+	num_forks = num_exits = num_short_lived = num_missed = 0;
+	exited_time = 0;
 	if(use_tty) {
-		/* Restore current cursor position */
-		//printf("\x1b[8");
+		frame_flush();
 	} else {
 		putchar('\n');
+		fflush(stdout);
 	}
 }
 
-static struct proc_info *find_old_proc(pid_t pid, pid_t tid) {
-	int i;
+static int parse_columns(const char *list) {
+	while(*list) {
+		size_t len = strcspn(list, ",");
+		int col;
+		for(col = 0; col < NUM_COLUMNS; col++) {
+			if(strlen(column_names[col]) == len && strncmp(list, column_names[col], len) == 0) break;
+		}
+		if(col == NUM_COLUMNS || num_record_columns == NUM_COLUMNS) {
+			fprintf(stderr, "Invalid column \"%.*s\".\n", (int)len, list);
+			return -1;
+		}
+		record_columns[num_record_columns++] = col;
+		list += len;
+		if(*list) list++;
+	}
+	if(!num_record_columns) {
+		fprintf(stderr, "No columns to record.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Writes s as a JSON string, or as a CSV field quoted if it needs to be */
+static void record_string(const char *s) {
+	if(record_format == RECORD_JSON) {
+		putchar('"');
+		for(; *s; s++) {
+			if(*s == '"' || *s == '\\') {
+				putchar('\\');
+				putchar(*s);
+			} else if((unsigned char)*s < 0x20) printf("\\u%04x", *s);
+			else putchar(*s);
+		}
+		putchar('"');
+	} else if(strpbrk(s, ",\"\r\n")) {
+		putchar('"');
+		for(; *s; s++) {
+			if(*s == '"') putchar('"');
+			putchar(*s);
+		}
+		putchar('"');
+	} else fputs(s, stdout);
+}
+
+/* User and system time of this process so far */
+static long long int cpu_used_us(void) {
+	struct rusage ru;
+	if(getrusage(RUSAGE_SELF, &ru) < 0) return 0;
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static const char *user_name(uid_t uid) {
+	static uid_t last_uid = -1;
+	static char name[32];
+	struct passwd *user;
+	if(uid == last_uid) return name;
+	user = getpwuid(uid);
+	if(user && user->pw_name) snprintf(name, sizeof name, "%s", user->pw_name);
+	else snprintf(name, sizeof name, "%u", (unsigned int)uid);
+	last_uid = uid;
+	return name;
+}
 
-	for(i = 0; i < num_old_procs; i++) {
-		if(old_procs[i] && old_procs[i]->pid == pid && old_procs[i]->tid == tid) return old_procs[i];
+/* Writes one record per process, or per thread, for the sample just read */
+static void record_procs(void) {
+	unsigned long int total_delta_time = cpu_delta();
+	int page_kb = getpagesize() / 1024;
+	struct timespec now;
+	long long int used_us;
+	int i, j;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	// What this process spent since the last sample, reading and writing included
+	used_us = -self_us;
+	self_us = cpu_used_us();
+	used_us += self_us;
+
+	if(memory) refresh_memory(max_procs);
+	select_procs(max_procs);
+	for(i = 0; i < num_new_procs && (max_procs < 0 || i < max_procs); i++) {
+		struct proc_info *proc = new_procs[i];
+		if(record_format == RECORD_JSON) putchar('{');
+		for(j = 0; j < num_record_columns; j++) {
+			char state[2];
+			if(j) putchar(',');
+			if(record_format == RECORD_JSON) printf("\"%s\":", column_names[record_columns[j]]);
+			switch(record_columns[j]) {
+				case COL_TIME:
+					printf("%ld.%03ld", (long int)now.tv_sec, now.tv_nsec / 1000000);
+					break;
+				case COL_PID:
+					printf("%d", (int)proc->pid);
+					break;
+				case COL_TID:
+					printf("%d", (int)proc->tid);
+					break;
+				case COL_UID:
+					printf("%u", (unsigned int)proc->uid);
+					break;
+				case COL_USER:
+					record_string(user_name(proc->uid));
+					break;
+				case COL_NAME:
+					record_string(*proc->name ? proc->name : proc->tname);
+					break;
+				case COL_THREAD:
+					record_string(proc->tname);
+					break;
+				case COL_STATE:
+					state[0] = proc->state;
+					state[1] = 0;
+					record_string(state);
+					break;
+				case COL_CPU:
+					printf("%.1f", proc->delta_time * 100.0 / total_delta_time);
+					break;
+				case COL_TICKS:
+					printf("%lu", proc->delta_time);
+					break;
+				case COL_RSS:
+					printf("%lu", proc->rss * page_kb);
+					break;
+				case COL_VSS:
+					printf("%lu", proc->vss / 1024);
+					break;
+				case COL_PSS:
+				case COL_USS:
+				case COL_SWAP:
+					{
+						long int kib = record_columns[j] == COL_PSS ? proc->pss :
+							record_columns[j] == COL_USS ? proc->uss : proc->swap;
+						if(kib >= 0) printf("%ld", kib);
+						else if(record_format == RECORD_JSON) fputs("null", stdout);
+					}
+					break;
+				case COL_THR:
+					printf("%d", proc->num_threads);
+					break;
+				case COL_PRS:
+					printf("%d", proc->prs);
+					break;
+				case COL_CPUS:
+					record_string(allowed_cpus(proc->tid, 0));
+					break;
+				case COL_FORKS:
+					printf("%u", num_forks);
+					break;
+				case COL_EXITS:
+					printf("%u", num_exits);
+					break;
+				case COL_SHORT:
+					printf("%u", num_short_lived);
+					break;
+				case COL_SELF:
+					printf("%.3f", used_us / 1e3);
+					break;
+			}
+		}
+		if(record_format == RECORD_JSON) putchar('}');
+		putchar('\n');
 	}
+	fflush(stdout);
+	num_forks = num_exits = num_short_lived = num_missed = 0;
+	exited_time = 0;
+}
 
-	return NULL;
+#ifdef __linux__
+/* Prints a cell for each CPU online, as many to a line as fit in width;
+ * returns the number of lines, which is all it does if count_only is set */
+static int print_cpus(int width, int count_only) {
+	char buf[4096];
+	int cell_width = 0, per_line, online = 0, lines, n, col = 0;
+	for(n = 0; n < num_cpus; n++) online += old_cpu_seen[n] && new_cpu_seen[n];
+	if(!online) return 0;
+	// "cpuN" for the widest N, the busy percentage, and five more
+	cell_width = 3 + snprintf(buf, sizeof buf, "%d", num_cpus - 1) + 1 + 4 + 5 * 6;
+	per_line = (width + CPU_CELL_GAP) / (cell_width + CPU_CELL_GAP);
+	if(per_line < 1) per_line = 1;
+	lines = (online + per_line - 1) / per_line;
+	if(count_only) return lines;
+	buf[0] = 0;
+	for(n = 0; n < num_cpus; n++) {
+		const struct cpu_info *o = &old_cpus[n], *c = &new_cpus[n];
+		unsigned long int total, idle;
+		size_t len = strlen(buf);
+		if(!old_cpu_seen[n] || !new_cpu_seen[n]) continue;
+		total = (c->utime + c->ntime + c->stime + c->itime + c->iowtime + c->irqtime + c->sirqtime) -
+			(o->utime + o->ntime + o->stime + o->itime + o->iowtime + o->irqtime + o->sirqtime);
+		idle = c->itime - o->itime;
+		if(!total) total = idle = 1;
+		snprintf(buf + len, sizeof buf - len, "%*scpu%-*d %3lu%% us%3lu sy%3lu wa%3lu hi%3lu si%3lu",
+			col ? CPU_CELL_GAP : 0, "", cell_width - 3 - 1 - 4 - 5 * 6, n,
+			(total - idle) * 100 / total,
+			((c->utime + c->ntime) - (o->utime + o->ntime)) * 100 / total,
+			(c->stime - o->stime) * 100 / total,
+			(c->iowtime - o->iowtime) * 100 / total,
+			(c->irqtime - o->irqtime) * 100 / total,
+			(c->sirqtime - o->sirqtime) * 100 / total);
+		if(++col == per_line) {
+			PRINT_BUF();
+			END_LINE();
+			buf[0] = 0;
+			col = 0;
+		}
+	}
+	if(col) {
+		PRINT_BUF();
+		END_LINE();
+	}
+	return lines;
 }
+#endif
 
-static void free_old_procs(void) {
-	int i;
+/* The CPUs the task may run on as a list like 0-3,8, or all; if max_len
+ * isn't 0, a longer list is cut short and ends with a + */
+static const char *allowed_cpus(pid_t tid, size_t max_len) {
+#if defined __linux__ && defined SYS_sched_getaffinity
+	static unsigned long int *mask;
+	static size_t mask_size, size;
+	static char *buf;
+	const int bits = sizeof(unsigned long int) * 8;
+	size_t len = 0;
+	int n, count = 0;
+	if(!mask) {
+		mask_size = (num_cpus + bits - 1) / bits * sizeof(unsigned long int);
+		mask = malloc(mask_size);
+		size = num_cpus * 6 + 1;
+		buf = malloc(size);
+		if(!mask || !buf) die("Could not allocate CPU mask.\n");
+	}
+	// The kernel fills in only as much of the mask as it has CPUs for
+	memset(mask, 0, mask_size);
+	if(syscall(SYS_sched_getaffinity, tid, mask_size, mask) < 0) return "-";
+#define CPU_ALLOWED(N) (mask[(N) / bits] >> ((N) % bits) & 1)
+	for(n = 0; n < num_cpus; n++) count += CPU_ALLOWED(n);
+	if(count >= num_cpus) return "all";
+	buf[0] = 0;
+	for(n = 0; n < num_cpus; n++) {
+		int last = n;
+		if(!CPU_ALLOWED(n)) continue;
+		while(last + 1 < num_cpus && CPU_ALLOWED(last + 1)) last++;
+		if(last == n) len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", n);
+		else len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", n, last);
+		n = last;
+	}
+#undef CPU_ALLOWED
+	if(max_len && len > max_len) strcpy(buf + max_len - 1, "+");
+	return buf;
+#else
+	return "-";
+#endif
+}
 
-	for(i = 0; i < num_old_procs; i++) {
-		if(old_procs[i]) free_proc(old_procs[i]);
+static void sift_down(struct proc_info **heap, int i, int n) {
+	while(1) {
+		struct proc_info *t;
+		int c = 2 * i + 1;
+		if(c >= n) break;
+		if(c + 1 < n && proc_cmp(&heap[c + 1], &heap[c]) > 0) c++;
+		if(proc_cmp(&heap[c], &heap[i]) <= 0) break;
+		t = heap[i];
+		heap[i] = heap[c];
+		heap[c] = t;
+		i = c;
 	}
+}
 
-	free(old_procs);
+/* Sorts just the first count entries of new_procs into place, or all of
+ * them if count is -1, keeping the best ones seen in a heap */
+static void select_procs(int count) {
+	struct proc_info *t;
+	int i;
+
+	if(count < 0 || count >= num_new_procs) {
+		qsort(new_procs, num_new_procs, sizeof(struct proc_info *), proc_cmp);
+		return;
+	}
+	if(!count) return;
+	// The root is the one of them that would be shown last
+	for(i = count / 2 - 1; i >= 0; i--) sift_down(new_procs, i, count);
+	for(i = count; i < num_new_procs; i++) {
+		if(proc_cmp(&new_procs[i], &new_procs[0]) >= 0) continue;
+		t = new_procs[0];
+		new_procs[0] = new_procs[i];
+		new_procs[i] = t;
+		sift_down(new_procs, 0, count);
+	}
+	qsort(new_procs, count, sizeof(struct proc_info *), proc_cmp);
 }
 
 static int proc_cpu_cmp(const void *a, const void *b) {
 	struct proc_info *pa, *pb;
+	int r;
 
 	pa = *((struct proc_info **)a); pb = *((struct proc_info **)b);
 
@@ -637,11 +1732,13 @@ static int proc_cpu_cmp(const void *a, const void *b) {
 	if(!pa) return 1;
 	if(!pb) return -1;
 
-	return -numcmp(pa->delta_time, pb->delta_time);
+	r = -numcmp(pa->delta_time, pb->delta_time);
+	return r ? r : id_cmp(pa, pb);
 }
 
 static int proc_vss_cmp(const void *a, const void *b) {
 	struct proc_info *pa, *pb;
+	int r;
 
 	pa = *((struct proc_info **)a); pb = *((struct proc_info **)b);
 
@@ -649,11 +1746,13 @@ static int proc_vss_cmp(const void *a, const void *b) {
 	if(!pa) return 1;
 	if(!pb) return -1;
 
-	return -numcmp(pa->vss, pb->vss);
+	r = -numcmp(pa->vss, pb->vss);
+	return r ? r : id_cmp(pa, pb);
 }
 
 static int proc_rss_cmp(const void *a, const void *b) {
 	struct proc_info *pa, *pb;
+	int r;
 
 	pa = *((struct proc_info **)a); pb = *((struct proc_info **)b);
 
@@ -661,11 +1760,61 @@ static int proc_rss_cmp(const void *a, const void *b) {
 	if(!pa) return 1;
 	if(!pb) return -1;
 
-	return -numcmp(pa->rss, pb->rss);
+	r = -numcmp(pa->rss, pb->rss);
+	return r ? r : id_cmp(pa, pb);
 }
 
 static int proc_thr_cmp(const void *a, const void *b) {
 	struct proc_info *pa, *pb;
+	int r;
+
+	pa = *((struct proc_info **)a); pb = *((struct proc_info **)b);
+
+	if(!pa && !pb) return 0;
+	if(!pa) return 1;
+	if(!pb) return -1;
+
+	r = -numcmp(pa->num_threads, pb->num_threads);
+	return r ? r : id_cmp(pa, pb);
+}
+
+/* Ties go in pid order, so the rows picked don't depend on the selection */
+static int id_cmp(const struct proc_info *a, const struct proc_info *b) {
+	int r = numcmp(a->pid, b->pid);
+	return r ? r : numcmp(a->tid, b->tid);
+}
+
+static int proc_pss_cmp(const void *a, const void *b) {
+	struct proc_info *pa, *pb;
+	int r;
+
+	pa = *((struct proc_info **)a); pb = *((struct proc_info **)b);
+
+	if(!pa && !pb) return 0;
+	if(!pa) return 1;
+	if(!pb) return -1;
+
+	r = -numcmp(pa->pss, pb->pss);
+	return r ? r : id_cmp(pa, pb);
+}
+
+static int proc_uss_cmp(const void *a, const void *b) {
+	struct proc_info *pa, *pb;
+	int r;
+
+	pa = *((struct proc_info **)a); pb = *((struct proc_info **)b);
+
+	if(!pa && !pb) return 0;
+	if(!pa) return 1;
+	if(!pb) return -1;
+
+	r = -numcmp(pa->uss, pb->uss);
+	return r ? r : id_cmp(pa, pb);
+}
+
+static int proc_swap_cmp(const void *a, const void *b) {
+	struct proc_info *pa, *pb;
+	int r;
 
 	pa = *((struct proc_info **)a); pb = *((struct proc_info **)b);
 
@@ -673,7 +1822,8 @@ static int proc_thr_cmp(const void *a, const void *b) {
 	if(!pa) return 1;
 	if(!pb) return -1;
 
-	return -numcmp(pa->num_threads, pb->num_threads);
+	r = -numcmp(pa->swap, pb->swap);
+	return r ? r : id_cmp(pa, pb);
 }
 
 static int numcmp(long long int a, long long int b) {
@@ -683,14 +1833,26 @@ static int numcmp(long long int a, long long int b) {
 }
 
 static void usage(const char *name) {
-	fprintf(stderr, "Usage: %s [-m <max_procs>] [-n <iterations>] [-d <delay>] [-s <sort_column>] [-t] [-h]\n\n"
+	fprintf(stderr, "Usage: %s [-m <max_procs>] [-n <iterations>] [-d <delay>] [-s <sort_column>] [-t] [-P] [-M <delay>] [-T] [-o <format> [-c <columns>]] [-h]\n\n"
 		"	-b        Batch mode.\n"
 		"	-m <num>  Maximum number of processes to display.\n"
 		"	-n <num>  Updates to show before exiting.\n"
-		"	-d <num>  Seconds to wait between updates.\n"
-		"	-s <col>  Column to sort by (cpu,vss,rss,thr).\n"
+		"	-d <num>  Seconds to wait between updates, fractions allowed.\n"
+		"	-s <col>  Column to sort by (cpu,vss,rss,thr, or with -M pss,uss,swap).\n"
 		"	-t        Show threads instead of processes.\n"
-		"	-h        Display this help screen.\n\n", name);
+		"	-P        Show each CPU, and the CPUs each task may run on.\n"
+		"	-M <num>  Show PSS, USS and swap, read at most every num seconds for\n"
+		"	          the largest processes by RSS, as many as shown or %d.\n"
+		"	-T        Show how long each refresh takes.\n"
+		"	-o <fmt>  Record each update as csv or json lines instead.\n"
+		"	-c <cols> Columns to record, separated by commas, out of\n"
+		"	          time,pid,tid,uid,user,name,thread,state,cpu,ticks,rss,vss,pss,uss,\n"
+		"	          swap,thr,prs,cpus,forks,exits,short,self. cpu is in percent, the\n"
+		"	          memory sizes in KiB, prs is the CPU last run on, cpus those\n"
+		"	          allowed, forks and exits count processes since the last update,\n"
+		"	          short those that didn't live to see one, and self is the CPU\n"
+		"	          time in ms top itself used since the last update.\n"
+		"	-h        Display this help screen.\n\n", name, MEM_PROCS_DEFAULT);
 }
 
 static void SIGINT_handler(int signal) {